@@ -5175,12 +5175,22 @@ static uint16_t nvme_identify(NvmeCtrl *n, NvmeRequest *req)
 static uint16_t nvme_abort(NvmeCtrl *n, NvmeRequest *req)
 {
     uint16_t sqid = le32_to_cpu(req->cmd.cdw10) & 0xffff;
+    uint16_t cid = (le32_to_cpu(req->cmd.cdw10) >> 16) & 0xffff;
+    NvmeRequest *r;
 
     req->cqe.result = 1;
     if (nvme_check_sqid(n, sqid)) {
         return NVME_INVALID_FIELD | NVME_DNR;
     }
 
+    /* only pushed down queries can be stopped */
+    QTAILQ_FOREACH(r, &n->sq[sqid]->out_req_list, entry) {
+        if (le16_to_cpu(r->cmd.cid) == cid && nvme_kv_abort(n, r)) {
+            req->cqe.result = 0;
+            break;
+        }
+    }
+
     return NVME_SUCCESS;
 }
 
@@ -6294,6 +6304,8 @@ static void nvme_ctrl_reset(NvmeCtrl *n, NvmeResetType rst)
     NvmeNamespace *ns;
     int i;
 
+    nvme_kv_reset(n);
+
     for (i = 1; i <= NVME_MAX_NAMESPACES; i++) {
         ns = nvme_ns(n, i);
         if (!ns) {
@@ -7585,6 +7597,7 @@ static void nvme_exit(PCIDevice *pci_dev)
     NvmeNamespace *ns;
     int i;
 
+    nvme_kv_exit(n);
     nvme_ctrl_reset(n, NVME_RESET_FUNCTION);
 
     if (n->subsys) {
@@ -7768,6 +7781,7 @@ static void nvme_instance_init(Object *obj)
     object_property_add(obj, "smart_critical_warning", "uint8",
                         nvme_get_smart_warning,
                         nvme_set_smart_warning, NULL, NULL);
+    nvme_kv_instance_init(obj);
 }
 
 static const TypeInfo nvme_info = {
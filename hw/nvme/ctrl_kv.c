@@ -12,6 +12,10 @@
 #include "qemu/select-results.h"
 #include "qemu/kv-tasks.h"
 #include "qemu/kv_utils.h"
+#include "qemu/kv_value_cache.h"
+#include "qemu/query.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
 
 #include "nvme.h"
 
@@ -20,10 +24,128 @@
 static void nvme_kv_notifier(EventNotifier *e);
 
 void nvme_kv_init(NvmeCtrl *n) {
+    /* the workers store SELECT results */
+    select_results_init();
     event_notifier_init(&n->kv_notifier, 0);
     event_notifier_set_handler(&n->kv_notifier, nvme_kv_notifier);
-    kv_tasks_init(&n->kv_notifier); 
-    select_results_init();
+    n->kv_engine = kv_tasks_engine_new(&n->kv_notifier);
+}
+
+void nvme_kv_exit(NvmeCtrl *n) {
+    if (!n->kv_engine) {
+        return;
+    }
+    /* queries blocked on a stream nobody reads would never finish */
+    select_results_drop_streams(n);
+    /* let the in-flight commands finish so their guest mappings are released */
+    kv_tasks_engine_stop(n->kv_engine);
+    nvme_kv_notifier(&n->kv_notifier);
+    kv_tasks_engine_free(n->kv_engine);
+    n->kv_engine = NULL;
+    event_notifier_set_handler(&n->kv_notifier, NULL);
+    event_notifier_cleanup(&n->kv_notifier);
+}
+
+bool nvme_kv_abort(NvmeCtrl *n, NvmeRequest *req) {
+    if (!req->sq->sqid || req->cmd.opcode != NVME_CMD_KV_SEND_SELECT || !req->opaque) {
+        return false;
+    }
+    /* the command completes with Command Abort Requested once DuckDB returns */
+    query_cancel(req->opaque);
+    return true;
+}
+
+void nvme_kv_reset(NvmeCtrl *n) {
+    if (!n->kv_engine) {
+        return;
+    }
+    select_results_drop_streams(n);
+    /* cancels the SELECTs, whose commands complete with Command Abort
+     * Requested, and completes what is in flight while the queues still
+     * exist; the workers are kept
+     */
+    kv_tasks_engine_drain(n->kv_engine);
+    nvme_kv_notifier(&n->kv_notifier);
+}
+
+static void nvme_kv_get_value_cache_stat(Object *obj, Visitor *v, const char *name,
+                                         void *opaque, Error **errp) {
+    KvValueCacheStats stats;
+    uint64_t value;
+
+    kv_value_cache_get_stats(&stats);
+    value = *(uint64_t *)((char *)&stats + (uintptr_t)opaque);
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static void nvme_kv_get_query_pool_stat(Object *obj, Visitor *v, const char *name,
+                                        void *opaque, Error **errp) {
+    QueryPoolStats stats;
+    uint64_t value;
+
+    query_get_pool_stats(&stats);
+    value = *(uint64_t *)((char *)&stats + (uintptr_t)opaque);
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static void nvme_kv_set_query_pool_size(Object *obj, Visitor *v, const char *name,
+                                        void *opaque, Error **errp) {
+    uint64_t value;
+
+    if (!visit_type_uint64(v, name, &value, errp)) {
+        return;
+    }
+    if (!value || value > 256) {
+        error_setg(errp, "%s must be between 1 and 256", name);
+        return;
+    }
+    if (query_resize_pool(value)) {
+        error_setg(errp, "cannot resize the query connection pool to %" PRIu64, value);
+    }
+}
+
+/* the value cache and the query pool are shared by all controllers, so
+ * are their counters
+ */
+void nvme_kv_instance_init(Object *obj) {
+    static const struct {
+        const char *name;
+        size_t offset;
+    } stats[] = {
+        { "kv-value-cache-hits", offsetof(KvValueCacheStats, hits) },
+        { "kv-value-cache-misses", offsetof(KvValueCacheStats, misses) },
+        { "kv-value-cache-evictions", offsetof(KvValueCacheStats, evictions) },
+        { "kv-value-cache-entries", offsetof(KvValueCacheStats, entries) },
+        { "kv-value-cache-bytes", offsetof(KvValueCacheStats, bytes) },
+    };
+
+    static const struct {
+        const char *name;
+        size_t offset;
+    } pool_stats[] = {
+        { "kv-query-pool-acquisitions", offsetof(QueryPoolStats, acquisitions) },
+        { "kv-query-pool-waits", offsetof(QueryPoolStats, waits) },
+        { "kv-query-pool-wait-us", offsetof(QueryPoolStats, wait_us) },
+        { "kv-query-pool-max-wait-us", offsetof(QueryPoolStats, max_wait_us) },
+        { "kv-query-pool-open", offsetof(QueryPoolStats, open) },
+        { "kv-query-pool-busy", offsetof(QueryPoolStats, busy) },
+        { "kv-query-pool-waiting", offsetof(QueryPoolStats, waiting) },
+        { "kv-query-admission-waits", offsetof(QueryPoolStats, admission_waits) },
+        { "kv-query-admission-wait-us", offsetof(QueryPoolStats, admission_wait_us) },
+    };
+
+    for (int i = 0; i < ARRAY_SIZE(stats); i++) {
+        object_property_add(obj, stats[i].name, "uint64", nvme_kv_get_value_cache_stat,
+                            NULL, NULL, (void *)stats[i].offset);
+    }
+    for (int i = 0; i < ARRAY_SIZE(pool_stats); i++) {
+        object_property_add(obj, pool_stats[i].name, "uint64", nvme_kv_get_query_pool_stat,
+                            NULL, NULL, (void *)pool_stats[i].offset);
+    }
+    /* qom-set resizes the pool at runtime */
+    object_property_add(obj, "kv-query-pool-size", "uint64", nvme_kv_get_query_pool_stat,
+                        nvme_kv_set_query_pool_size, NULL,
+                        (void *)offsetof(QueryPoolStats, size));
 }
 
 static int nvme_kv_get_key(NvmeKvCmd *cmd, unsigned char *key_buf, size_t *key_len, bool empty_allowed) {
@@ -183,6 +305,65 @@ static size_t nvme_kv_read_data(NvmeRequest *req, unsigned char *buffer, size_t
     }
 }
 
+/* Maps the first len bytes of the data pointer of req so a worker thread
+ * can do its I/O directly from or into guest memory.  Returns NULL if some
+ * part can't be mapped in place (e.g. the bounce buffer for MMIO is busy),
+ * callers then copy through a buffer of their own instead.
+ */
+static struct iovec *nvme_kv_map_data(NvmeRequest *req, size_t len, DMADirection dir,
+                                      int *iov_count) {
+    GArray *iov = g_array_new(false, false, sizeof(struct iovec));
+
+    if (req->sg.flags & NVME_SG_DMA) {
+        QEMUSGList *qsg = &req->sg.qsg;
+        for (int i = 0; i < qsg->nsg && len; i++) {
+            dma_addr_t base = qsg->sg[i].base;
+            dma_addr_t sg_len = MIN(qsg->sg[i].len, len);
+            while (sg_len) {
+                dma_addr_t map_len = sg_len;
+                void *p = dma_memory_map(qsg->as, base, &map_len, dir, MEMTXATTRS_UNSPECIFIED);
+                if (!p) {
+                    for (guint j = 0; j < iov->len; j++) {
+                        struct iovec *v = &g_array_index(iov, struct iovec, j);
+                        dma_memory_unmap(qsg->as, v->iov_base, v->iov_len, dir, 0);
+                    }
+                    g_array_free(iov, true);
+                    return NULL;
+                }
+                struct iovec v = { .iov_base = p, .iov_len = map_len };
+                g_array_append_val(iov, v);
+                base += map_len;
+                sg_len -= map_len;
+                len -= map_len;
+            }
+        }
+    } else {
+        /* controller memory buffer, already host memory */
+        QEMUIOVector *qiov = &req->sg.iov;
+        for (int i = 0; i < qiov->niov && len; i++) {
+            struct iovec v = qiov->iov[i];
+            v.iov_len = MIN(v.iov_len, len);
+            g_array_append_val(iov, v);
+            len -= v.iov_len;
+        }
+    }
+    *iov_count = iov->len;
+    return (struct iovec *)g_array_free(iov, false);
+}
+
+/* access_len is how many bytes the device wrote for DMA_DIRECTION_FROM_DEVICE */
+static void nvme_kv_unmap_data(NvmeRequest *req, struct iovec *iov, int iov_count,
+                               DMADirection dir, size_t access_len) {
+    if (req->sg.flags & NVME_SG_DMA) {
+        for (int i = 0; i < iov_count; i++) {
+            size_t len = MIN(access_len, iov[i].iov_len);
+            dma_memory_unmap(req->sg.qsg.as, iov[i].iov_base, iov[i].iov_len, dir, len);
+            access_len -= len;
+        }
+    }
+    g_free(iov);
+}
+
 static uint16_t nvme_build_kv_list_response(ObjectKey *keys, size_t num_keys,
                                             unsigned char *list_buffer, size_t max_list_buffer_size,
                                             size_t *list_buffer_size) {
@@ -246,7 +427,7 @@ static uint16_t nvme_kv_list(NvmeCtrl *n, NvmeRequest *req) {
         return status | NVME_DNR;
     }
 
-    kv_tasks_add_request_with_params(KV_TASK_LIST, pci_dev_bus_num(&n->parent_obj), le32_to_cpu(req->cmd.nsid),
+    kv_tasks_add_request_with_params(n->kv_engine, KV_TASK_LIST, pci_dev_bus_num(&n->parent_obj), le32_to_cpu(req->cmd.nsid),
          req, key, key_length, NULL, 0, 0, false, false, false, 0, 0, 0, false, false);
 
     return NVME_NO_COMPLETE;
@@ -261,7 +442,7 @@ static uint16_t nvme_kv_exist(NvmeCtrl *n, NvmeRequest *req) {
         return NVME_INVALID_KV_SIZE | NVME_DNR;
     }
 
-    kv_tasks_add_request_with_params(KV_TASK_EXISTS, pci_dev_bus_num(&n->parent_obj),
+    kv_tasks_add_request_with_params(n->kv_engine, KV_TASK_EXISTS, pci_dev_bus_num(&n->parent_obj),
         le32_to_cpu(req->cmd.nsid),
        req, key, key_length, NULL, 0, 0, false, false, false, 0, 0, 0, false, false);
 
@@ -277,7 +458,7 @@ static uint16_t nvme_kv_delete(NvmeCtrl *n, NvmeRequest *req) {
         return NVME_INVALID_KV_SIZE | NVME_DNR;
     }
 
-    kv_tasks_add_request_with_params(KV_TASK_DELETE, pci_dev_bus_num(&n->parent_obj), le32_to_cpu(req->cmd.nsid),
+    kv_tasks_add_request_with_params(n->kv_engine, KV_TASK_DELETE, pci_dev_bus_num(&n->parent_obj), le32_to_cpu(req->cmd.nsid),
         req, key, key_length, NULL, 0, 0, false, false, false, 0, 0, 0, false, false);
 
     return NVME_NO_COMPLETE;
@@ -301,7 +482,30 @@ static uint16_t nvme_kv_store(NvmeCtrl *n, NvmeRequest *req) {
     if (status != NVME_SUCCESS) {
         return status | NVME_DNR;
     }
-    unsigned char *buffer = g_malloc0(value_size);
+
+    /* the worker writes the value straight from guest memory */
+    int iov_count;
+    struct iovec *iov = value_size ? nvme_kv_map_data(req, value_size, DMA_DIRECTION_TO_DEVICE,
+                                                      &iov_count) : NULL;
+    if (iov) {
+        kv_task_request *request = g_new0(kv_task_request, 1);
+        request->task_type = KV_TASK_STORE;
+        request->bus_number = pci_dev_bus_num(&n->parent_obj);
+        request->namespace_id = le32_to_cpu(req->cmd.nsid);
+        request->nvme_cmd = req;
+        memcpy(request->key, key, key_length);
+        request->key_length = key_length;
+        request->iov = iov;
+        request->iov_count = iov_count;
+        request->data_length = value_size;
+        request->must_exist = must_exist;
+        request->must_not_exist = must_not_exist;
+        request->append = append;
+        kv_tasks_add_request(n->kv_engine, request);
+        return NVME_NO_COMPLETE;
+    }
+
+    unsigned char *buffer = g_malloc(value_size);
     if (!buffer && value_size) {
         return NVME_KV_ERROR | NVME_DNR;
     }
@@ -309,8 +513,9 @@ static uint16_t nvme_kv_store(NvmeCtrl *n, NvmeRequest *req) {
     size_t bytes_read = nvme_kv_read_data(req, buffer, value_size);
     if (bytes_read != value_size) {
         // no error is returned if there is less data than host buffer size
+        memset(buffer + bytes_read, 0, value_size - bytes_read);
     }
-    kv_tasks_add_request_with_params(KV_TASK_STORE, pci_dev_bus_num(&n->parent_obj), le32_to_cpu(req->cmd.nsid),
+    kv_tasks_add_request_with_params(n->kv_engine, KV_TASK_STORE, pci_dev_bus_num(&n->parent_obj), le32_to_cpu(req->cmd.nsid),
        req, key, key_length, buffer, value_size, 0, must_exist, must_not_exist, append, 0, 0, 0, false, false);
 
     return NVME_NO_COMPLETE;
@@ -333,7 +538,27 @@ static uint16_t nvme_kv_retrieve(NvmeCtrl *n, NvmeRequest *req) {
         return status | NVME_DNR;
     }
 
-    kv_tasks_add_request_with_params(KV_TASK_RETRIEVE, pci_dev_bus_num(&n->parent_obj), le32_to_cpu(req->cmd.nsid),
+    /* the worker reads the object straight into guest memory */
+    int iov_count;
+    struct iovec *iov = max_len ? nvme_kv_map_data(req, max_len, DMA_DIRECTION_FROM_DEVICE,
+                                                   &iov_count) : NULL;
+    if (iov) {
+        kv_task_request *request = g_new0(kv_task_request, 1);
+        request->task_type = KV_TASK_RETRIEVE;
+        request->bus_number = pci_dev_bus_num(&n->parent_obj);
+        request->namespace_id = le32_to_cpu(req->cmd.nsid);
+        request->nvme_cmd = req;
+        memcpy(request->key, key, key_length);
+        request->key_length = key_length;
+        request->iov = iov;
+        request->iov_count = iov_count;
+        request->max_length = max_len;
+        request->offset = offset;
+        kv_tasks_add_request(n->kv_engine, request);
+        return NVME_NO_COMPLETE;
+    }
+
+    kv_tasks_add_request_with_params(n->kv_engine, KV_TASK_RETRIEVE, pci_dev_bus_num(&n->parent_obj), le32_to_cpu(req->cmd.nsid),
        req, key, key_length, NULL, 0, max_len, false, false, false, offset, 0, 0, false, false);
 
     return NVME_NO_COMPLETE;
@@ -348,6 +573,8 @@ static Query_Data_Type nvme_select_type_to_data_type(uint8_t select_type, bool *
             return QUERY_TYPE_JSON;
         case NVME_SELECT_TYPE_PARQUET:
             return QUERY_TYPE_PARQUET;
+        case NVME_SELECT_TYPE_ARROW:
+            return QUERY_TYPE_ARROW;
         default:
             *found = false;
             return QUERY_TYPE_CSV;
@@ -378,6 +605,10 @@ static uint16_t nvme_kv_send_select(NvmeCtrl *n, NvmeRequest *req) {
     uint8_t select_options = NVME_KV_GET_CMD_OPTIONS(kv->key_length_and_options);
     bool use_csv_headers_input = NVME_SELECT_CMD_OUTPUT_TYPE_USE_CSV_HEADERS_INPUT(select_options);
     bool use_csv_headers_output = NVME_SELECT_CMD_OUTPUT_TYPE_USE_CSV_HEADERS_OUTPUT(select_options);
+    bool select_into = NVME_SELECT_CMD_OPTION_INTO(select_options);
+    if (select_into && NVME_SELECT_CMD_OPTION_STREAM_OUTPUT(select_options)) {
+        return NVME_KV_INVALID_PARAMETER | NVME_DNR;
+    }
 
     size_t len = le32_to_cpu(kv->host_buffer_size);
     status = nvme_map_dptr(n, &req->sg, len, &req->cmd);
@@ -392,13 +623,112 @@ static uint16_t nvme_kv_send_select(NvmeCtrl *n, NvmeRequest *req) {
     size_t bytes_read = nvme_kv_read_data(req, buffer, len);
     buffer[bytes_read] = '\0';
 
-    kv_tasks_add_request_with_params(KV_TASK_SEND_SELECT, pci_dev_bus_num(&n->parent_obj), le32_to_cpu(req->cmd.nsid),
-        req, key, key_length, buffer, bytes_read + 1, 0, false, false, false, 0, input_type, output_type,
-        use_csv_headers_input, use_csv_headers_output);
+    unsigned char into_key[NVME_KV_MAX_LEN_LENGTH];
+    size_t into_key_length = 0;
+    if (select_into) {
+        into_key_length = bytes_read ? buffer[0] : 0;
+        if (!into_key_length || into_key_length > NVME_KV_MAX_LEN_LENGTH ||
+            into_key_length >= bytes_read) {
+            g_free(buffer);
+            return NVME_INVALID_KV_SIZE | NVME_DNR;
+        }
+        memcpy(into_key, buffer + 1, into_key_length);
+        /* the query follows the key */
+        bytes_read -= 1 + into_key_length;
+        memmove(buffer, buffer + 1 + into_key_length, bytes_read + 1);
+    }
+
+    kv_task_request *request = g_new0(kv_task_request, 1);
+    request->task_type = KV_TASK_SEND_SELECT;
+    request->bus_number = pci_dev_bus_num(&n->parent_obj);
+    request->namespace_id = le32_to_cpu(req->cmd.nsid);
+    memcpy(request->key, key, key_length);
+    request->key_length = key_length;
+    request->data = buffer;
+    request->data_length = bytes_read + 1;
+    request->select_input_type = input_type;
+    request->select_output_type = output_type;
+    request->use_csv_headers_input = use_csv_headers_input;
+    request->use_csv_headers_output = use_csv_headers_output;
+    request->select_key_prefix = NVME_SELECT_CMD_OPTION_KEY_PREFIX(select_options);
+    request->select_cancel = query_cancel_new(request->bus_number, request->namespace_id);
+    memcpy(request->select_into_key, into_key, into_key_length);
+    request->select_into_key_length = into_key_length;
+
+    if (NVME_SELECT_CMD_OPTION_STREAM_OUTPUT(select_options)) {
+        int stream_fd;
+        uint32_t results_id = select_results_new_stream(n, &stream_fd);
+        if (!results_id) {
+            g_free(buffer);
+            g_free(request->select_cancel);
+            g_free(request);
+            return NVME_KV_ERROR | NVME_DNR;
+        }
+        /* the command completes now, errors of the query show up when the
+         * stream is retrieved
+         */
+        request->select_id = results_id;
+        request->select_stream_fd = stream_fd;
+        kv_tasks_add_request(n->kv_engine, request);
+        req->cqe.result = cpu_to_le32(results_id);
+        return NVME_SUCCESS;
+    }
+
+    request->nvme_cmd = req;
+    /* for nvme_kv_abort() */
+    req->opaque = request->select_cancel;
+    kv_tasks_add_request(n->kv_engine, request);
 
     return NVME_NO_COMPLETE;
 }
 
+static void nvme_kv_select_stream_ready(void *opaque);
+
+/* returns the next chunk of a streamed result or waits for it */
+static uint16_t nvme_kv_read_select_stream(NvmeRequest *req) {
+    NvmeKvCmd *kv = (NvmeKvCmd *)&req->cmd;
+    size_t max_len = le32_to_cpu(kv->host_buffer_size);
+    size_t offset = le32_to_cpu(kv->read_offset);
+    bool more;
+
+    unsigned char *buffer = g_malloc(max_len);
+    ssize_t len = select_results_read_stream(kv->select_id, offset, buffer, max_len, &more);
+    if (!len && more && max_len) {
+        g_free(buffer);
+        if (!select_results_wait_stream(kv->select_id, nvme_kv_select_stream_ready, req)) {
+            return NVME_KV_NOT_FOUND | NVME_DNR;
+        }
+        return NVME_NO_COMPLETE;
+    }
+    if (len < 0) {
+        g_free(buffer);
+        if (len == KV_ERROR_FILE_NOT_FOUND) {
+            return NVME_KV_NOT_FOUND | NVME_DNR;
+        }
+        if (len == KV_ERROR_FILE_OFFSET) {
+            return NVME_KV_INVALID_PARAMETER | NVME_DNR;
+        }
+        return NVME_KV_ERROR | NVME_DNR;
+    }
+    nvme_kv_write_data(req, buffer, len);
+    g_free(buffer);
+
+    /* chunk size */
+    req->cqe.result = cpu_to_le32(len);
+    req->cqe.dw1 = cpu_to_le32(more ? NVME_SELECT_RETRIEVE_MORE_DATA : 0);
+    return NVME_SUCCESS;
+}
+
+static void nvme_kv_select_stream_ready(void *opaque) {
+    NvmeRequest *req = opaque;
+    uint16_t status = nvme_kv_read_select_stream(req);
+
+    if (status != NVME_NO_COMPLETE) {
+        req->status = status;
+        nvme_enqueue_req_completion(nvme_cq(req), req);
+    }
+}
+
 static uint16_t nvme_kv_retrieve_select(NvmeCtrl *n, NvmeRequest *req) {
     uint16_t status;
     
@@ -410,32 +740,40 @@ static uint16_t nvme_kv_retrieve_select(NvmeCtrl *n, NvmeRequest *req) {
     size_t offset = le32_to_cpu(kv->read_offset);
    
     uint32_t select_id = kv->select_id;
+    if (select_results_is_stream(select_id)) {
+        status = nvme_map_dptr(n, &req->sg, max_len, &req->cmd);
+        if (status != NVME_SUCCESS) {
+            return status | NVME_DNR;
+        }
+        return nvme_kv_read_select_stream(req);
+    }
+    GBytes *results;
     size_t results_len;
-    bool found;
-    unsigned char *results = select_results_retrieve(select_id, &results_len, do_not_free, do_not_free_if_not_all_data_fetched, max_len + offset, &found);
-    if (!found) {
+    int res = select_results_retrieve(select_id, offset, max_len, do_not_free,
+                                      do_not_free_if_not_all_data_fetched, &results, &results_len);
+    if (res == KV_ERROR_FILE_NOT_FOUND) {
         return  NVME_KV_NOT_FOUND | NVME_DNR;
     }
+    if (res) {
+        return NVME_KV_ERROR | NVME_DNR;
+    }
 
     status = nvme_map_dptr(n, &req->sg, max_len, &req->cmd);
     if (status != NVME_SUCCESS) {
-        if (results) {
-           g_free(results);
-        }
+        g_bytes_unref(results);
         return status | NVME_DNR;
     }
-   
-    size_t return_len = results_len > offset ? (results_len - offset) : 0;
+
+    /* only the requested window is returned */
+    size_t return_len;
+    const unsigned char *data = g_bytes_get_data(results, &return_len);
     if (return_len) {
-        size_t bytes_written = nvme_kv_write_data(req, results + offset, return_len < max_len ? return_len : max_len);
-        if (bytes_written != results_len) {
+        size_t bytes_written = nvme_kv_write_data(req, (unsigned char *)data, return_len);
+        if (bytes_written != return_len) {
            // no error is returned if there is not enough room in buffer
         }
     }
-
-    if (results) {
-       g_free(results);
-    }
+    g_bytes_unref(results);
 
     /* total data size */
     req->cqe.result = cpu_to_le32(results_len);
@@ -443,17 +781,27 @@ static uint16_t nvme_kv_retrieve_select(NvmeCtrl *n, NvmeRequest *req) {
 }
 
 static void nvme_kv_notifier(EventNotifier *e) {
+    NvmeCtrl *n = container_of(e, NvmeCtrl, kv_notifier);
     kv_task_result *result;
 
     event_notifier_test_and_clear(e);
-    while ((result = kv_tasks_get_next_result())) {
+    while ((result = kv_tasks_get_next_result(n->kv_engine))) {
         NvmeRequest *req = (NvmeRequest *) result->nvme_cmd;
+        if (!req) {
+            /* a streamed SELECT, completed when it was submitted */
+            kv_tasks_free_result(result);
+            continue;
+        }
         NvmeKvCmd *kv = (NvmeKvCmd *)&req->cmd;
         uint16_t cqe_status = NVME_SUCCESS;
         uint32_t cqe_result = 0;
 
         switch (result->task_type) {
             case KV_TASK_STORE: 
+                if (result->iov) {
+                    nvme_kv_unmap_data(req, result->iov, result->iov_count,
+                                       DMA_DIRECTION_TO_DEVICE, 0);
+                }
                 if (result->status < 0) {
                     if (result->status == KV_ERROR_FILE_NOT_FOUND) {
                        cqe_status = NVME_KV_NOT_FOUND;
@@ -480,8 +828,16 @@ static void nvme_kv_notifier(EventNotifier *e) {
                 break;
             case KV_TASK_RETRIEVE:
                 {
+                    if (result->iov) {
+                        nvme_kv_unmap_data(req, result->iov, result->iov_count,
+                                           DMA_DIRECTION_FROM_DEVICE,
+                                           result->status > 0 ? result->status : 0);
+                    }
                     if (result->status < 0) {
                         cqe_status = result->status == KV_ERROR_CANNOT_OPEN ? NVME_KV_NOT_FOUND : NVME_KV_ERROR;
+                    } else if (result->iov) {
+                        /* the data is already in place */
+                        cqe_result = result->max_length;
                     } else {
                         size_t len = le32_to_cpu(kv->host_buffer_size);
                         size_t bytes_written = nvme_kv_write_data(req, (unsigned char *) result->result,
@@ -523,15 +879,25 @@ static void nvme_kv_notifier(EventNotifier *e) {
                 break;
             case KV_TASK_SEND_SELECT:
                 {
-                    if (result->status != 0) {
+                    /* the token is freed with the result */
+                    req->opaque = NULL;
+                    if (result->status == KV_ERROR_QUERY_CANCELLED) {
+                        cqe_status = NVME_CMD_ABORT_REQ;
+                    } else if (result->status == KV_ERROR_QUERY_TIMEOUT) {
+                        cqe_status = NVME_KV_QUERY_TIMEOUT;
+                    } else if (result->status != 0) {
                         cqe_status = NVME_KV_ERROR;
+                    } else if (result->select_into) {
+                        cqe_result = MIN(result->max_length, UINT32_MAX);
+                        req->cqe.dw1 = cpu_to_le32(MIN(result->result_length, UINT32_MAX));
                     } else {
-                        uint32_t results_id = select_results_store((unsigned char *) result->result, result->result_length);
-                        cqe_result = results_id;
-                        result->result = NULL;
+                        cqe_result = result->select_id;
                     }
                 }
                 break;
+            case KV_TASK_TRANSCODE:
+                /* internal, never completes a command */
+                break;
         }
         if (cqe_status != NVME_SUCCESS) {
             cqe_status |= NVME_DNR;
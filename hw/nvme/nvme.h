@@ -512,6 +512,7 @@ typedef struct NvmeCtrl {
         uint16_t    virfap;
     } next_pri_ctrl_cap;    /* These override pri_ctrl_cap after reset */
     EventNotifier kv_notifier;
+    struct KvTaskEngine *kv_engine;
 } NvmeCtrl;
 
 typedef enum NvmeResetType {
@@ -589,6 +590,12 @@ uint16_t nvme_map_dptr(NvmeCtrl *n, NvmeSg *sg, size_t len,
 
 void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req);
 void nvme_kv_init(NvmeCtrl *n);
+void nvme_kv_exit(NvmeCtrl *n);
+void nvme_kv_instance_init(Object *obj);
 uint16_t nvme_kv_process(NvmeCtrl *n, NvmeRequest *req);
+/* stops a pushed down SELECT, false if req is not one */
+bool nvme_kv_abort(NvmeCtrl *n, NvmeRequest *req);
+/* stops the queries of the controller and waits for its KV commands */
+void nvme_kv_reset(NvmeCtrl *n);
 
 #endif /* HW_NVME_NVME_H */
@@ -607,15 +607,35 @@ typedef struct QEMU_PACKED NvmeKvCmd {
 /* options of KV_RETRIEVE_SELECT */
 #define NVME_SELECT_CMD_OPTION_DO_NOT_FREE(options) (options & 0x01)
 #define NVME_SELECT_CMD_OPTION_DO_NOT_FREE_IF_NOT_ALL_DATA_FETCHED(options) (options & 0x02)
+/* dw1 of the completion of KV_RETRIEVE_SELECT of a streamed result, whose
+ * result (dw0) is the size of the returned chunk instead of the total size
+ */
+#define NVME_SELECT_RETRIEVE_MORE_DATA 0x01
 
 /* options of KV_SEND_SELECT */
 #define NVME_SELECT_CMD_INPUT_TYPE(dw) ((le32_to_cpu(dw) >> 16) & 0xff)
 #define NVME_SELECT_CMD_OUTPUT_TYPE(dw) ((le32_to_cpu(dw) >> 24) & 0xff)
 #define NVME_SELECT_CMD_OUTPUT_TYPE_USE_CSV_HEADERS_INPUT(options) (options & 0x01)
 #define NVME_SELECT_CMD_OUTPUT_TYPE_USE_CSV_HEADERS_OUTPUT(options) (options & 0x02)
+/* complete once the query starts and stream the result in chunks; it is read
+ * sequentially with read_offset at the bytes fetched so far, and freed at
+ * its end
+ */
+#define NVME_SELECT_CMD_OPTION_STREAM_OUTPUT(options) (options & 0x04)
+/* query every object whose key starts with the key of the command as one
+ * table, in key order
+ */
+#define NVME_SELECT_CMD_OPTION_KEY_PREFIX(options) (options & 0x08)
+/* store the result as an object instead of keeping it for
+ * KV_RETRIEVE_SELECT; the host buffer starts with the length of its key in
+ * one byte and the key, followed by the query. Completes with the number of
+ * rows in dw0, all ones if unknown, and the size of the object in dw1
+ */
+#define NVME_SELECT_CMD_OPTION_INTO(options) (options & 0x10)
 #define NVME_SELECT_TYPE_CSV 0
 #define NVME_SELECT_TYPE_JSON 1
 #define NVME_SELECT_TYPE_PARQUET 2
+#define NVME_SELECT_TYPE_ARROW 3
 
 #define NVME_CMD_FLAGS_FUSE(flags) (flags & 0x3)
 #define NVME_CMD_FLAGS_PSDT(flags) ((flags >> 6) & 0x3)
@@ -990,7 +1010,8 @@ enum NvmeStatusCodes {
     NVME_KV_NOT_FOUND           = 0x0087,
     NVME_KV_ERROR               = 0x0088,
     NVME_KV_EXISTS              = 0x0089,
-    NVME_KV_INVALID_PARAMETER   = 0x0090
+    NVME_KV_INVALID_PARAMETER   = 0x0090,
+    NVME_KV_QUERY_TIMEOUT       = 0x0091
 };
 
 typedef struct QEMU_PACKED NvmeFwSlotInfoLog {
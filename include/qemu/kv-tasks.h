@@ -27,7 +27,9 @@ typedef enum kv_task_type {
     KV_TASK_LIST,
     KV_TASK_DELETE,
     KV_TASK_EXISTS,
-    KV_TASK_SEND_SELECT
+    KV_TASK_SEND_SELECT,
+    /* queued by the engine after stores, see kv_shadow.h; no result is sent */
+    KV_TASK_TRANSCODE
 } kv_task_type;
 
 typedef struct kv_task_request {
@@ -39,6 +41,11 @@ typedef struct kv_task_request {
     size_t key_length;
     unsigned char *data;
     size_t data_length;
+    /* when set, the data lives in iov (usually mapped guest memory) instead
+     * of data; it is handed back with the result for the caller to release
+     */
+    struct iovec *iov;
+    int iov_count;
     size_t max_length;
     bool must_exist;
     bool must_not_exist;
@@ -48,7 +55,23 @@ typedef struct kv_task_request {
     Query_Data_Type select_output_type;
     bool use_csv_headers_input;
     bool use_csv_headers_output;
-    QSIMPLEQ_ENTRY(kv_task_request) request_list;
+    /* the SELECT reads every object whose key starts with key */
+    bool select_key_prefix;
+    /* stops the SELECT, handed over to the result which frees it */
+    QueryCancel *select_cancel;
+    /* when set, the SELECT result is streamed into select_stream_fd, the
+     * write end of the pipe of this select-results id, which is closed
+     * once the query is done; otherwise the worker stores the result and
+     * passes its id back in the task result
+     */
+    uint32_t select_id;
+    int select_stream_fd;
+    /* when set, the SELECT result is stored as the object at this key and
+     * the task result carries its row and byte counts instead of an id
+     */
+    unsigned char select_into_key[KV_TASK_KEY_MAX_LENGTH];
+    size_t select_into_key_length;
+    QSLIST_ENTRY(kv_task_request) request_list;
 } kv_task_request;
 
 typedef struct kv_task_result {
@@ -58,17 +81,45 @@ typedef struct kv_task_result {
     void *result;
     size_t result_length;
     size_t max_length;
-    QSIMPLEQ_ENTRY(kv_task_result) result_list;
+    struct iovec *iov;
+    int iov_count;
+    uint32_t select_id;
+    QueryCancel *select_cancel;
+    /* a SELECT INTO stored its result, result_length holds its size and
+     * max_length the number of rows
+     */
+    bool select_into;
+    QSLIST_ENTRY(kv_task_result) result_list;
 } kv_task_result;
 
-int kv_tasks_add_request_with_params(kv_task_type task_type, uint32_t bus_number, uint32_t namespace_id,
+/* A set of worker threads with its own request and result queues, results
+ * are signalled on the EventNotifier given to kv_tasks_engine_new().
+ */
+typedef struct KvTaskEngine KvTaskEngine;
+
+KvTaskEngine *kv_tasks_engine_new(EventNotifier *event_notifier);
+/* finishes all queued requests and joins the workers, the results stay
+ * queued for kv_tasks_get_next_result(); no requests may be added afterwards.
+ * Running SELECTs and conversions are cancelled.
+ */
+void kv_tasks_engine_stop(KvTaskEngine *engine);
+/* cancels the running SELECTs and conversions like kv_tasks_engine_stop()
+ * and waits until every queued request is done, but keeps the workers
+ */
+void kv_tasks_engine_drain(KvTaskEngine *engine);
+/* stops the engine and drops results which have not been fetched */
+void kv_tasks_engine_free(KvTaskEngine *engine);
+
+int kv_tasks_add_request_with_params(KvTaskEngine *engine, kv_task_type task_type, uint32_t bus_number, uint32_t namespace_id,
     void *nvme_cmd, unsigned char *key, size_t key_length, unsigned char *data, size_t data_length,
     size_t max_length, bool must_exist, bool must_not_exist, bool append, size_t offset,
     Query_Data_Type select_input_type, Query_Data_Type select_output_type,
     bool use_csv_headers_input, bool use_csv_headers_output);
-void kv_tasks_add_request(kv_task_request *request);
-kv_task_result *kv_tasks_get_next_result(void);
-void kv_tasks_init(EventNotifier *event_notifier);
+/* returns false if the request was dropped, which only happens to the
+ * engine's own requests once it is stopping
+ */
+bool kv_tasks_add_request(KvTaskEngine *engine, kv_task_request *request);
+kv_task_result *kv_tasks_get_next_result(KvTaskEngine *engine);
 void kv_tasks_free_result(kv_task_result *result);
 
 #endif
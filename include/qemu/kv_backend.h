@@ -0,0 +1,64 @@
+/*
+ * KV Storage Backends
+ *
+ * Copyright (C) 2023 AirMettle, Inc.
+ *
+ * This code is licensed under the GNU GPL v2 or later.
+ */
+
+#ifndef KV_BACKEND_H
+#define KV_BACKEND_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include "qemu/kv_utils.h"
+
+/* The functions of util/kv_store.h dispatch to the backend a namespace is
+ * configured for (see kv_namespace_uses_log()), return values follow the
+ * contracts documented there.
+ */
+typedef struct KvStoreBackend {
+    const char *name;
+    ssize_t (*store)(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                     size_t key_len, const struct iovec *value, int value_count, bool append,
+                     bool must_exist, bool must_not_exist);
+    ssize_t (*read)(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                    size_t key_len, size_t offset, const struct iovec *iov, int iov_count,
+                    size_t *total_object_size);
+    int (*delete)(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                  size_t key_len);
+    int (*exist)(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                 size_t key_len);
+    /* calls func for every key of the namespace, path_str may be NULL */
+    int (*walk_keys)(uint32_t bus_number, uint32_t namespace_id, KvWalkObjectFunc func,
+                     void *opaque);
+    /* a host file holding the object for readers which need one, *is_temp
+     * is set when it is a copy the caller has to remove, NULL on errors
+     */
+    char *(*object_path)(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                         size_t key_len, bool *is_temp);
+    /* the read end of a pipe the object is written to, for readers which
+     * read it once; NULL if object_path() never copies
+     */
+    int (*object_stream)(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                         size_t key_len);
+    /* whether kv_index may snapshot the ordered key index of the namespace */
+    bool index_snapshots;
+} KvStoreBackend;
+
+/* one host file per key, util/kv_store.c */
+extern const KvStoreBackend kv_file_backend;
+
+/* append-only segment log, util/kv_log.c */
+extern const KvStoreBackend kv_log_backend;
+
+const KvStoreBackend *kv_store_backend(uint32_t namespace_id);
+
+/* set up on first use, then stop compaction and close all open logs when the
+ * base directory changes; called from kv_store_init() on the main thread
+ */
+void kv_log_reset(void);
+
+#endif //KV_BACKEND_H
@@ -0,0 +1,56 @@
+/*
+ * KV Storage Open File Cache
+ *
+ * Copyright (C) 2023 AirMettle, Inc.
+ *
+ * This code is licensed under the GNU GPL v2 or later.
+ */
+
+#ifndef KV_FD_CACHE_H
+#define KV_FD_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* A bounded LRU of read-only descriptors of file backend objects with
+ * their size, so repeated reads of an object are a single preadv. The
+ * capacity is KV_FD_CACHE_SIZE (0 disables the cache).
+ *
+ * Stores and deletes invalidate the key once they are done; a descriptor
+ * opened while an update was in flight is used once but not cached.
+ */
+
+typedef struct KvFdCacheEntry {
+    int fd;
+    off_t size;
+} KvFdCacheEntry;
+
+/* a referenced entry or NULL, *generation is set for a later insert */
+KvFdCacheEntry *kv_fd_cache_get(uint32_t bus_number, uint32_t namespace_id,
+                                const unsigned char *key, size_t key_len,
+                                uint64_t *generation);
+
+/* takes ownership of fd and returns a referenced entry for it; it is only
+ * cached when nothing was invalidated since kv_fd_cache_get returned
+ * generation
+ */
+KvFdCacheEntry *kv_fd_cache_insert(uint32_t bus_number, uint32_t namespace_id,
+                                   const unsigned char *key, size_t key_len, int fd,
+                                   off_t size, uint64_t generation);
+
+/* drops a reference, the descriptor is closed with the last one once the
+ * entry has left the cache
+ */
+void kv_fd_cache_put(KvFdCacheEntry *entry);
+
+void kv_fd_cache_invalidate(uint32_t bus_number, uint32_t namespace_id,
+                            const unsigned char *key, size_t key_len);
+
+/* close all cached descriptors and reread the capacity, used when the base
+ * directory changes
+ */
+void kv_fd_cache_reset(void);
+
+#endif //KV_FD_CACHE_H
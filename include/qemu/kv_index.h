@@ -0,0 +1,61 @@
+/*
+ * KV Storage Ordered Key Index
+ *
+ * Copyright (C) 2023 AirMettle, Inc.
+ *
+ * This code is licensed under the GNU GPL v2 or later.
+ */
+
+#ifndef KV_INDEX_H
+#define KV_INDEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "qemu/kv_utils.h"
+
+/* Each (bus, namespace) pair keeps an ordered in-memory index of its keys
+ * (an indexed skiplist) so KV LIST can seek to the prefix and return a page
+ * in O(log N + page) instead of scanning the namespace directory.
+ *
+ * The index is loaded on first use, either from the snapshot saved beside
+ * the namespace directory on clean exit, or by a one-time directory scan
+ * when the snapshot is missing or stale.  Namespaces in the log backend
+ * are loaded from the log's own key table and are not snapshotted.
+ */
+
+/* call before a create or remove of an object, paired with kv_index_end_update */
+void kv_index_begin_update(uint32_t bus_number, uint32_t namespace_id);
+
+/* call after a create or remove of an object; the index entry is reconciled
+ * with whether path_str currently exists
+ */
+void kv_index_end_update(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                         size_t key_len, const char *path_str);
+
+/* for backends which know whether a key exists without looking at the
+ * directory, updates of the same key must be serialized by the caller
+ */
+void kv_index_set(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                  size_t key_len, bool present);
+
+/* same contract as list_objects(), returns 0 on success */
+int kv_index_list(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key_prefix,
+                  size_t key_prefix_len, size_t offset, size_t max_to_return,
+                  size_t *num_objects_returned, ObjectKey **objects);
+
+/* whether the key exists, answered from the index so definite misses cost
+ * no file system access; 1 or 0, negative values if the index cannot tell
+ */
+int kv_index_lookup(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                    size_t key_len);
+
+/* write snapshots of all loaded indexes, called on exit */
+void kv_index_save_all(void);
+
+/* set up on first use, then save and drop all in-memory indexes when the
+ * base directory changes; called from kv_store_init() on the main thread
+ */
+void kv_index_reset(void);
+
+#endif //KV_INDEX_H
@@ -0,0 +1,49 @@
+/*
+ * KV Storage I/O
+ *
+ * Copyright (C) 2023 AirMettle, Inc.
+ *
+ * This code is licensed under the GNU GPL v2 or later.
+ */
+
+#ifndef KV_IO_H
+#define KV_IO_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/* The file system calls of the KV store. Called from a coroutine of a
+ * thread with an attached KvIoRing they are submitted to the io_uring and
+ * the coroutine yields until they complete, everywhere else they are plain
+ * system calls. Either way they return like the system call, -1 with errno
+ * set on errors.
+ *
+ * Since the coroutine may yield, no locks may be held across these calls.
+ */
+int kv_io_open(const char *path, int flags, mode_t mode);
+int kv_io_close(int fd);
+/* a negative offset uses and advances the file position */
+ssize_t kv_io_preadv(int fd, const struct iovec *iov, int iov_count, off_t offset);
+ssize_t kv_io_pwritev(int fd, const struct iovec *iov, int iov_count, off_t offset);
+int kv_io_unlink(const char *path);
+/* stats path, or fd when path is NULL */
+int kv_io_stat(int fd, const char *path, struct stat *st);
+
+typedef struct KvIoRing KvIoRing;
+
+/* NULL when io_uring is not available, wakeup_fd is polled by
+ * kv_io_ring_wait() so other threads can interrupt it
+ */
+KvIoRing *kv_io_ring_new(unsigned int entries, int wakeup_fd);
+void kv_io_ring_free(KvIoRing *ring);
+/* makes the kv_io calls of coroutines running in this thread use ring */
+void kv_io_ring_attach(KvIoRing *ring);
+/* submits the queued operations and waits until at least one of them
+ * completes or wakeup_fd becomes readable, then enters the coroutines of
+ * the completed operations; returns whether wakeup_fd fired
+ */
+bool kv_io_ring_wait(KvIoRing *ring);
+
+#endif //KV_IO_H
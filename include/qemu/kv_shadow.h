@@ -0,0 +1,66 @@
+/*
+ * KV Storage Parquet Shadow Copies
+ *
+ * Copyright (C) 2023 AirMettle, Inc.
+ *
+ * This code is licensed under the GNU GPL v2 or later.
+ */
+
+#ifndef KV_SHADOW_H
+#define KV_SHADOW_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "qemu/query.h"
+
+/* Text objects of the namespaces listed in KV_PARQUET_NAMESPACES are
+ * transcoded to Parquet in the background after every store other than an
+ * append, and SELECTs read the shadow copy instead of parsing the text
+ * again. An appended object has no shadow until it is stored whole. The
+ * setting is a comma separated list of <namespace id>:<csv|csv-header|json>,
+ * which says how the objects of the namespace are read; a shadow is only
+ * used by queries reading the object the same way. RETRIEVE always returns
+ * the stored bytes.
+ *
+ * Shadows live in <base dir>/<bus>/<namespace>.parquet. Stores and deletes
+ * drop the shadow once they are done, a conversion which overlapped an
+ * update is discarded. Namespaces in KV_LOG_NAMESPACES get no shadows, as
+ * their objects are streamed to queries.
+ */
+
+/* returns whether the namespace keeps shadows and how its objects are read */
+bool kv_shadow_policy(uint32_t namespace_id, Query_Data_Type *input_format,
+                      bool *use_csv_headers);
+
+/* path of the shadow of the object, creating its directory if asked;
+ * free with g_free
+ */
+char *kv_shadow_path(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                     size_t key_len, bool create_folder_on_absence);
+
+/* call before reading the object for a conversion */
+uint64_t kv_shadow_begin(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                         size_t key_len);
+
+/* installs the converted file at tmp_path as the shadow, or removes it if
+ * the object was updated since kv_shadow_begin() returned generation
+ */
+bool kv_shadow_commit(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                      size_t key_len, uint64_t generation, const char *tmp_path);
+
+/* drops the shadow, called once the object has been updated */
+void kv_shadow_invalidate(uint32_t bus_number, uint32_t namespace_id,
+                          const unsigned char *key, size_t key_len);
+
+/* returns the path of a shadow a query reading the object at object_path
+ * with input_format can use instead, or NULL
+ */
+char *kv_shadow_lookup(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                       size_t key_len, const char *object_path,
+                       Query_Data_Type input_format, bool use_csv_headers);
+
+/* rereads the configuration, used when the base directory changes */
+void kv_shadow_reset(void);
+
+#endif //KV_SHADOW_H
@@ -25,6 +25,13 @@ ssize_t store_object(uint32_t bus_number, uint32_t namespace_id, unsigned char *
                      unsigned char *value, size_t value_len, bool append, bool must_exist,
                      bool must_not_exist);
 
+/* same as store_object() with the value gathered from iov, which may point
+ * straight at guest memory
+ */
+ssize_t store_object_iov(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                         size_t key_len, const struct iovec *iov, int iov_count, bool append,
+                         bool must_exist, bool must_not_exist);
+
 /* returns number of bytes read, negative values on errors
 if offset is non-zero, begin reading at that offset
 buffer is where the data should be read into
@@ -34,6 +41,13 @@ ssize_t read_object(uint32_t bus_number, uint32_t namespace_id, unsigned char *k
                     size_t offset, unsigned char *buffer, size_t max_buffer_len,
                     size_t *total_object_size);
 
+/* same as read_object() with the data scattered into iov, which may point
+ * straight at guest memory
+ */
+ssize_t read_object_iov(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                        size_t key_len, size_t offset, const struct iovec *iov, int iov_count,
+                        size_t *total_object_size);
+
 /* returns whether the file exists given a key.
  * 1 means file exists, 0 means file doesn't exist
  * negative values on errors
@@ -50,4 +64,26 @@ int list_objects(uint32_t bus_number, uint32_t namespace_id, unsigned char *key_
                         size_t key_prefix_len, size_t offset, size_t max_to_return,
                         size_t *num_objects_returned, ObjectKey **objects);
 
+/* calls func for every key of a namespace in no particular order, path_str
+ * is NULL for backends which don't keep a file per key
+ * returns 0 on success, the callback's return value or negative values on errors
+ */
+int kv_store_walk_keys(uint32_t bus_number, uint32_t namespace_id, KvWalkObjectFunc func,
+                       void *opaque);
+
+/* returns the path of a host file holding the object, for readers such as
+ * the query engine which need one, NULL on errors.  If *is_temp is set the
+ * file is a copy which the caller has to remove.  Free the result with free()
+ */
+char *kv_store_object_path(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                           size_t key_len, bool *is_temp);
+
+/* returns the read end of a pipe carrying the object, for readers which
+ * read it once from start to end and would otherwise get a copy from
+ * kv_store_object_path(); the caller closes it.  Negative values on
+ * errors, KV_ERROR_INVALID_PARAMETER if the object has a file of its own
+ */
+int kv_store_object_stream(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                           size_t key_len);
+
 #endif //KV_STORE_H
@@ -14,6 +14,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #define KV_ERROR_INVALID_PARAMETER (-1)
 #define KV_ERROR_FILE_PATH (-2)
@@ -30,18 +32,79 @@
 #define KV_ERROR_DUCKDB (-13)
 #define KV_ERROR_REMOVE (-14)
 #define KV_ERROR_KEY_TOO_LONG (-15)
+#define KV_ERROR_QUERY_CANCELLED (-16)
+#define KV_ERROR_QUERY_TIMEOUT (-17)
+
+#define KV_KEY_MAX_LENGTH 16
 
 typedef struct ObjectKey {
-    unsigned char key[16];
+    unsigned char key[KV_KEY_MAX_LENGTH];
     size_t key_len;
 } ObjectKey;
 
+/* identifies an object across buses and namespaces, for hash tables */
+typedef struct KvObjectId {
+    uint32_t bus_number;
+    uint32_t namespace_id;
+    size_t key_len;
+    unsigned char key[KV_KEY_MAX_LENGTH];
+} KvObjectId;
+
+/* false if the key is too long for an id */
+bool kv_object_id_init(KvObjectId *id, uint32_t bus_number, uint32_t namespace_id,
+                       const unsigned char *key, size_t key_len);
+/* GHashFunc and GEqualFunc for KvObjectId keys */
+unsigned int kv_object_id_hash(const void *v);
+int kv_object_id_equal(const void *a, const void *b);
+
 void kv_store_init(void);
 
 void hex(const unsigned char *key, size_t key_len, char *buffer);
 
+/* inverse of hex(), returns 0 on success, -1 if str is not an even length
+ * string of upper case hex digits
+ */
+int unhex(const char *str, size_t str_len, unsigned char *key);
+
+/* KV_DIR_LEVELS selects how many levels of hash named subdirectories
+ * (00-FF) objects are spread over inside a namespace dir, 0 keeps the flat
+ * <base>/<bus>/<nsid>/<HEXKEY> layout.  An existing namespace dir in another
+ * layout is migrated the first time it is accessed.
+ */
+int kv_dir_levels(void);
+
+/* KV_LOG_NAMESPACES is a comma separated list of namespace ids, or "all",
+ * whose objects are kept in the log-structured backend under
+ * <base>/<bus>/<nsid>.log/ instead of one file per key.  Objects stored
+ * through the other backend stay where they are and are used again once the
+ * namespace is no longer listed.
+ */
+bool kv_namespace_uses_log(uint32_t namespace_id);
+
 const char *
 get_path_str(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key, size_t key_len,
              bool create_folder_on_absence);
 
+/* callbacks for kv_walk_objects, a non-zero return value stops the walk */
+typedef int (*KvWalkObjectFunc)(const unsigned char *key, size_t key_len, const char *path_str,
+                                void *opaque);
+typedef int (*KvWalkDirFunc)(const char *dir_path, void *opaque);
+
+/* calls object_func for every object of a namespace and dir_func for the
+ * namespace dir and each of its shard dirs, either may be NULL
+ * returns 0 on success, the callback's return value or negative values on errors
+ */
+int kv_walk_objects(uint32_t bus_number, uint32_t namespace_id, KvWalkObjectFunc object_func,
+                    KvWalkDirFunc dir_func, void *opaque);
+
+/* writes all of iov at offset, or at the file position (honouring
+ * O_APPEND) when offset is negative, returns 0 or -1 with errno set
+ */
+int kv_writev_full(int fd, const struct iovec *iov, int iov_count, off_t offset);
+
+/* fills iov from offset until it is full or the end of the file, returns
+ * the number of bytes read or -1 with errno set
+ */
+ssize_t kv_readv_full(int fd, const struct iovec *iov, int iov_count, off_t offset);
+
 #endif //KV_UTILS_H
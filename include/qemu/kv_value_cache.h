@@ -0,0 +1,66 @@
+/*
+ * KV Storage Value Cache
+ *
+ * Copyright (C) 2023 AirMettle, Inc.
+ *
+ * This code is licensed under the GNU GPL v2 or later.
+ */
+
+#ifndef KV_VALUE_CACHE_H
+#define KV_VALUE_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Contents of small objects kept in memory by read_object_iov() and
+ * store_object_iov(), independent of the backend. It is a segmented LRU:
+ * new values enter a probationary segment and move to the protected one on
+ * their second hit, so a scan of cold objects cannot flush the hot ones.
+ *
+ * KV_VALUE_CACHE_SIZE is the budget in bytes (0 disables the cache), values
+ * larger than KV_VALUE_CACHE_MAX_OBJECT are not cached.
+ */
+
+typedef struct KvValueCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t entries;
+    uint64_t bytes;
+} KvValueCacheStats;
+
+/* serves a read from the cache like read_object_iov() and returns true on a
+ * hit; on a miss *generation is set for kv_value_cache_fill()
+ */
+bool kv_value_cache_read(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                         size_t key_len, size_t offset, const struct iovec *iov, int iov_count,
+                         ssize_t *res, size_t *total_object_size, uint64_t *generation);
+
+/* caches the whole value of an object read after a miss, unless the key was
+ * updated since kv_value_cache_read() returned generation
+ */
+void kv_value_cache_fill(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                         size_t key_len, const struct iovec *iov, int iov_count, size_t size,
+                         uint64_t generation);
+
+/* brackets a store or delete of the key; end caches value when it is not
+ * NULL and no other update of the key finished in between, otherwise the
+ * key is dropped from the cache
+ */
+uint64_t kv_value_cache_begin_update(uint32_t bus_number, uint32_t namespace_id,
+                                     const unsigned char *key, size_t key_len);
+void kv_value_cache_end_update(uint32_t bus_number, uint32_t namespace_id,
+                               const unsigned char *key, size_t key_len,
+                               const struct iovec *value, int value_count, uint64_t generation);
+
+void kv_value_cache_get_stats(KvValueCacheStats *stats);
+
+/* drop all values and reread the configuration, used when the base
+ * directory changes
+ */
+void kv_value_cache_reset(void);
+
+#endif //KV_VALUE_CACHE_H
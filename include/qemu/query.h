@@ -18,11 +18,23 @@
 typedef enum Query_Data_Type {
     QUERY_TYPE_CSV = 0,
     QUERY_TYPE_JSON = 1,
-    QUERY_TYPE_PARQUET = 2
+    QUERY_TYPE_PARQUET = 2,
+    /* an Arrow IPC stream, which needs the duckdb arrow extension */
+    QUERY_TYPE_ARROW = 3
 } Query_Data_Type;
 
 /* initialize the duckdb before running queries
 ** num_connection is the size of connection pool
+** each connection keeps up to KV_QUERY_PLAN_CACHE_SIZE prepared queries (default 64, 0 disables),
+** reused while the queried object is unchanged
+** KV_QUERY_TIMEOUT_MS sets the deadline of queries started with query_cancel_new(),
+** as "<ms>[,[<bus number>:]<namespace id>:<ms>...]" where a bare value applies to all
+** other namespaces, and a namespace id without bus number to that namespace of every
+** controller
+** KV_QUERY_NAMESPACE_LIMIT bounds the queries a namespace of a controller runs at once,
+** in the same form
+** KV_QUERY_THREADS, KV_QUERY_MEMORY_LIMIT ("4GB") and KV_QUERY_TEMP_DIR set the duckdb
+** threads, memory_limit and temp_directory shared by all queries
 ** return 0 on success, negative value on error
 */
 int query_init_db(int num_connection);
@@ -31,6 +43,56 @@ int query_init_db(int num_connection);
 */
 void query_close_db(void);
 
+/* connection pool counters, wait times are in microseconds
+*/
+typedef struct QueryPoolStats {
+    uint64_t acquisitions;
+    uint64_t waits;
+    uint64_t wait_us;
+    uint64_t max_wait_us;
+    /* the size set by query_init_db() or query_resize_pool(), and the
+     * connections open, more than size until the busy ones beyond a
+     * shrink are released
+     */
+    uint64_t size;
+    uint64_t open;
+    uint64_t busy;
+    uint64_t waiting;
+    /* queries held back by KV_QUERY_NAMESPACE_LIMIT */
+    uint64_t admission_waits;
+    uint64_t admission_wait_us;
+} QueryPoolStats;
+
+/* change the number of pooled connections while queries run
+** connections in use beyond the new size are closed once their query is done
+** queries blocked on a busy pool are served in arrival order
+** return 0 on success, negative value on error
+*/
+int query_resize_pool(int num_connection);
+
+/* a snapshot of the counters, all zero before query_init_db()
+*/
+void query_get_pool_stats(QueryPoolStats *stats);
+
+/* lets another thread stop a running query between two of its duckdb tasks
+** the query then fails with KV_ERROR_QUERY_CANCELLED, or KV_ERROR_QUERY_TIMEOUT
+** once past its deadline (g_get_monotonic_time(), 0 for none); cancelling
+** the parent, unless NULL, cancels it as well
+*/
+typedef struct QueryCancel {
+    bool cancelled;
+    int64_t deadline;
+    struct QueryCancel *parent;
+} QueryCancel;
+
+/* a token with the KV_QUERY_TIMEOUT_MS deadline of the namespace, free with g_free()
+*/
+QueryCancel *query_cancel_new(uint32_t bus_number, uint32_t namespace_id);
+
+/* may be called from any thread while the query runs
+*/
+void query_cancel(QueryCancel *cancel);
+
 /* run the query on the duckdb
 ** input_format and output_format can be JSON, CSV, PARQUET
 ** if use_csv_headers_input is true, assumes the input contains column names if input_format is CSV,
@@ -45,4 +107,73 @@ run_query(uint32_t bus_number, uint32_t namespace_id, unsigned char *key, size_t
           Query_Data_Type output_format, bool use_csv_headers_input,
           bool use_csv_headers_output, unsigned char **result);
 
+/* run the query like run_query(), writing the result to fd as duckdb
+** produces it, so a pipe throttles the query to the pace of its reader;
+** parquet results are written once they are complete
+** return 0 on success, negative value on error
+*/
+int
+run_query_to_fd(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                size_t key_length, char *sql, Query_Data_Type input_format,
+                Query_Data_Type output_format, bool use_csv_headers_input,
+                bool use_csv_headers_output, int fd);
+
+/* run the query like run_query() over every object whose key starts with
+** key_prefix, scanned as one table in key order so that aggregations span
+** all of them; the objects are read with the same format and options
+** return 0 on success, negative value on error, KV_ERROR_FILE_NOT_FOUND if no key matches
+*/
+int
+run_query_prefix(uint32_t bus_number, uint32_t namespace_id, unsigned char *key_prefix,
+                 size_t key_prefix_length, char *sql, size_t *output_len,
+                 Query_Data_Type input_format, Query_Data_Type output_format,
+                 bool use_csv_headers_input, bool use_csv_headers_output,
+                 unsigned char **result);
+
+/* run_query_prefix() writing the result to fd like run_query_to_fd()
+*/
+int
+run_query_prefix_to_fd(uint32_t bus_number, uint32_t namespace_id, unsigned char *key_prefix,
+                       size_t key_prefix_length, char *sql, Query_Data_Type input_format,
+                       Query_Data_Type output_format, bool use_csv_headers_input,
+                       bool use_csv_headers_output, int fd);
+
+/* run_query() or, with key_prefix, run_query_prefix(), stopped through cancel unless NULL
+*/
+int
+query_run(uint32_t bus_number, uint32_t namespace_id, unsigned char *key, size_t key_length,
+          bool key_prefix, char *sql, size_t *output_len, Query_Data_Type input_format,
+          Query_Data_Type output_format, bool use_csv_headers_input,
+          bool use_csv_headers_output, QueryCancel *cancel, unsigned char **result);
+
+/* the same for run_query_to_fd() and run_query_prefix_to_fd()
+*/
+int
+query_run_to_fd(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                size_t key_length, bool key_prefix, char *sql, Query_Data_Type input_format,
+                Query_Data_Type output_format, bool use_csv_headers_input,
+                bool use_csv_headers_output, QueryCancel *cancel, int fd);
+
+/* query_run() storing the result as the object at into_key instead of
+** returning it, which replaces an existing object; a large result is written
+** in pieces, which reads of the object may see part of. The number of rows, or
+** UINT64_MAX for an Arrow result, and of bytes stored are returned in *rows
+** and *output_len. Return 0 on success, negative value on error
+*/
+int
+query_run_into(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+               size_t key_length, bool key_prefix, char *sql, Query_Data_Type input_format,
+               Query_Data_Type output_format, bool use_csv_headers_input,
+               bool use_csv_headers_output, QueryCancel *cancel, unsigned char *into_key,
+               size_t into_key_length, uint64_t *rows, size_t *output_len);
+
+/* write a Parquet shadow copy of the object for the KV_PARQUET_NAMESPACES
+** policy of its namespace (see kv_shadow.h), which later queries read instead
+** and stopped through cancel unless NULL
+** return 0 on success, negative value on error or if the object was updated meanwhile
+*/
+int
+query_transcode_to_parquet(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                           size_t key_length, QueryCancel *cancel);
+
 #endif //QUERY_H
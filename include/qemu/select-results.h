@@ -15,9 +15,51 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
+#include <sys/types.h>
+
+typedef struct _GBytes GBytes;
+
+/* Stored results are kept in memory up to KV_SELECT_RESULTS_MEMORY, later
+ * ones are written to KV_SELECT_RESULTS_DIR until retrieved. Results not
+ * accessed for KV_SELECT_RESULTS_TTL seconds are freed.
+ */
 void select_results_init(void);
+/* takes ownership of results; returns the id, or 0 if it cannot be kept */
 uint32_t select_results_store(unsigned char *results, size_t results_len);
-unsigned char *select_results_retrieve(uint32_t id, size_t *data_len, bool do_not_remove,
-                                       bool do_not_remove_if_size_gt, size_t size_check, bool *found);
+/* returns in *window up to len bytes of the result from offset, sharing the
+ * memory of a result that is not spilled, and its size in *total_size.
+ * Returns 0, or negative values on errors.
+ */
+int select_results_retrieve(uint32_t id, size_t offset, size_t len, bool do_not_remove,
+                            bool do_not_remove_if_not_all_fetched, GBytes **window,
+                            size_t *total_size);
+
+/* Streamed results are read from a pipe the query writes into while it
+ * runs, so the host can fetch the first chunks before the query ends and a
+ * host that does not keep up stalls the query instead of growing a buffer.
+ * Except for select_results_finish_stream() they are used from the main loop.
+ */
+typedef void SelectStreamReadyFunc(void *opaque);
+
+/* returns the id of a new stream, or 0 on error, and the write end of its
+ * pipe in *write_fd; owner is passed to select_results_drop_streams()
+ */
+uint32_t select_results_new_stream(void *owner, int *write_fd);
+bool select_results_is_stream(uint32_t id);
+/* records the status of the query, before it closes the write end */
+void select_results_finish_stream(uint32_t id, int status);
+/* reads the next chunk of the stream without blocking; offset must be the
+ * number of bytes returned before. Returns the chunk size with *more set
+ * until the end of the stream, which frees it; 0 with *more set means no
+ * data is ready yet. Negative values on errors, including a failed query.
+ */
+ssize_t select_results_read_stream(uint32_t id, size_t offset, unsigned char *buffer,
+                                   size_t len, bool *more);
+/* calls ready once the stream can be read or is freed, false if there is
+ * no such stream or another read is waiting for it
+ */
+bool select_results_wait_stream(uint32_t id, SelectStreamReadyFunc *ready, void *opaque);
+/* frees the streams of owner, which makes their queries fail */
+void select_results_drop_streams(void *owner);
 
 #endif
@@ -9,8 +9,12 @@
  */ 
 
 #include "qemu/kv_store.h"
+#include "qemu/kv_value_cache.h"
+#include "qemu/kv_shadow.h"
 #include "qemu/query.h"
+#include "qemu/select-results.h"
 #include <pthread.h>
+#include <unistd.h>
 #include <glib/gstdio.h>
 
 static void test_string(void) {
@@ -176,6 +180,343 @@ static void test_binary(void) {
     }
 }
 
+static void test_list_paging(void) {
+    setenv("KV_BASE_DIR", "/tmp", 1);
+    kv_store_init();
+    unsigned char value[1] = {0x01};
+    unsigned char key[2];
+    for (int i = 0; i < 256; ++i) {
+        key[0] = 0xA0;
+        key[1] = i;
+        g_assert(store_object(4294967294, 4294967295, key, sizeof(key), value, sizeof(value),
+                            false, false, true) == sizeof(value));
+    }
+    // drop every odd key so the index has to handle removes
+    for (int i = 1; i < 256; i += 2) {
+        key[0] = 0xA0;
+        key[1] = i;
+        g_assert(!delete_object(4294967294, 4294967295, key, sizeof(key)));
+    }
+
+    // page through everything >= {0xA0, 0x10}, 10 keys at a time
+    unsigned char prefix[2] = {0xA0, 0x10};
+    size_t num_objects;
+    ObjectKey *list;
+    int expected = 0x10;
+    for (size_t offset = 0; ; offset += 10) {
+        g_assert(!list_objects(4294967294, 4294967295, prefix, sizeof(prefix), offset, 10,
+                               &num_objects, &list));
+        if (!num_objects) {
+            break;
+        }
+        for (int i = 0; i < num_objects; ++i) {
+            g_assert(list[i].key_len == 2);
+            g_assert(list[i].key[0] == 0xA0 && list[i].key[1] == expected);
+            expected += 2;
+        }
+        free(list);
+    }
+    g_assert(expected == 256);
+
+    for (int i = 0; i < 256; i += 2) {
+        key[0] = 0xA0;
+        key[1] = i;
+        g_assert(!delete_object(4294967294, 4294967295, key, sizeof(key)));
+    }
+    g_assert(!list_objects(4294967294, 4294967295, NULL, 0, 0, 0, &num_objects, &list));
+    g_assert(num_objects == 0);
+}
+
+static void test_dir_levels(void) {
+    setenv("KV_BASE_DIR", "/tmp", 1);
+    unsetenv("KV_DIR_LEVELS");
+    kv_store_init();
+    unsigned char value[12] = "value\nvalue";
+    unsigned char keys[3][6] = {"Alice", "Bob", "Connor"};
+    for (int i = 0; i < 3; ++i) {
+        g_assert(store_object(4294967294, 4294967294, keys[i], sizeof(keys[i]), value, sizeof(value),
+                            false, false, true) == sizeof(value));
+    }
+
+    // switching to two levels moves the existing objects
+    setenv("KV_DIR_LEVELS", "2", 1);
+    kv_store_init();
+    const char *path = get_path_str(4294967294, 4294967294, keys[0], sizeof(keys[0]), false);
+    g_assert(!strncmp(path, "/tmp/4294967294/4294967294/", 27));
+    g_assert(path[29] == '/' && path[32] == '/');
+    g_assert(!strcmp(path + 33, "416C69636500"));
+    free((void *)path);
+
+    unsigned char buffer[12];
+    size_t total_object_size;
+    for (int i = 0; i < 3; ++i) {
+        g_assert(file_exist(4294967294, 4294967294, keys[i], sizeof(keys[i])) == 1);
+        g_assert(read_object(4294967294, 4294967294, keys[i], sizeof(keys[i]), 0, buffer, 12,
+                           &total_object_size) == sizeof(value));
+    }
+    size_t num_objects;
+    ObjectKey *list;
+    g_assert(!list_objects(4294967294, 4294967294, NULL, 0, 1, 0, &num_objects, &list));
+    g_assert(num_objects == 2);
+    g_assert(!memcmp(list[0].key, keys[1], sizeof(keys[1])));
+    g_assert(!memcmp(list[1].key, keys[2], sizeof(keys[2])));
+    free(list);
+
+    // and back to the flat layout
+    unsetenv("KV_DIR_LEVELS");
+    kv_store_init();
+    for (int i = 0; i < 3; ++i) {
+        g_assert(!delete_object(4294967294, 4294967294, keys[i], sizeof(keys[i])));
+    }
+    g_assert(!list_objects(4294967294, 4294967294, NULL, 0, 0, 0, &num_objects, &list));
+    g_assert(num_objects == 0);
+}
+
+static void test_log_backend(void) {
+    setenv("KV_BASE_DIR", "/tmp", 1);
+    unsetenv("KV_LOG_NAMESPACES");
+    kv_store_init();
+    unsigned char value[12] = "value\nvalue";
+    unsigned char keys[3][6] = {"Alice", "Bob", "Connor"};
+    // an object of the file backend
+    g_assert(store_object(4294967294, 4294967293, keys[0], sizeof(keys[0]), value, sizeof(value),
+                        false, false, false) == sizeof(value));
+
+    setenv("KV_LOG_NAMESPACES", "1, 4294967293", 1);
+    kv_store_init();
+    g_assert(file_exist(4294967294, 4294967293, keys[0], sizeof(keys[0])) == 0);
+    for (int i = 0; i < 3; ++i) {
+        g_assert(store_object(4294967294, 4294967293, keys[i], sizeof(keys[i]), value, sizeof(value),
+                            false, false, true) == sizeof(value));
+    }
+    g_assert(store_object(4294967294, 4294967293, keys[1], sizeof(keys[1]), value, sizeof(value),
+                        false, false, true) == KV_ERROR_FILE_EXISTS);
+    g_assert(store_object(4294967294, 4294967293, (unsigned char *) "Dan", sizeof("Dan"), value,
+                        sizeof(value), true, true, false) == KV_ERROR_FILE_NOT_FOUND);
+    g_assert(store_object(4294967294, 4294967293, keys[2], sizeof(keys[2]), value, 6,
+                        true, true, false) == 6);
+    g_assert(!delete_object(4294967294, 4294967293, keys[0], sizeof(keys[0])));
+    g_assert(delete_object(4294967294, 4294967293, keys[0], sizeof(keys[0])) == KV_ERROR_FILE_NOT_FOUND);
+
+    // reopening replays the log
+    kv_store_init();
+    unsigned char buffer[18];
+    size_t total_object_size;
+    g_assert(file_exist(4294967294, 4294967293, keys[0], sizeof(keys[0])) == 0);
+    g_assert(read_object(4294967294, 4294967293, keys[1], sizeof(keys[1]), 0, buffer, sizeof(buffer),
+                       &total_object_size) == sizeof(value));
+    g_assert(!memcmp(buffer, value, sizeof(value)));
+    g_assert(read_object(4294967294, 4294967293, keys[2], sizeof(keys[2]), 6, buffer, sizeof(buffer),
+                       &total_object_size) == 12);
+    g_assert(total_object_size == 18);
+    g_assert(!memcmp(buffer, "value\0value\n", 12));
+    size_t num_objects;
+    ObjectKey *list;
+    g_assert(!list_objects(4294967294, 4294967293, NULL, 0, 0, 0, &num_objects, &list));
+    g_assert(num_objects == 2);
+    g_assert(!memcmp(list[0].key, keys[1], sizeof(keys[1])));
+    g_assert(!memcmp(list[1].key, keys[2], sizeof(keys[2])));
+    free(list);
+    for (int i = 1; i < 3; ++i) {
+        g_assert(!delete_object(4294967294, 4294967293, keys[i], sizeof(keys[i])));
+    }
+
+    // appends write only new bytes and fold short trailing extents
+    unsigned char eve[4] = "Eve";
+    unsigned char expected[30];
+    g_assert(store_object(4294967294, 4294967293, eve, sizeof(eve), value, sizeof(value),
+                        false, false, false) == sizeof(value));
+    memcpy(expected, value, sizeof(value));
+    for (int i = 0; i < 3; ++i) {
+        g_assert(store_object(4294967294, 4294967293, eve, sizeof(eve), value, 6,
+                            true, true, false) == 6);
+        memcpy(expected + sizeof(value) + 6 * i, value, 6);
+    }
+    kv_store_init();
+    unsigned char eve_buffer[30];
+    g_assert(read_object(4294967294, 4294967293, eve, sizeof(eve), 10, eve_buffer,
+                       sizeof(eve_buffer), &total_object_size) == 20);
+    g_assert(total_object_size == 30);
+    g_assert(!memcmp(eve_buffer, expected + 10, 20));
+    g_assert(!delete_object(4294967294, 4294967293, eve, sizeof(eve)));
+
+    // the file backend object is still there
+    unsetenv("KV_LOG_NAMESPACES");
+    kv_store_init();
+    g_assert(file_exist(4294967294, 4294967293, keys[0], sizeof(keys[0])) == 1);
+    g_assert(!delete_object(4294967294, 4294967293, keys[0], sizeof(keys[0])));
+}
+
+static void test_iov(void) {
+    setenv("KV_BASE_DIR", "/tmp", 1);
+    unsigned char key[4] = "iov";
+    char parts[3][6] = {"value", "", "value"};
+    struct iovec iov[3];
+    for (int i = 0; i < 3; ++i) {
+        iov[i].iov_base = parts[i];
+        iov[i].iov_len = strlen(parts[i]);
+    }
+    // once through each backend
+    for (int log = 0; log < 2; ++log) {
+        if (log) {
+            setenv("KV_LOG_NAMESPACES", "4294967293", 1);
+        } else {
+            unsetenv("KV_LOG_NAMESPACES");
+        }
+        kv_store_init();
+        g_assert(store_object_iov(4294967294, 4294967293, key, sizeof(key), iov, 3,
+                                  false, false, true) == 10);
+        g_assert(store_object_iov(4294967294, 4294967293, key, sizeof(key), iov, 1,
+                                  true, true, false) == 5);
+        unsigned char buffer[16];
+        size_t total_object_size;
+        g_assert(read_object(4294967294, 4294967293, key, sizeof(key), 0, buffer, sizeof(buffer),
+                           &total_object_size) == 15);
+        g_assert(!memcmp(buffer, "valuevaluevalue", 15));
+        // scattered read from an offset
+        unsigned char head[4], tail[16];
+        struct iovec out[2] = {{head, sizeof(head)}, {tail, sizeof(tail)}};
+        g_assert(read_object_iov(4294967294, 4294967293, key, sizeof(key), 3, out, 2,
+                                 &total_object_size) == 12);
+        g_assert(total_object_size == 15);
+        g_assert(!memcmp(head, "ueva", 4) && !memcmp(tail, "luevalue", 8));
+        g_assert(!delete_object(4294967294, 4294967293, key, sizeof(key)));
+    }
+    unsetenv("KV_LOG_NAMESPACES");
+}
+
+static void test_fd_cache(void) {
+    setenv("KV_BASE_DIR", "/tmp", 1);
+    setenv("KV_FD_CACHE_SIZE", "1", 1);
+    kv_store_init();
+    unsigned char keys[2][4] = {"fd1", "fd2"};
+    unsigned char buffer[16];
+    size_t total_object_size;
+    for (int i = 0; i < 2; ++i) {
+        g_assert(store_object(4294967294, 4294967293, keys[i], sizeof(keys[i]),
+                              (unsigned char *)"longer value", 12, false, false, false) == 12);
+    }
+    // cached by the first read, evicted by reading the second key
+    for (int i = 0; i < 3; ++i) {
+        g_assert(read_object(4294967294, 4294967293, keys[i % 2], sizeof(keys[i % 2]), 7,
+                             buffer, sizeof(buffer), &total_object_size) == 5);
+        g_assert(total_object_size == 12 && !memcmp(buffer, "value", 5));
+    }
+    // stores and deletes invalidate the cached size
+    g_assert(store_object(4294967294, 4294967293, keys[0], sizeof(keys[0]),
+                          (unsigned char *)"short", 5, false, false, false) == 5);
+    g_assert(read_object(4294967294, 4294967293, keys[0], sizeof(keys[0]), 0, buffer,
+                         sizeof(buffer), &total_object_size) == 5);
+    g_assert(total_object_size == 5 && !memcmp(buffer, "short", 5));
+    g_assert(store_object(4294967294, 4294967293, keys[0], sizeof(keys[0]),
+                          (unsigned char *)"er", 2, true, true, false) == 2);
+    g_assert(read_object(4294967294, 4294967293, keys[0], sizeof(keys[0]), 0, buffer,
+                         sizeof(buffer), &total_object_size) == 7);
+    g_assert(total_object_size == 7 && !memcmp(buffer, "shorter", 7));
+    for (int i = 0; i < 2; ++i) {
+        g_assert(!delete_object(4294967294, 4294967293, keys[i], sizeof(keys[i])));
+        g_assert(read_object(4294967294, 4294967293, keys[i], sizeof(keys[i]), 0, buffer,
+                             sizeof(buffer), &total_object_size) == KV_ERROR_CANNOT_OPEN);
+    }
+    unsetenv("KV_FD_CACHE_SIZE");
+}
+
+static void test_value_cache(void) {
+    setenv("KV_BASE_DIR", "/tmp", 1);
+    setenv("KV_VALUE_CACHE_SIZE", "1M", 1);
+    kv_store_init();
+    unsigned char key[4] = "vc";
+    unsigned char buffer[16];
+    size_t total_object_size;
+    KvValueCacheStats before, after;
+    kv_value_cache_get_stats(&before);
+    // written through, slices are served from memory
+    g_assert(store_object(4294967294, 4294967293, key, sizeof(key), (unsigned char *)"cached", 6,
+                          false, false, false) == 6);
+    g_assert(read_object(4294967294, 4294967293, key, sizeof(key), 2, buffer, sizeof(buffer),
+                         &total_object_size) == 4);
+    g_assert(total_object_size == 6 && !memcmp(buffer, "ched", 4));
+    // an append drops the value, the next full read brings it back
+    g_assert(store_object(4294967294, 4294967293, key, sizeof(key), (unsigned char *)"!", 1,
+                          true, true, false) == 1);
+    for (int i = 0; i < 2; ++i) {
+        g_assert(read_object(4294967294, 4294967293, key, sizeof(key), 0, buffer, sizeof(buffer),
+                             &total_object_size) == 7);
+        g_assert(total_object_size == 7 && !memcmp(buffer, "cached!", 7));
+    }
+    kv_value_cache_get_stats(&after);
+    g_assert(after.hits - before.hits == 2 && after.misses - before.misses == 1);
+    g_assert(after.entries == 1 && after.bytes == 7);
+    g_assert(!delete_object(4294967294, 4294967293, key, sizeof(key)));
+    g_assert(read_object(4294967294, 4294967293, key, sizeof(key), 0, buffer, sizeof(buffer),
+                         &total_object_size) == KV_ERROR_CANNOT_OPEN);
+    unsetenv("KV_VALUE_CACHE_SIZE");
+}
+
+static void test_select_results(void) {
+    setenv("KV_SELECT_RESULTS_MEMORY", "16", 1);
+    setenv("KV_SELECT_RESULTS_TTL", "1", 1);
+    setenv("KV_SELECT_RESULTS_DIR", "/tmp", 1);
+    select_results_init();
+    GBytes *window;
+    size_t total_size;
+    // the first result fits the budget, the second one is spilled
+    uint32_t ids[2];
+    ids[0] = select_results_store((unsigned char *)g_strdup("in memory!"), 10);
+    ids[1] = select_results_store((unsigned char *)g_strdup("written to the scratch dir"), 26);
+    g_assert(ids[0] && ids[1] && ids[0] != ids[1]);
+    const char *expected[2] = { "memory", "to the" };
+    for (int i = 0; i < 2; ++i) {
+        size_t offset = i ? 8 : 3;
+        // a partial window keeps the result
+        g_assert(!select_results_retrieve(ids[i], offset, 6, false, true, &window, &total_size));
+        g_assert(total_size == (i ? 26 : 10));
+        g_assert(g_bytes_get_size(window) == 6);
+        g_assert(!memcmp(g_bytes_get_data(window, NULL), expected[i], 6));
+        g_bytes_unref(window);
+        // the window is clipped to the result, fetching the end frees it
+        g_assert(!select_results_retrieve(ids[i], offset + 2, 100, false, true, &window,
+                                          &total_size));
+        g_assert(g_bytes_get_size(window) == total_size - offset - 2);
+        g_bytes_unref(window);
+        g_assert(select_results_retrieve(ids[i], 0, 1, false, true, &window, &total_size) ==
+                 KV_ERROR_FILE_NOT_FOUND);
+        g_assert(!window && !total_size);
+    }
+    // a result not accessed within the TTL is freed
+    ids[0] = select_results_store((unsigned char *)g_strdup("expires"), 7);
+    g_assert(!select_results_retrieve(ids[0], 0, 3, true, false, &window, &total_size));
+    g_bytes_unref(window);
+    g_usleep(1100 * 1000);
+    g_assert(select_results_retrieve(ids[0], 0, 3, true, false, &window, &total_size) ==
+             KV_ERROR_FILE_NOT_FOUND);
+    unsetenv("KV_SELECT_RESULTS_MEMORY");
+    unsetenv("KV_SELECT_RESULTS_TTL");
+    unsetenv("KV_SELECT_RESULTS_DIR");
+}
+
+static void test_exist_index(void) {
+    setenv("KV_BASE_DIR", "/tmp", 1);
+    kv_store_init();
+    unsigned char key[4] = "ex";
+    g_assert(store_object(4294967294, 4294967293, key, sizeof(key), (unsigned char *)"v", 1,
+                          false, false, true) == 1);
+    g_assert(file_exist(4294967294, 4294967293, key, sizeof(key)) == 1);
+    g_assert(store_object(4294967294, 4294967293, key, sizeof(key), (unsigned char *)"v", 1,
+                          false, false, true) == KV_ERROR_FILE_EXISTS);
+    g_assert(!delete_object(4294967294, 4294967293, key, sizeof(key)));
+    g_assert(file_exist(4294967294, 4294967293, key, sizeof(key)) == 0);
+    g_assert(store_object(4294967294, 4294967293, key, sizeof(key), (unsigned char *)"v", 1,
+                          true, true, false) == KV_ERROR_FILE_NOT_FOUND);
+    g_assert(store_object(4294967294, 4294967293, key, sizeof(key), (unsigned char *)"v", 1,
+                          false, false, true) == 1);
+    // a fresh index is rebuilt from the directory
+    kv_store_init();
+    g_assert(file_exist(4294967294, 4294967293, key, sizeof(key)) == 1);
+    g_assert(!delete_object(4294967294, 4294967293, key, sizeof(key)));
+    g_assert(file_exist(4294967294, 4294967293, key, sizeof(key)) == 0);
+}
+
 static void* test_json_to_csv_with_header(void* arg) {    
     size_t output_len;
     unsigned char *results;
@@ -266,6 +607,254 @@ static void* test_csv_to_csv_no_header(void* arg) {
     return NULL;
 }
 
+static void* test_csv_to_csv_to_fd(void* arg) {
+    int fds[2];
+    g_assert(!pipe(fds));
+    g_assert(!run_query_to_fd(4294967295, 4294967295, (unsigned char*)"test_with_header.csv", sizeof("test_with_header.csv"), (char *)"select name,age from s3object",
+                              QUERY_TYPE_CSV, QUERY_TYPE_CSV, true, true, fds[1]));
+    close(fds[1]);
+    char buffer[64];
+    size_t len = 0;
+    ssize_t n;
+    while ((n = read(fds[0], buffer + len, sizeof(buffer) - 1 - len)) > 0) {
+        len += n;
+    }
+    close(fds[0]);
+    buffer[len] = '\0';
+    g_assert(!strcmp((const char *)buffer, "name,age\nBob,18\n"));
+    return NULL;
+}
+
+static void test_csv_plan_cache(void) {
+    const char *before = "name,age\nBob,18";
+    const char *after = "name,age\nAmy,21";
+    g_assert(store_object(4294967295, 4294967295, (unsigned char*)"plan.csv", sizeof("plan.csv"), (unsigned char*)before,
+                        strlen(before), false, false, false) == strlen(before));
+    /* plans are only kept for objects not modified within the last second */
+    sleep(2);
+    for (int i = 0; i < 2; i++) {
+        size_t output_len;
+        unsigned char *results;
+        g_assert(!run_query(4294967295, 4294967295, (unsigned char*)"plan.csv", sizeof("plan.csv"), (char *)"select name from  s3object",
+                          &output_len, QUERY_TYPE_CSV, QUERY_TYPE_CSV, true, false, &results));
+        g_assert(output_len == 4 && !memcmp(results, "Bob\n", 4));
+        free(results);
+    }
+    /* same size, the cached plan must not be used for the new contents */
+    g_assert(store_object(4294967295, 4294967295, (unsigned char*)"plan.csv", sizeof("plan.csv"), (unsigned char*)after,
+                        strlen(after), false, false, false) == strlen(after));
+    size_t output_len;
+    unsigned char *results;
+    g_assert(!run_query(4294967295, 4294967295, (unsigned char*)"plan.csv", sizeof("plan.csv"), (char *)"select name from s3object;",
+                      &output_len, QUERY_TYPE_CSV, QUERY_TYPE_CSV, true, false, &results));
+    g_assert(output_len == 4 && !memcmp(results, "Amy\n", 4));
+    free(results);
+    g_assert(!delete_object(4294967295, 4294967295, (unsigned char*)"plan.csv", sizeof("plan.csv")));
+}
+
+static void test_csv_line_comment(void) {
+    size_t output_len;
+    unsigned char *results;
+
+    /* the query is run as written, so a line comment ends with its line */
+    g_assert(!run_query(4294967295, 4294967295, (unsigned char*)"test_with_header.csv", sizeof("test_with_header.csv"),
+                        (char *)"select name -- read from the object\nfrom s3object\nwhere age > 10 -- adults only",
+                        &output_len, QUERY_TYPE_CSV, QUERY_TYPE_CSV, true, false, &results));
+    g_assert(output_len == 4 && !memcmp(results, "Bob\n", 4));
+    free(results);
+}
+
+static void test_csv_parquet_shadow(void) {
+    const char *before = "name,age\nBob,18";
+    const char *after = "name,age\nAmy,21";
+    size_t output_len;
+    unsigned char *results;
+
+    setenv("KV_PARQUET_NAMESPACES", "4294967294:csv-header", 1);
+    kv_store_init();
+    g_assert(store_object(4294967295, 4294967294, (unsigned char*)"shadow.csv", sizeof("shadow.csv"), (unsigned char*)before,
+                        strlen(before), false, false, false) == strlen(before));
+    g_assert(!query_transcode_to_parquet(4294967295, 4294967294, (unsigned char*)"shadow.csv", sizeof("shadow.csv"), NULL));
+    g_autofree char *shadow = kv_shadow_path(4294967295, 4294967294, (unsigned char*)"shadow.csv", sizeof("shadow.csv"), false);
+    g_assert(g_file_test(shadow, G_FILE_TEST_EXISTS));
+    g_assert(!run_query(4294967295, 4294967294, (unsigned char*)"shadow.csv", sizeof("shadow.csv"), (char *)"select name from s3object where age > 10",
+                      &output_len, QUERY_TYPE_CSV, QUERY_TYPE_CSV, true, false, &results));
+    g_assert(output_len == 4 && !memcmp(results, "Bob\n", 4));
+    free(results);
+
+    /* an update drops the shadow, queries read the new contents */
+    g_assert(store_object(4294967295, 4294967294, (unsigned char*)"shadow.csv", sizeof("shadow.csv"), (unsigned char*)after,
+                        strlen(after), false, false, false) == strlen(after));
+    g_assert(!g_file_test(shadow, G_FILE_TEST_EXISTS));
+    g_assert(!run_query(4294967295, 4294967294, (unsigned char*)"shadow.csv", sizeof("shadow.csv"), (char *)"select name from s3object where age > 10",
+                      &output_len, QUERY_TYPE_CSV, QUERY_TYPE_CSV, true, false, &results));
+    g_assert(output_len == 4 && !memcmp(results, "Amy\n", 4));
+    free(results);
+    g_assert(!delete_object(4294967295, 4294967294, (unsigned char*)"shadow.csv", sizeof("shadow.csv")));
+    unsetenv("KV_PARQUET_NAMESPACES");
+    kv_store_init();
+}
+
+static void test_csv_key_prefix(void) {
+    const char *keys[] = { "day-1", "day-2", "day-3", "dz" };
+    const char *values[] = { "x\n1", "x\n2", "x\n3", "x\n100" };
+    size_t output_len;
+    unsigned char *results;
+
+    for (int i = 0; i < 4; i++) {
+        g_assert(store_object(4294967295, 4294967295, (unsigned char*)keys[i], strlen(keys[i]), (unsigned char*)values[i],
+                            strlen(values[i]), false, false, false) == strlen(values[i]));
+    }
+    g_assert(!run_query_prefix(4294967295, 4294967295, (unsigned char*)"day-", 4, (char *)"select sum(x) from s3object",
+                             &output_len, QUERY_TYPE_CSV, QUERY_TYPE_CSV, true, false, &results));
+    g_assert(output_len == 2 && !memcmp(results, "6\n", 2));
+    free(results);
+    g_assert(run_query_prefix(4294967295, 4294967295, (unsigned char*)"month-", 6, (char *)"select sum(x) from s3object",
+                            &output_len, QUERY_TYPE_CSV, QUERY_TYPE_CSV, true, false, &results) == KV_ERROR_FILE_NOT_FOUND);
+    for (int i = 0; i < 4; i++) {
+        g_assert(!delete_object(4294967295, 4294967295, (unsigned char*)keys[i], strlen(keys[i])));
+    }
+}
+
+static void test_csv_gzip(void) {
+    /* "x\n1\n2\n" compressed with gzip */
+    const unsigned char gz[] = "\x1f\x8b\x08\x00\x00\x00\x00\x00\x02\x03\xab\xe0\x32\xe4\x32\xe2"
+                               "\x02\x00\xd3\x91\xa6\x54\x06\x00\x00\x00";
+    size_t output_len;
+    unsigned char *results;
+
+    g_assert(store_object(4294967295, 4294967295, (unsigned char*)"gzip.csv", sizeof("gzip.csv"), (unsigned char*)gz,
+                        sizeof(gz) - 1, false, false, false) == sizeof(gz) - 1);
+    g_assert(!run_query(4294967295, 4294967295, (unsigned char*)"gzip.csv", sizeof("gzip.csv"), (char *)"select sum(x) from s3object",
+                      &output_len, QUERY_TYPE_CSV, QUERY_TYPE_CSV, true, false, &results));
+    g_assert(output_len == 2 && !memcmp(results, "3\n", 2));
+    free(results);
+    g_assert(!delete_object(4294967295, 4294967295, (unsigned char*)"gzip.csv", sizeof("gzip.csv")));
+}
+
+static void test_csv_select_into(void) {
+    const char *csv = "x\n1\n2\n3";
+    unsigned char buffer[16];
+    size_t total_size;
+    uint64_t rows;
+    size_t output_len;
+
+    g_assert(store_object(4294967295, 4294967295, (unsigned char*)"into.csv", sizeof("into.csv"), (unsigned char*)csv,
+                        strlen(csv), false, false, false) == strlen(csv));
+    g_assert(!query_run_into(4294967295, 4294967295, (unsigned char*)"into.csv", sizeof("into.csv"), false,
+                           (char *)"select x from s3object where x > 1", QUERY_TYPE_CSV, QUERY_TYPE_CSV, true, false, NULL,
+                           (unsigned char*)"into.out", sizeof("into.out"), &rows, &output_len));
+    g_assert(rows == 2 && output_len == 4);
+    g_assert(read_object(4294967295, 4294967295, (unsigned char*)"into.out", sizeof("into.out"), 0, buffer, sizeof(buffer),
+                         &total_size) == 4);
+    g_assert(!memcmp(buffer, "2\n3\n", 4));
+
+    /* a result of several megabytes is stored a piece at a time */
+    g_assert(!query_run_into(4294967295, 4294967295, (unsigned char*)"into.csv", sizeof("into.csv"), false,
+                           (char *)"select x * 1000000 + range from s3object, range(300000)", QUERY_TYPE_CSV, QUERY_TYPE_CSV,
+                           true, false, NULL, (unsigned char*)"into.out", sizeof("into.out"), &rows, &output_len));
+    g_assert(rows == 900000 && output_len > 4 * 1024 * 1024);
+    g_assert(read_object(4294967295, 4294967295, (unsigned char*)"into.out", sizeof("into.out"), 0, buffer, sizeof(buffer),
+                         &total_size) > 0);
+    g_assert(total_size == output_len);
+    g_assert(!delete_object(4294967295, 4294967295, (unsigned char*)"into.csv", sizeof("into.csv")));
+    g_assert(!delete_object(4294967295, 4294967295, (unsigned char*)"into.out", sizeof("into.out")));
+}
+
+static void test_arrow(void) {
+    size_t output_len;
+    unsigned char *results;
+    uint64_t rows;
+
+    /* table functions reading raw memory are not available to queries */
+    g_assert(run_query(4294967295, 4294967295, (unsigned char*)"test.csv", sizeof("test.csv"),
+                       (char *)"select * from s3object, SCAN_ARROW_IPC([{'ptr': 4096::UBIGINT, 'size': 64::UBIGINT}])",
+                       &output_len, QUERY_TYPE_CSV, QUERY_TYPE_CSV, false, false, &results) == KV_ERROR_INVALID_PARAMETER);
+    g_assert(run_query(4294967295, 4294967295, (unsigned char*)"test.csv", sizeof("test.csv"),
+                       (char *)"select * from arrow_scan(4096, 4096, 4096)",
+                       &output_len, QUERY_TYPE_CSV, QUERY_TYPE_CSV, false, false, &results) == KV_ERROR_INVALID_PARAMETER);
+    g_assert(run_query(4294967295, 4294967295, (unsigned char*)"test.csv", sizeof("test.csv"),
+                       (char *)"select * from U&\"\\0061rrow_scan\"(4096, 4096, 4096)",
+                       &output_len, QUERY_TYPE_CSV, QUERY_TYPE_CSV, false, false, &results) == KV_ERROR_INVALID_PARAMETER);
+
+    int status = query_run_into(4294967295, 4294967295, (unsigned char*)"test_with_header.csv", sizeof("test_with_header.csv"),
+                                false, (char *)"select name, age from s3object", QUERY_TYPE_CSV, QUERY_TYPE_ARROW, true, false,
+                                NULL, (unsigned char*)"test.arrow", sizeof("test.arrow"), &rows, &output_len);
+    if (status == KV_ERROR_QUERY) {
+        /* the arrow extension of duckdb is not installed */
+        return;
+    }
+    g_assert(!status && output_len > 0);
+    g_assert(!run_query(4294967295, 4294967295, (unsigned char*)"test.arrow", sizeof("test.arrow"), (char *)"select name from s3object where age > 10",
+                      &output_len, QUERY_TYPE_ARROW, QUERY_TYPE_CSV, false, false, &results));
+    g_assert(output_len == 4 && !memcmp(results, "Bob\n", 4));
+    free(results);
+    g_assert(!delete_object(4294967295, 4294967295, (unsigned char*)"test.arrow", sizeof("test.arrow")));
+}
+
+static void test_query_settings(void) {
+    size_t output_len;
+    unsigned char *results;
+
+    g_assert(!run_query(4294967295, 4294967295, (unsigned char*)"test.csv", sizeof("test.csv"), (char *)"select current_setting('threads') from s3object",
+                      &output_len, QUERY_TYPE_CSV, QUERY_TYPE_CSV, false, false, &results));
+    g_assert(output_len == 2 && !memcmp(results, "2\n", 2));
+    free(results);
+
+    /* namespace settings may name the controller */
+    QueryCancel *cancel = query_cancel_new(1, 7);
+    g_assert(cancel->deadline);
+    g_free(cancel);
+    cancel = query_cancel_new(2, 7);
+    g_assert(!cancel->deadline);
+    g_free(cancel);
+}
+
+static void *test_query_cancel_busy(void *arg) {
+    size_t output_len;
+    unsigned char *results;
+
+    /* holds the only connection until cancelled */
+    g_assert(query_run(4294967295, 4294967295, (unsigned char*)"test.csv", sizeof("test.csv"), false, (char *)"select sum(range) from s3object, range(100000000000)",
+                     &output_len, QUERY_TYPE_CSV, QUERY_TYPE_CSV, false, false, arg, &results) == KV_ERROR_QUERY_CANCELLED);
+    return NULL;
+}
+
+static void test_query_cancel(void) {
+    QueryCancel cancel = { 0 };
+    size_t output_len;
+    unsigned char *results;
+
+    query_cancel(&cancel);
+    g_assert(query_run(4294967295, 4294967295, (unsigned char*)"test.csv", sizeof("test.csv"), false, (char *)"select * from s3object",
+                     &output_len, QUERY_TYPE_CSV, QUERY_TYPE_CSV, false, false, &cancel, &results) == KV_ERROR_QUERY_CANCELLED);
+
+    /* would run for hours */
+    cancel.cancelled = false;
+    cancel.deadline = g_get_monotonic_time() + 200 * 1000;
+    g_assert(query_run(4294967295, 4294967295, (unsigned char*)"test.csv", sizeof("test.csv"), false, (char *)"select sum(range) from s3object, range(100000000000)",
+                     &output_len, QUERY_TYPE_CSV, QUERY_TYPE_CSV, false, false, &cancel, &results) == KV_ERROR_QUERY_TIMEOUT);
+    g_assert(g_get_monotonic_time() - cancel.deadline < 5 * G_USEC_PER_SEC);
+
+    /* a query waiting for a connection gives up at its deadline */
+    QueryCancel busy = { 0 };
+    QueryPoolStats stats;
+    pthread_t thread;
+    pthread_create(&thread, NULL, test_query_cancel_busy, &busy);
+    do {
+        g_usleep(10 * 1000);
+        query_get_pool_stats(&stats);
+    } while (!stats.busy);
+    cancel.deadline = g_get_monotonic_time() + 200 * 1000;
+    g_assert(query_run(4294967295, 4294967295, (unsigned char*)"test.csv", sizeof("test.csv"), false, (char *)"select * from s3object",
+                     &output_len, QUERY_TYPE_CSV, QUERY_TYPE_CSV, false, false, &cancel, &results) == KV_ERROR_QUERY_TIMEOUT);
+    g_assert(g_get_monotonic_time() - cancel.deadline < 5 * G_USEC_PER_SEC);
+    query_get_pool_stats(&stats);
+    g_assert(!stats.waiting);
+    query_cancel(&busy);
+    pthread_join(thread, NULL);
+}
+
 static void* test_json_to_json(void* arg) {
     size_t output_len;
     unsigned char *results;
@@ -341,6 +930,26 @@ static void* test_json_with_semicolon(void* arg) {
     return NULL;
 }
 
+static void test_csv_log_namespace(void) {
+    size_t output_len;
+    unsigned char *results;
+
+    // log objects are streamed to the query, appends make them several extents
+    setenv("KV_LOG_NAMESPACES", "4294967293", 1);
+    kv_store_init();
+    g_assert(store_object(4294967295, 4294967293, (unsigned char*)"log.csv", sizeof("log.csv"), (unsigned char*)"x\n1\n",
+                        4, false, false, false) == 4);
+    g_assert(store_object(4294967295, 4294967293, (unsigned char*)"log.csv", sizeof("log.csv"), (unsigned char*)"2\n",
+                        2, true, true, false) == 2);
+    g_assert(!run_query(4294967295, 4294967293, (unsigned char*)"log.csv", sizeof("log.csv"), (char *)"select sum(x) from s3object",
+                      &output_len, QUERY_TYPE_CSV, QUERY_TYPE_CSV, true, false, &results));
+    g_assert(output_len == 2 && !memcmp(results, "3\n", 2));
+    free(results);
+    g_assert(!delete_object(4294967295, 4294967293, (unsigned char*)"log.csv", sizeof("log.csv")));
+    unsetenv("KV_LOG_NAMESPACES");
+    kv_store_init();
+}
+
 static void test_serial(void) {
     setenv("KV_BASE_DIR", "/tmp", 1);
     kv_store_init();
@@ -366,9 +975,15 @@ static void test_serial(void) {
     g_assert(store_object(4294967295, 4294967295, (unsigned char*)"test_with_header.csv", sizeof("test_with_header.csv"), (unsigned char*)csv_with_header,
                         strlen(csv_with_header), false, false, false) == (strlen(csv_with_header)));
 
+    setenv("KV_QUERY_THREADS", "2", 1);
+    setenv("KV_QUERY_TIMEOUT_MS", "0,1:7:60000", 1);
     query_init_db(1);
+    unsetenv("KV_QUERY_THREADS");
+    unsetenv("KV_QUERY_TIMEOUT_MS");
+    test_query_settings();
     test_csv_to_csv_no_header(NULL);
     test_csv_to_csv_with_header(NULL);
+    test_csv_to_csv_to_fd(NULL);
     test_csv_to_json_no_header(NULL);
     test_csv_to_json_with_header(NULL);
     test_json_to_csv_no_header(NULL);
@@ -379,8 +994,25 @@ static void test_serial(void) {
     test_json_groupby_clause(NULL);
     test_json_limit_clause(NULL);
     test_json_with_semicolon(NULL);
+    test_csv_plan_cache();
+    test_csv_line_comment();
+    test_csv_parquet_shadow();
+    test_csv_key_prefix();
+    test_csv_gzip();
+    test_csv_log_namespace();
+    test_csv_select_into();
+    test_arrow();
+    test_query_cancel();
 
     query_close_db();
+    /* a database that cannot be opened fails the queries, not the caller */
+    setenv("KV_QUERY_THREADS", "bad", 1);
+    g_assert(query_init_db(1) == KV_ERROR_DUCKDB);
+    unsetenv("KV_QUERY_THREADS");
+    size_t output_len;
+    unsigned char *results;
+    g_assert(run_query(4294967295, 4294967295, (unsigned char*)"test.csv", sizeof("test.csv"), (char *)"select * from s3object",
+                     &output_len, QUERY_TYPE_CSV, QUERY_TYPE_CSV, false, false, &results) == KV_ERROR_DUCKDB);
     g_assert(!delete_object(4294967295, 4294967295, (unsigned char*)"test.json", sizeof("test.json")));
     g_assert(!delete_object(4294967295, 4294967295, (unsigned char*)"test.csv", sizeof("test.csv")));
     g_assert(!delete_object(4294967295, 4294967295, (unsigned char*)"test_with_header.csv", sizeof("test_with_header.csv")));
@@ -429,6 +1061,14 @@ static void test_concurrent(void) {
     for (int i = 0; i < 12; ++i) {
         pthread_join(threads[i], NULL);
     }
+    QueryPoolStats stats;
+    query_get_pool_stats(&stats);
+    g_assert(stats.acquisitions == 12 && stats.size == 3 && stats.open == 3 && !stats.busy &&
+             !stats.waiting);
+    g_assert(!query_resize_pool(1));
+    test_json_where_clause(NULL);
+    query_get_pool_stats(&stats);
+    g_assert(stats.acquisitions == 13 && stats.size == 1 && stats.open == 1);
     query_close_db();
     g_assert(!delete_object(4294967295, 4294967295, (unsigned char*)"test.json", sizeof("test.json")));
     g_assert(!delete_object(4294967295, 4294967295, (unsigned char*)"test.csv", sizeof("test.csv")));
@@ -441,6 +1081,14 @@ int main(int argc, char **argv)
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/kv/test_string", test_string);
     g_test_add_func("/kv/test_binary", test_binary);
+    g_test_add_func("/kv/test_list_paging", test_list_paging);
+    g_test_add_func("/kv/test_dir_levels", test_dir_levels);
+    g_test_add_func("/kv/test_log_backend", test_log_backend);
+    g_test_add_func("/kv/test_iov", test_iov);
+    g_test_add_func("/kv/test_fd_cache", test_fd_cache);
+    g_test_add_func("/kv/test_value_cache", test_value_cache);
+    g_test_add_func("/kv/test_select_results", test_select_results);
+    g_test_add_func("/kv/test_exist_index", test_exist_index);
     g_test_add_func("/kv/test_serial", test_serial);
     g_test_add_func("/kv/test_concurrent", test_concurrent);
     return g_test_run();
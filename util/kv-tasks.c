@@ -10,65 +10,284 @@
 
 #include "qemu/kv-tasks.h"
 #include "qemu/kv_store.h"
+#include "qemu/kv_shadow.h"
+#include "qemu/kv_io.h"
+#include "qemu/kv_utils.h"
+#include "qemu/coroutine.h"
+#include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/thread.h"
 #include "qemu/query.h"
+#include "qemu/select-results.h"
 
 #define KV_TASK_NUM_THREADS 5
+#define KV_TASK_NUM_QUERY_THREADS 2
 #define KV_TASK_NUM_DB_CONNS 5
+#define KV_TASK_IO_URING_DEPTH 128
+
+/* Requests are pushed onto the inbox of one worker, preferably an idle one.
+ * The inboxes and the completion list are lock-free stacks: producers push
+ * with a cmpxchg, consumers take the whole stack with an xchg and reverse it
+ * to restore submission order. A worker which runs out of work steals the
+ * inbox of another worker before going to sleep.
+ *
+ * SELECTs run on their own set of query workers (KV_NUM_QUERY_THREADS) so
+ * long queries cannot occupy the point workers (KV_NUM_THREADS) which serve
+ * store, retrieve, list, delete and exists. Query workers help out with
+ * point requests when there is no query work, point workers never pick up
+ * a SELECT.
+ *
+ * With KV_IO_ENGINE=io_uring every point worker runs up to
+ * KV_IO_URING_DEPTH requests of file namespaces at once, each in its own
+ * coroutine whose file system calls go through the io_uring of the worker
+ * (see kv_io.h). Log namespaces take locks across their I/O and keep
+ * running outside of coroutines.
+ */
+typedef QSLIST_HEAD(KvTaskRequestList, kv_task_request) KvTaskRequestList;
+
+typedef enum KvTaskClass {
+    KV_TASK_CLASS_POINT,
+    KV_TASK_CLASS_QUERY,
+    KV_TASK_CLASS__MAX
+} KvTaskClass;
+
+/* a contiguous range of engine->workers */
+typedef struct KvTaskWorkerSet {
+    int first;
+    int count;
+    unsigned int next_worker;
+} KvTaskWorkerSet;
+
+typedef struct KvTaskWorker {
+    KvTaskEngine *engine;
+    QemuThread thread;
+    QemuEvent wakeup;
+    KvTaskRequestList inbox;
+    KvTaskClass task_class;
+    int index;
+    bool idle;
+    /* io_uring engine */
+    KvIoRing *ring;
+    EventNotifier ring_wakeup;
+    /* blocked in the ring, producers have to kick ring_wakeup */
+    bool ring_waiting;
+    int active;
+} KvTaskWorker;
+
+typedef struct KvTaskCo {
+    KvTaskWorker *worker;
+    kv_task_request *request;
+} KvTaskCo;
+
+struct KvTaskEngine {
+    KvTaskWorker *workers;
+    int num_workers;
+    KvTaskWorkerSet sets[KV_TASK_CLASS__MAX];
+    /* requests in flight per io_uring worker, 0 for blocking I/O */
+    int io_depth;
+    bool running;
+    bool stopping;
+    /* parent of the SELECT tokens and the token of the conversions, which
+     * stopping or draining the engine trips
+     */
+    QueryCancel cancel;
+    /* requests added and not done yet */
+    unsigned int in_flight;
+    QemuEvent drained;
+    /* pushed by the workers */
+    QSLIST_HEAD(, kv_task_result) completed;
+    /* taken from completed in submission order, consumer only */
+    QSLIST_HEAD(, kv_task_result) ready;
+    /* the notifier has been set and the consumer has not looked yet */
+    bool notify_pending;
+    EventNotifier *notifier;
+};
 
-static QSIMPLEQ_HEAD(, kv_task_request) requests =
-    QSIMPLEQ_HEAD_INITIALIZER(requests);
-static QSIMPLEQ_HEAD(, kv_task_result) results =
-    QSIMPLEQ_HEAD_INITIALIZER(results);
-
-static QemuMutex requests_mutex;
-static QemuMutex results_mutex;
-static QemuThread *task_threads;
-static int num_threads;
-static int num_db_conns;
-static EventNotifier *notifier;
-static QemuCond tasks_cond;
 static bool init;
 
 static void *kv_tasks_run_thread(void *opaque);
 
-void kv_tasks_init(EventNotifier *event_notifier) {
+/* process wide state shared by all engines */
+static void kv_tasks_init(void) {
+    int num_db_conns = 0;
+
     if (init) {
         return;
     }
     init = true;
-    assert(qemu_in_main_thread());
-    notifier = event_notifier;
-    qemu_mutex_init(&requests_mutex);
-    qemu_mutex_init(&results_mutex);
-    qemu_cond_init(&tasks_cond);
     kv_store_init();
 
-    const char *num_threads_env = getenv("KV_NUM_THREADS");
-    if (num_threads_env) {
-        num_threads = atoi(num_threads_env);
+    const char *num_db_conns_env = getenv("KV_NUM_DB_CONNS");
+    if (num_db_conns_env) {
+        num_db_conns = atoi(num_db_conns_env);
+    }
+    if (num_db_conns <= 0 || num_db_conns > 256) {
+        num_db_conns = KV_TASK_NUM_DB_CONNS;
+    }
+    /* the error has been reported, SELECTs then fail with KV_ERROR_DUCKDB */
+    if (query_init_db(num_db_conns)) {
+        error_report("KV SELECT is not available");
+    }
+}
+
+static int kv_tasks_num_threads(const char *name, int default_value) {
+    const char *env = getenv(name);
+    int num_threads = 0;
+
+    if (env) {
+        num_threads = atoi(env);
     }
     if (num_threads <= 0 || num_threads > 1024) {
-        num_threads = KV_TASK_NUM_THREADS;
+        num_threads = default_value;
+    }
+    return num_threads;
+}
+
+/* sets up the io_uring engine on the point workers if it is configured */
+static void kv_tasks_init_rings(KvTaskEngine *engine) {
+    KvTaskWorkerSet *set = &engine->sets[KV_TASK_CLASS_POINT];
+    const char *io_engine = getenv("KV_IO_ENGINE");
+
+    if (!io_engine || !strcmp(io_engine, "threads")) {
+        return;
+    }
+    if (strcmp(io_engine, "io_uring")) {
+        warn_report("KV_IO_ENGINE: unknown engine '%s', using threads", io_engine);
+        return;
+    }
+    engine->io_depth = kv_tasks_num_threads("KV_IO_URING_DEPTH", KV_TASK_IO_URING_DEPTH);
+    for (int i = set->first; i < set->first + set->count; i++) {
+        KvTaskWorker *worker = &engine->workers[i];
+
+        event_notifier_init(&worker->ring_wakeup, 0);
+        /* one more entry for the wakeup poll */
+        worker->ring = kv_io_ring_new(engine->io_depth + 1,
+                                      event_notifier_get_fd(&worker->ring_wakeup));
+        if (!worker->ring) {
+            event_notifier_cleanup(&worker->ring_wakeup);
+            warn_report("KV_IO_ENGINE: io_uring is not available, using threads");
+            for (int j = set->first; j < i; j++) {
+                kv_io_ring_free(engine->workers[j].ring);
+                engine->workers[j].ring = NULL;
+                event_notifier_cleanup(&engine->workers[j].ring_wakeup);
+            }
+            engine->io_depth = 0;
+            return;
+        }
     }
-    task_threads = g_new0(QemuThread, num_threads);
+}
+
+static KvTaskClass kv_tasks_class(kv_task_type task_type) {
+    return task_type == KV_TASK_SEND_SELECT || task_type == KV_TASK_TRANSCODE ?
+           KV_TASK_CLASS_QUERY : KV_TASK_CLASS_POINT;
+}
+
+KvTaskEngine *kv_tasks_engine_new(EventNotifier *event_notifier) {
+    KvTaskEngine *engine;
+    int num_threads;
+
+    assert(qemu_in_main_thread());
+    kv_tasks_init();
+
+    engine = g_new0(KvTaskEngine, 1);
+    QSLIST_INIT(&engine->completed);
+    QSLIST_INIT(&engine->ready);
+    engine->notifier = event_notifier;
+
+    engine->sets[KV_TASK_CLASS_POINT].count =
+        kv_tasks_num_threads("KV_NUM_THREADS", KV_TASK_NUM_THREADS);
+    engine->sets[KV_TASK_CLASS_QUERY].first = engine->sets[KV_TASK_CLASS_POINT].count;
+    engine->sets[KV_TASK_CLASS_QUERY].count =
+        kv_tasks_num_threads("KV_NUM_QUERY_THREADS", KV_TASK_NUM_QUERY_THREADS);
+    num_threads = engine->sets[KV_TASK_CLASS_POINT].count +
+                  engine->sets[KV_TASK_CLASS_QUERY].count;
+
+    engine->num_workers = num_threads;
+    engine->workers = g_new0(KvTaskWorker, num_threads);
     for (int i = 0; i < num_threads; i++) {
-        qemu_thread_create(task_threads + i, "kv_task", kv_tasks_run_thread,
-                           NULL, QEMU_THREAD_DETACHED);
+        KvTaskWorker *worker = &engine->workers[i];
+
+        worker->engine = engine;
+        worker->index = i;
+        worker->task_class = i < engine->sets[KV_TASK_CLASS_QUERY].first ?
+                             KV_TASK_CLASS_POINT : KV_TASK_CLASS_QUERY;
+        QSLIST_INIT(&worker->inbox);
+        qemu_event_init(&worker->wakeup, false);
     }
+    qemu_event_init(&engine->drained, false);
+    kv_tasks_init_rings(engine);
+    for (int i = 0; i < num_threads; i++) {
+        qemu_thread_create(&engine->workers[i].thread, "kv_task", kv_tasks_run_thread,
+                           &engine->workers[i], QEMU_THREAD_JOINABLE);
+    }
+    engine->running = true;
+    return engine;
+}
 
-    const char *num_db_conns_env = getenv("KV_NUM_DB_CONNS");
-    if (num_db_conns_env) {
-        num_db_conns = atoi(num_db_conns_env);
+void kv_tasks_engine_stop(KvTaskEngine *engine) {
+    assert(qemu_in_main_thread());
+    if (!engine->running) {
+        return;
     }
-    if (num_db_conns <= 0 || num_db_conns > 256) {
-        num_db_conns = KV_TASK_NUM_DB_CONNS;
+    qatomic_set(&engine->stopping, true);
+    query_cancel(&engine->cancel);
+    for (int i = 0; i < engine->num_workers; i++) {
+        qemu_event_set(&engine->workers[i].wakeup);
+    }
+    for (int i = 0; i < engine->num_workers; i++) {
+        qemu_thread_join(&engine->workers[i].thread);
+    }
+    engine->running = false;
+}
+
+void kv_tasks_engine_drain(KvTaskEngine *engine) {
+    assert(qemu_in_main_thread());
+    query_cancel(&engine->cancel);
+    while (1) {
+        qemu_event_reset(&engine->drained);
+        smp_mb();
+        if (!qatomic_read(&engine->in_flight)) {
+            break;
+        }
+        qemu_event_wait(&engine->drained);
     }
-    query_init_db(num_db_conns);
+    /* conversions queued meanwhile were cancelled, the next store redoes them */
+    qatomic_set(&engine->cancel.cancelled, false);
 }
 
-int kv_tasks_add_request_with_params(kv_task_type task_type, uint32_t bus_number, uint32_t namespace_id,
+void kv_tasks_engine_free(KvTaskEngine *engine) {
+    kv_task_result *result;
+
+    if (!engine) {
+        return;
+    }
+    kv_tasks_engine_stop(engine);
+    while ((result = kv_tasks_get_next_result(engine))) {
+        kv_tasks_free_result(result);
+    }
+    for (int i = 0; i < engine->num_workers; i++) {
+        KvTaskWorker *worker = &engine->workers[i];
+        kv_task_request *request;
+
+        /* conversions queued after the workers left */
+        while ((request = QSLIST_FIRST(&worker->inbox))) {
+            QSLIST_REMOVE_HEAD(&worker->inbox, request_list);
+            g_free(request->select_cancel);
+            g_free(request);
+        }
+
+        if (worker->ring) {
+            kv_io_ring_free(worker->ring);
+            event_notifier_cleanup(&worker->ring_wakeup);
+        }
+        qemu_event_destroy(&worker->wakeup);
+    }
+    qemu_event_destroy(&engine->drained);
+    g_free(engine->workers);
+    g_free(engine);
+}
+
+int kv_tasks_add_request_with_params(KvTaskEngine *engine, kv_task_type task_type, uint32_t bus_number, uint32_t namespace_id,
     void *nvme_cmd, unsigned char *key, size_t key_length, unsigned char *data, size_t data_length,
     size_t max_length, bool must_exist, bool must_not_exist, bool append, size_t offset,
     Query_Data_Type select_input_type, Query_Data_Type select_output_type,
@@ -96,26 +315,79 @@ int kv_tasks_add_request_with_params(kv_task_type task_type, uint32_t bus_number
     request->select_output_type = select_output_type;
     request->use_csv_headers_input = use_csv_headers_input;
     request->use_csv_headers_output = use_csv_headers_output;
-    kv_tasks_add_request(request);
+    kv_tasks_add_request(engine, request);
     return 0;
 }
 
-void kv_tasks_add_request(kv_task_request *request) {
-    qemu_mutex_lock(&requests_mutex);
-    QSIMPLEQ_INSERT_TAIL(&requests, request, request_list);
-    qemu_mutex_unlock(&requests_mutex);
-    qemu_cond_signal(&tasks_cond);
+/* claims an idle worker of the set, scanning from its round-robin cursor */
+static KvTaskWorker *kv_tasks_claim_idle(KvTaskEngine *engine, KvTaskWorkerSet *set,
+                                         unsigned int start) {
+    for (int i = 0; i < set->count; i++) {
+        KvTaskWorker *worker = &engine->workers[set->first + (start + i) % set->count];
+
+        if (qatomic_read(&worker->idle) &&
+            qatomic_cmpxchg(&worker->idle, true, false)) {
+            return worker;
+        }
+    }
+    return NULL;
 }
 
-kv_task_result *kv_tasks_get_next_result(void) {
+bool kv_tasks_add_request(KvTaskEngine *engine, kv_task_request *request) {
+    KvTaskClass task_class = kv_tasks_class(request->task_type);
+    KvTaskWorkerSet *set = &engine->sets[task_class];
+    unsigned int start = qatomic_fetch_inc(&set->next_worker);
+    KvTaskWorker *target;
+
+    if (qatomic_read(&engine->stopping)) {
+        /* commands come from the main thread, which stops the engine, but
+         * workers queue conversions while it does so
+         */
+        assert(request->task_type == KV_TASK_TRANSCODE);
+        g_free(request);
+        return false;
+    }
+    if (request->select_cancel) {
+        request->select_cancel->parent = &engine->cancel;
+    }
+    qatomic_inc(&engine->in_flight);
+    target = kv_tasks_claim_idle(engine, set, start);
+    if (!target && task_class == KV_TASK_CLASS_POINT) {
+        target = kv_tasks_claim_idle(engine, &engine->sets[KV_TASK_CLASS_QUERY], start);
+    }
+    if (!target) {
+        target = &engine->workers[set->first + start % set->count];
+    }
+    QSLIST_INSERT_HEAD_ATOMIC(&target->inbox, request, request_list);
+    qemu_event_set(&target->wakeup);
+    if (qatomic_read(&target->ring_waiting) &&
+        qatomic_xchg(&target->ring_waiting, false)) {
+        event_notifier_set(&target->ring_wakeup);
+    }
+    return true;
+}
+
+kv_task_result *kv_tasks_get_next_result(KvTaskEngine *engine) {
     assert(qemu_in_main_thread());
-    qemu_mutex_lock(&results_mutex);
 
-    kv_task_result *result = QSIMPLEQ_FIRST(&results);
+    if (QSLIST_EMPTY(&engine->ready)) {
+        QSLIST_HEAD(, kv_task_result) batch;
+        kv_task_result *result;
+
+        /* results pushed from here on set the notifier again */
+        qatomic_set(&engine->notify_pending, false);
+        smp_mb();
+        QSLIST_MOVE_ATOMIC(&batch, &engine->completed);
+        while ((result = QSLIST_FIRST(&batch))) {
+            QSLIST_REMOVE_HEAD(&batch, result_list);
+            QSLIST_INSERT_HEAD(&engine->ready, result, result_list);
+        }
+    }
+
+    kv_task_result *result = QSLIST_FIRST(&engine->ready);
     if (result) {
-        QSIMPLEQ_REMOVE_HEAD(&results, result_list);
+        QSLIST_REMOVE_HEAD(&engine->ready, result_list);
     }
-    qemu_mutex_unlock(&results_mutex);
     return result;
 }
 
@@ -123,10 +395,11 @@ void kv_tasks_free_result(kv_task_result *result) {
     if (result->result) {
         g_free(result->result);
     }
+    g_free(result->select_cancel);
     g_free(result);
 }
 
-static void kv_tasks_send_result(kv_task_request *request, ssize_t status,
+static void kv_tasks_send_result(KvTaskEngine *engine, kv_task_request *request, ssize_t status,
                                  void *result_data, size_t result_data_length,
                                  size_t max_length) {
     kv_task_result *result;
@@ -138,102 +411,296 @@ static void kv_tasks_send_result(kv_task_request *request, ssize_t status,
     result->result = result_data;
     result->result_length = result_data_length;
     result->max_length = max_length;
-    qemu_mutex_lock(&results_mutex);
-    QSIMPLEQ_INSERT_TAIL(&results, result, result_list);
-    qemu_mutex_unlock(&results_mutex);
+    result->iov = request->iov;
+    result->iov_count = request->iov_count;
+    result->select_id = request->select_id;
+    result->select_cancel = request->select_cancel;
+    result->select_into = request->select_into_key_length;
+    QSLIST_INSERT_HEAD_ATOMIC(&engine->completed, result, result_list);
 
     if (request->data) {
         g_free(request->data);
     }
     g_free(request);
-    event_notifier_set(notifier);
+    if (!qatomic_xchg(&engine->notify_pending, true)) {
+        event_notifier_set(engine->notifier);
+    }
 }
 
-static void *kv_tasks_run_thread(void *opaque) {
-    while (1) {
-        qemu_mutex_lock(&requests_mutex);
-        kv_task_request *request = QSIMPLEQ_FIRST(&requests);
-        if (request) {
-            QSIMPLEQ_REMOVE_HEAD(&requests, request_list);
-        } else {
-            qemu_cond_wait(&tasks_cond, &requests_mutex);
-            request = QSIMPLEQ_FIRST(&requests);
-            if (request) {
-                QSIMPLEQ_REMOVE_HEAD(&requests, request_list);
-            }
-        }
-        qemu_mutex_unlock(&requests_mutex);
-        if (!request) {
-            continue;
+static void kv_tasks_steal(KvTaskEngine *engine, KvTaskWorkerSet *set, int start,
+                           KvTaskRequestList *batch) {
+    for (int i = 0; i < set->count && QSLIST_EMPTY(batch); i++) {
+        KvTaskWorker *victim = &engine->workers[set->first + (start + i) % set->count];
+
+        if (qatomic_read(&QSLIST_FIRST(&victim->inbox))) {
+            QSLIST_MOVE_ATOMIC(batch, &victim->inbox);
         }
-        ssize_t status = -1;
-        size_t result_data_length = 0;
-        size_t max_length = 0;
-        void *result_data = NULL;
-        switch (request->task_type) {
-        case KV_TASK_STORE: {
+    }
+}
+
+/* takes the inbox of the worker or, when it is empty, the one of another
+ * worker and queues it on the private list of the worker in FIFO order
+ */
+static bool kv_tasks_take_requests(KvTaskWorker *worker, KvTaskRequestList *pending) {
+    KvTaskRequestList batch;
+    KvTaskEngine *engine = worker->engine;
+    KvTaskWorkerSet *set = &engine->sets[worker->task_class];
+    kv_task_request *request;
+
+    QSLIST_INIT(&batch);
+    /* starting with the own inbox */
+    kv_tasks_steal(engine, set, worker->index - set->first, &batch);
+    if (QSLIST_EMPTY(&batch) && worker->task_class == KV_TASK_CLASS_QUERY) {
+        kv_tasks_steal(engine, &engine->sets[KV_TASK_CLASS_POINT], worker->index, &batch);
+    }
+    if (QSLIST_EMPTY(&batch)) {
+        return false;
+    }
+    while ((request = QSLIST_FIRST(&batch))) {
+        QSLIST_REMOVE_HEAD(&batch, request_list);
+        QSLIST_INSERT_HEAD(pending, request, request_list);
+    }
+    return true;
+}
+
+/* converts the stored object to Parquet on a query worker; queries stream
+ * the objects of a log namespace and never read their shadows
+ */
+static void kv_tasks_queue_transcode(KvTaskEngine *engine, uint32_t bus_number,
+                                     uint32_t namespace_id, const unsigned char *key,
+                                     size_t key_length) {
+    Query_Data_Type input_format;
+    bool use_csv_headers;
+
+    if (kv_namespace_uses_log(namespace_id) ||
+        !kv_shadow_policy(namespace_id, &input_format, &use_csv_headers)) {
+        return;
+    }
+    kv_task_request *request = g_new0(kv_task_request, 1);
+    request->task_type = KV_TASK_TRANSCODE;
+    request->bus_number = bus_number;
+    request->namespace_id = namespace_id;
+    memcpy(request->key, key, key_length);
+    request->key_length = key_length;
+    kv_tasks_add_request(engine, request);
+}
+
+static void kv_tasks_process(KvTaskEngine *engine, kv_task_request *request) {
+    ssize_t status = -1;
+    size_t result_data_length = 0;
+    size_t max_length = 0;
+    void *result_data = NULL;
+    switch (request->task_type) {
+    case KV_TASK_STORE: {
+        if (request->iov) {
+            status = store_object_iov(
+                request->bus_number, request->namespace_id, request->key,
+                request->key_length, request->iov, request->iov_count,
+                request->append, request->must_exist, request->must_not_exist);
+        } else {
             status = store_object(
                 request->bus_number, request->namespace_id, request->key,
                 request->key_length, request->data, request->data_length,
                 request->append, request->must_exist, request->must_not_exist);
-        } break;
-        case KV_TASK_RETRIEVE: {
-            unsigned char *buffer = g_malloc(request->max_length);
-            if (!buffer) {
-                break;
-            }
+        }
+        /* the store dropped the shadow; an appended object is left without
+         * one, as converting it again after every append costs quadratic work
+         */
+        if (status >= 0 && !request->append) {
+            kv_tasks_queue_transcode(engine, request->bus_number, request->namespace_id,
+                                     request->key, request->key_length);
+        }
+    } break;
+    case KV_TASK_RETRIEVE: {
+        if (request->iov) {
             size_t total_size = 0;
-            status =
-                read_object(request->bus_number, request->namespace_id,
-                            request->key, request->key_length, request->offset,
-                            buffer, request->max_length, &total_size);
-            if (status > 0) {
-                result_data = (void *)buffer;
-                result_data_length = request->max_length < total_size
-                                         ? request->max_length
-                                         : total_size;
+            status = read_object_iov(request->bus_number, request->namespace_id,
+                                     request->key, request->key_length, request->offset,
+                                     request->iov, request->iov_count, &total_size);
+            if (status >= 0) {
+                result_data_length = status;
                 max_length = total_size;
-            } else {
-                g_free(buffer);
             }
-        } break;
-        case KV_TASK_LIST: {
-            ObjectKey *list;
-            size_t num_objects = 0;
-            status =
-                list_objects(request->bus_number, request->namespace_id,
-                             request->key, request->key_length, request->offset,
-                             request->max_length, &num_objects, &list);
-            result_data_length = num_objects;
-            result_data = (void *)list;
-        } break;
-        case KV_TASK_DELETE: {
-            status = (ssize_t)delete_object(request->bus_number,
-                                            request->namespace_id, request->key,
-                                            request->key_length);
-        } break;
-        case KV_TASK_EXISTS: {
-            status =
-                (ssize_t)file_exist(request->bus_number, request->namespace_id,
-                                    request->key, request->key_length);
-        } break;
-        case KV_TASK_SEND_SELECT: {
+            break;
+        }
+        unsigned char *buffer = g_malloc(request->max_length);
+        if (!buffer) {
+            break;
+        }
+        size_t total_size = 0;
+        status =
+            read_object(request->bus_number, request->namespace_id,
+                        request->key, request->key_length, request->offset,
+                        buffer, request->max_length, &total_size);
+        if (status > 0) {
+            result_data = (void *)buffer;
+            result_data_length = request->max_length < total_size
+                                     ? request->max_length
+                                     : total_size;
+            max_length = total_size;
+        } else {
+            g_free(buffer);
+        }
+    } break;
+    case KV_TASK_LIST: {
+        ObjectKey *list;
+        size_t num_objects = 0;
+        status =
+            list_objects(request->bus_number, request->namespace_id,
+                         request->key, request->key_length, request->offset,
+                         request->max_length, &num_objects, &list);
+        result_data_length = num_objects;
+        result_data = (void *)list;
+    } break;
+    case KV_TASK_DELETE: {
+        status = (ssize_t)delete_object(request->bus_number,
+                                        request->namespace_id, request->key,
+                                        request->key_length);
+    } break;
+    case KV_TASK_EXISTS: {
+        status =
+            (ssize_t)file_exist(request->bus_number, request->namespace_id,
+                                request->key, request->key_length);
+    } break;
+    case KV_TASK_SEND_SELECT: {
+        if (request->select_id) {
+            status = query_run_to_fd(request->bus_number, request->namespace_id, request->key,
+                                     request->key_length, request->select_key_prefix,
+                                     (char *) request->data, request->select_input_type,
+                                     request->select_output_type,
+                                     request->use_csv_headers_input,
+                                     request->use_csv_headers_output, request->select_cancel,
+                                     request->select_stream_fd);
+            select_results_finish_stream(request->select_id, status);
+            close(request->select_stream_fd);
+            break;
+        }
+        if (request->select_into_key_length) {
+            uint64_t rows;
             size_t output_len;
-            unsigned char *result;
-            status = run_query(request->bus_number, request->namespace_id, request->key, request->key_length,
-                               (char *) request->data, &output_len, request->select_input_type, request->select_output_type,
-                                request->use_csv_headers_input, request->use_csv_headers_output, &result);
+            status = query_run_into(request->bus_number, request->namespace_id, request->key,
+                                    request->key_length, request->select_key_prefix,
+                                    (char *) request->data, request->select_input_type,
+                                    request->select_output_type,
+                                    request->use_csv_headers_input,
+                                    request->use_csv_headers_output, request->select_cancel,
+                                    request->select_into_key,
+                                    request->select_into_key_length, &rows, &output_len);
             if (status == 0) {
-                result_data = (void *) result;
+                kv_tasks_queue_transcode(engine, request->bus_number, request->namespace_id,
+                                         request->select_into_key,
+                                         request->select_into_key_length);
                 result_data_length = output_len;
+                max_length = rows;
             }
-        } break;
-
-        default:
-            status = -1;
             break;
         }
-        kv_tasks_send_result(request, status, result_data, result_data_length,
-                             max_length);
+        size_t output_len;
+        unsigned char *result;
+        status = query_run(request->bus_number, request->namespace_id, request->key,
+                           request->key_length, request->select_key_prefix,
+                           (char *) request->data, &output_len, request->select_input_type,
+                           request->select_output_type, request->use_csv_headers_input,
+                           request->use_csv_headers_output, request->select_cancel, &result);
+        if (status == 0) {
+            /* stored here as a result over the memory budget is written to disk */
+            request->select_id = select_results_store(result, output_len);
+            if (!request->select_id) {
+                status = KV_ERROR_FILE_WRITE;
+            }
+        }
+    } break;
+    case KV_TASK_TRANSCODE: {
+        query_transcode_to_parquet(request->bus_number, request->namespace_id, request->key,
+                                   request->key_length, &engine->cancel);
+        g_free(request);
+    } return;
+
+    default:
+        status = -1;
+        break;
+    }
+    kv_tasks_send_result(engine, request, status, result_data, result_data_length,
+                         max_length);
+}
+
+static void kv_tasks_request_done(KvTaskEngine *engine) {
+    if (qatomic_fetch_dec(&engine->in_flight) == 1) {
+        qemu_event_set(&engine->drained);
+    }
+}
+
+static void coroutine_fn kv_tasks_co_process(void *opaque) {
+    KvTaskCo *task = opaque;
+
+    kv_tasks_process(task->worker->engine, task->request);
+    kv_tasks_request_done(task->worker->engine);
+    task->worker->active--;
+    g_free(task);
+}
+
+/* waits for in-flight requests of the io_uring engine; unless the worker is
+ * at its depth, new requests in the inbox end the wait as well
+ */
+static void kv_tasks_ring_wait(KvTaskWorker *worker, KvTaskRequestList *pending) {
+    bool full = worker->active >= worker->engine->io_depth;
+
+    if (!full) {
+        qatomic_set(&worker->ring_waiting, true);
+        smp_mb();
+        if (!QSLIST_EMPTY(pending) || qatomic_read(&QSLIST_FIRST(&worker->inbox))) {
+            qatomic_set(&worker->ring_waiting, false);
+            return;
+        }
+    }
+    if (kv_io_ring_wait(worker->ring)) {
+        event_notifier_test_and_clear(&worker->ring_wakeup);
+    }
+    qatomic_set(&worker->ring_waiting, false);
+}
+
+static void *kv_tasks_run_thread(void *opaque) {
+    KvTaskWorker *worker = opaque;
+    KvTaskEngine *engine = worker->engine;
+    KvTaskRequestList pending = QSLIST_HEAD_INITIALIZER(pending);
+
+    kv_io_ring_attach(worker->ring);
+    while (1) {
+        kv_task_request *request;
+
+        if (worker->active &&
+            (worker->active >= engine->io_depth ||
+             (QSLIST_EMPTY(&pending) && !kv_tasks_take_requests(worker, &pending)))) {
+            kv_tasks_ring_wait(worker, &pending);
+            continue;
+        }
+        if (QSLIST_EMPTY(&pending) && !kv_tasks_take_requests(worker, &pending)) {
+            qatomic_set(&worker->idle, true);
+            qemu_event_reset(&worker->wakeup);
+            /* check again, a producer may have missed the idle flag */
+            if (!kv_tasks_take_requests(worker, &pending)) {
+                if (qatomic_read(&engine->stopping)) {
+                    /* stopping and everything queued has been processed */
+                    kv_io_ring_attach(NULL);
+                    return NULL;
+                }
+                qemu_event_wait(&worker->wakeup);
+                continue;
+            }
+            qatomic_set(&worker->idle, false);
+        }
+        request = QSLIST_FIRST(&pending);
+        QSLIST_REMOVE_HEAD(&pending, request_list);
+        if (worker->ring && !kv_namespace_uses_log(request->namespace_id)) {
+            KvTaskCo *task = g_new(KvTaskCo, 1);
+
+            task->worker = worker;
+            task->request = request;
+            worker->active++;
+            qemu_coroutine_enter(qemu_coroutine_create(kv_tasks_co_process, task));
+        } else {
+            kv_tasks_process(engine, request);
+            kv_tasks_request_done(engine);
+        }
     }
 }
@@ -0,0 +1,172 @@
+/*
+ * KV Storage Open File Cache
+ *
+ * Copyright (C) 2023 AirMettle, Inc.
+ *
+ * This code is licensed under the GNU GPL v2 or later.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/kv_utils.h"
+#include "qemu/kv_fd_cache.h"
+
+#define KV_FD_CACHE_SIZE 256
+
+typedef struct KvFdCacheNode {
+    KvFdCacheEntry entry;
+    KvObjectId key;
+    int refcnt;
+    /* in the table and the LRU list */
+    bool cached;
+    QTAILQ_ENTRY(KvFdCacheNode) lru;
+} KvFdCacheNode;
+
+typedef QTAILQ_HEAD(, KvFdCacheNode) KvFdCacheList;
+
+static GHashTable *nodes;
+/* most recently used first */
+static KvFdCacheList lru = QTAILQ_HEAD_INITIALIZER(lru);
+static QemuMutex lock;
+static unsigned int capacity;
+static unsigned int count;
+/* bumped by every invalidation */
+static uint64_t generation;
+static bool init;
+
+static void kv_fd_cache_free(KvFdCacheNode *node) {
+    close(node->entry.fd);
+    g_free(node);
+}
+
+/* called with lock held, unreferenced nodes are moved to dead for closing
+ * once the lock is dropped
+ */
+static void kv_fd_cache_remove_locked(KvFdCacheNode *node, KvFdCacheList *dead) {
+    g_hash_table_remove(nodes, &node->key);
+    QTAILQ_REMOVE(&lru, node, lru);
+    node->cached = false;
+    count--;
+    if (!node->refcnt) {
+        QTAILQ_INSERT_TAIL(dead, node, lru);
+    }
+}
+
+static void kv_fd_cache_free_list(KvFdCacheList *dead) {
+    KvFdCacheNode *node, *next;
+
+    QTAILQ_FOREACH_SAFE(node, dead, lru, next) {
+        kv_fd_cache_free(node);
+    }
+}
+
+KvFdCacheEntry *kv_fd_cache_get(uint32_t bus_number, uint32_t namespace_id,
+                                const unsigned char *key, size_t key_len,
+                                uint64_t *gen) {
+    KvObjectId k;
+    KvFdCacheNode *node = NULL;
+
+    if (!init || !kv_object_id_init(&k, bus_number, namespace_id, key, key_len)) {
+        *gen = 0;
+        return NULL;
+    }
+    qemu_mutex_lock(&lock);
+    *gen = generation;
+    node = g_hash_table_lookup(nodes, &k);
+    if (node) {
+        node->refcnt++;
+        QTAILQ_REMOVE(&lru, node, lru);
+        QTAILQ_INSERT_HEAD(&lru, node, lru);
+    }
+    qemu_mutex_unlock(&lock);
+    return node ? &node->entry : NULL;
+}
+
+KvFdCacheEntry *kv_fd_cache_insert(uint32_t bus_number, uint32_t namespace_id,
+                                   const unsigned char *key, size_t key_len, int fd,
+                                   off_t size, uint64_t gen) {
+    KvFdCacheNode *node = g_new0(KvFdCacheNode, 1);
+    KvFdCacheList dead = QTAILQ_HEAD_INITIALIZER(dead);
+
+    node->entry.fd = fd;
+    node->entry.size = size;
+    node->refcnt = 1;
+    if (!init || !kv_object_id_init(&node->key, bus_number, namespace_id, key, key_len)) {
+        return &node->entry;
+    }
+
+    qemu_mutex_lock(&lock);
+    if (capacity && gen == generation && !g_hash_table_contains(nodes, &node->key)) {
+        g_hash_table_insert(nodes, &node->key, node);
+        QTAILQ_INSERT_HEAD(&lru, node, lru);
+        node->cached = true;
+        count++;
+        while (count > capacity) {
+            kv_fd_cache_remove_locked(QTAILQ_LAST(&lru), &dead);
+        }
+    }
+    qemu_mutex_unlock(&lock);
+    kv_fd_cache_free_list(&dead);
+    return &node->entry;
+}
+
+void kv_fd_cache_put(KvFdCacheEntry *entry) {
+    KvFdCacheNode *node = container_of(entry, KvFdCacheNode, entry);
+    bool free_node;
+
+    if (!init) {
+        kv_fd_cache_free(node);
+        return;
+    }
+    qemu_mutex_lock(&lock);
+    free_node = !--node->refcnt && !node->cached;
+    qemu_mutex_unlock(&lock);
+    if (free_node) {
+        kv_fd_cache_free(node);
+    }
+}
+
+void kv_fd_cache_invalidate(uint32_t bus_number, uint32_t namespace_id,
+                            const unsigned char *key, size_t key_len) {
+    KvFdCacheList dead = QTAILQ_HEAD_INITIALIZER(dead);
+    KvFdCacheNode *node;
+    KvObjectId k;
+
+    if (!init) {
+        return;
+    }
+    qemu_mutex_lock(&lock);
+    generation++;
+    if (kv_object_id_init(&k, bus_number, namespace_id, key, key_len)) {
+        node = g_hash_table_lookup(nodes, &k);
+        if (node) {
+            kv_fd_cache_remove_locked(node, &dead);
+        }
+    }
+    qemu_mutex_unlock(&lock);
+    kv_fd_cache_free_list(&dead);
+}
+
+void kv_fd_cache_reset(void) {
+    KvFdCacheList dead = QTAILQ_HEAD_INITIALIZER(dead);
+    const char *size_env = getenv("KV_FD_CACHE_SIZE");
+
+    if (!init) {
+        init = true;
+        qemu_mutex_init(&lock);
+        nodes = g_hash_table_new(kv_object_id_hash, kv_object_id_equal);
+    }
+    qemu_mutex_lock(&lock);
+    generation++;
+    while (!QTAILQ_EMPTY(&lru)) {
+        kv_fd_cache_remove_locked(QTAILQ_FIRST(&lru), &dead);
+    }
+    capacity = KV_FD_CACHE_SIZE;
+    if (size_env) {
+        int size = atoi(size_env);
+        capacity = size < 0 ? KV_FD_CACHE_SIZE : size;
+    }
+    qemu_mutex_unlock(&lock);
+    kv_fd_cache_free_list(&dead);
+}
@@ -0,0 +1,538 @@
+/*
+ * KV Storage Ordered Key Index
+ *
+ * Copyright (C) 2023 AirMettle, Inc.
+ *
+ * This code is licensed under the GNU GPL v2 or later.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/kv_index.h"
+#include "qemu/kv_store.h"
+#include "qemu/kv_backend.h"
+#include "qemu/thread.h"
+
+#define KV_INDEX_MAX_LEVEL 32
+#define KV_INDEX_SNAPSHOT_MAGIC "KVIDX002"
+#define KV_INDEX_SNAPSHOT_SUFFIX ".kvindex"
+
+typedef struct KvIndexNode {
+    unsigned char key[KV_KEY_MAX_LENGTH];
+    uint8_t key_len;
+    uint8_t level;
+    struct {
+        struct KvIndexNode *next;
+        /* number of level 0 steps to next, or to the end of the list */
+        size_t span;
+    } link[];
+} KvIndexNode;
+
+typedef struct KvIndex {
+    uint64_t id;
+    uint32_t bus_number;
+    uint32_t namespace_id;
+    QemuMutex lock;
+    bool loaded;
+    /* creates/removes between begin_update and end_update */
+    int pending;
+    KvIndexNode *head;
+    int level;
+    size_t length;
+    uint32_t rand_state;
+} KvIndex;
+
+typedef struct KvIndexSnapshotHeader {
+    char magic[8];
+    uint64_t count;
+    /* mtimes of the namespace dir and its shard dirs */
+    uint64_t dir_fingerprint;
+} KvIndexSnapshotHeader;
+
+static GHashTable *indexes;
+static QemuMutex indexes_mutex;
+static bool init;
+
+/* on the main thread, from kv_index_reset() */
+static void kv_index_init(void) {
+    if (init) {
+        return;
+    }
+    init = true;
+    qemu_mutex_init(&indexes_mutex);
+    indexes = g_hash_table_new(g_int64_hash, g_int64_equal);
+    atexit(kv_index_save_all);
+}
+
+static int kv_index_cmp(const unsigned char *a, size_t a_len,
+                        const unsigned char *b, size_t b_len) {
+    /* same order as comparing the hex file names with strcmp */
+    size_t len = MIN(a_len, b_len);
+    int res = len ? memcmp(a, b, len) : 0;
+    if (res) {
+        return res;
+    }
+    return a_len < b_len ? -1 : (a_len > b_len);
+}
+
+static KvIndexNode *kv_index_node_new(int level, const unsigned char *key, size_t key_len) {
+    KvIndexNode *node = g_malloc0(sizeof(KvIndexNode) + level * sizeof(node->link[0]));
+    node->level = level;
+    node->key_len = key_len;
+    if (key_len) {
+        memcpy(node->key, key, key_len);
+    }
+    return node;
+}
+
+static int kv_index_random_level(KvIndex *idx) {
+    int level = 1;
+    /* xorshift32, p = 1/4 per level */
+    while (level < KV_INDEX_MAX_LEVEL) {
+        idx->rand_state ^= idx->rand_state << 13;
+        idx->rand_state ^= idx->rand_state >> 17;
+        idx->rand_state ^= idx->rand_state << 5;
+        if (idx->rand_state & 3) {
+            break;
+        }
+        level++;
+    }
+    return level;
+}
+
+static void kv_index_clear(KvIndex *idx) {
+    KvIndexNode *node = idx->head->link[0].next;
+    while (node) {
+        KvIndexNode *next = node->link[0].next;
+        g_free(node);
+        node = next;
+    }
+    for (int i = 0; i < KV_INDEX_MAX_LEVEL; i++) {
+        idx->head->link[i].next = NULL;
+        idx->head->link[i].span = 0;
+    }
+    idx->level = 1;
+    idx->length = 0;
+}
+
+static bool kv_index_insert(KvIndex *idx, const unsigned char *key, size_t key_len) {
+    KvIndexNode *update[KV_INDEX_MAX_LEVEL];
+    size_t rank[KV_INDEX_MAX_LEVEL];
+    KvIndexNode *x = idx->head;
+
+    for (int i = idx->level - 1; i >= 0; i--) {
+        rank[i] = i == idx->level - 1 ? 0 : rank[i + 1];
+        while (x->link[i].next &&
+               kv_index_cmp(x->link[i].next->key, x->link[i].next->key_len, key, key_len) < 0) {
+            rank[i] += x->link[i].span;
+            x = x->link[i].next;
+        }
+        update[i] = x;
+    }
+    x = x->link[0].next;
+    if (x && !kv_index_cmp(x->key, x->key_len, key, key_len)) {
+        return false;
+    }
+
+    int level = kv_index_random_level(idx);
+    if (level > idx->level) {
+        for (int i = idx->level; i < level; i++) {
+            rank[i] = 0;
+            update[i] = idx->head;
+            update[i]->link[i].span = idx->length;
+        }
+        idx->level = level;
+    }
+
+    x = kv_index_node_new(level, key, key_len);
+    for (int i = 0; i < level; i++) {
+        x->link[i].next = update[i]->link[i].next;
+        update[i]->link[i].next = x;
+        x->link[i].span = update[i]->link[i].span - (rank[0] - rank[i]);
+        update[i]->link[i].span = (rank[0] - rank[i]) + 1;
+    }
+    for (int i = level; i < idx->level; i++) {
+        update[i]->link[i].span++;
+    }
+    idx->length++;
+    return true;
+}
+
+static bool kv_index_remove(KvIndex *idx, const unsigned char *key, size_t key_len) {
+    KvIndexNode *update[KV_INDEX_MAX_LEVEL];
+    KvIndexNode *x = idx->head;
+
+    for (int i = idx->level - 1; i >= 0; i--) {
+        while (x->link[i].next &&
+               kv_index_cmp(x->link[i].next->key, x->link[i].next->key_len, key, key_len) < 0) {
+            x = x->link[i].next;
+        }
+        update[i] = x;
+    }
+    x = x->link[0].next;
+    if (!x || kv_index_cmp(x->key, x->key_len, key, key_len)) {
+        return false;
+    }
+
+    for (int i = 0; i < idx->level; i++) {
+        if (update[i]->link[i].next == x) {
+            update[i]->link[i].span += x->link[i].span - 1;
+            update[i]->link[i].next = x->link[i].next;
+        } else {
+            update[i]->link[i].span--;
+        }
+    }
+    while (idx->level > 1 && !idx->head->link[idx->level - 1].next) {
+        idx->level--;
+    }
+    idx->length--;
+    g_free(x);
+    return true;
+}
+
+/* number of keys that sort before key */
+static size_t kv_index_lower_bound_rank(KvIndex *idx, const unsigned char *key, size_t key_len) {
+    KvIndexNode *x = idx->head;
+    size_t traversed = 0;
+
+    for (int i = idx->level - 1; i >= 0; i--) {
+        while (x->link[i].next &&
+               kv_index_cmp(x->link[i].next->key, x->link[i].next->key_len, key, key_len) < 0) {
+            traversed += x->link[i].span;
+            x = x->link[i].next;
+        }
+    }
+    return traversed;
+}
+
+static bool kv_index_contains(KvIndex *idx, const unsigned char *key, size_t key_len) {
+    KvIndexNode *x = idx->head;
+
+    for (int i = idx->level - 1; i >= 0; i--) {
+        while (x->link[i].next &&
+               kv_index_cmp(x->link[i].next->key, x->link[i].next->key_len, key, key_len) < 0) {
+            x = x->link[i].next;
+        }
+    }
+    x = x->link[0].next;
+    return x && !kv_index_cmp(x->key, x->key_len, key, key_len);
+}
+
+/* rank is 1-based */
+static KvIndexNode *kv_index_get_by_rank(KvIndex *idx, size_t rank) {
+    KvIndexNode *x = idx->head;
+    size_t traversed = 0;
+
+    for (int i = idx->level - 1; i >= 0; i--) {
+        while (x->link[i].next && traversed + x->link[i].span <= rank) {
+            traversed += x->link[i].span;
+            x = x->link[i].next;
+        }
+        if (traversed == rank) {
+            return x;
+        }
+    }
+    return NULL;
+}
+
+static char *kv_index_snapshot_path(const char *dir_path) {
+    /* dir_path ends with '/', the snapshot lives beside the namespace directory */
+    size_t len = strlen(dir_path);
+    while (len > 1 && dir_path[len - 1] == '/') {
+        len--;
+    }
+    return g_strdup_printf("%.*s%s", (int)len, dir_path, KV_INDEX_SNAPSHOT_SUFFIX);
+}
+
+static int kv_index_fingerprint_dir(const char *dir_path, void *opaque) {
+    uint64_t *fingerprint = opaque;
+    struct stat st;
+    uint64_t h;
+
+    if (stat(dir_path, &st)) {
+        return KV_ERROR_FILE_PATH;
+    }
+    h = (uint64_t)st.st_ino * 0x9E3779B97F4A7C15ull;
+    h ^= (uint64_t)st.st_mtime * 0xC2B2AE3D27D4EB4Full;
+#ifdef CONFIG_DARWIN
+    h ^= (uint64_t)st.st_mtimespec.tv_nsec * 0x165667B19E3779F9ull;
+#else
+    h ^= (uint64_t)st.st_mtim.tv_nsec * 0x165667B19E3779F9ull;
+#endif
+    /* readdir order is not stable, so combine independent of order */
+    *fingerprint += h ^ (h >> 29);
+    return 0;
+}
+
+static int kv_index_fingerprint(KvIndex *idx, uint64_t *fingerprint) {
+    *fingerprint = 0;
+    return kv_walk_objects(idx->bus_number, idx->namespace_id, NULL, kv_index_fingerprint_dir,
+                           fingerprint);
+}
+
+static bool kv_index_load_snapshot(KvIndex *idx, const char *dir_path) {
+    KvIndexSnapshotHeader header;
+    uint64_t fingerprint;
+    bool ok = false;
+
+    char *snapshot_path = kv_index_snapshot_path(dir_path);
+    FILE *file = fopen(snapshot_path, "rb");
+    if (!file) {
+        g_free(snapshot_path);
+        return false;
+    }
+    /* only valid until the next update, and a crash must not leave it behind */
+    remove(snapshot_path);
+    g_free(snapshot_path);
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, KV_INDEX_SNAPSHOT_MAGIC, sizeof(header.magic)) ||
+        kv_index_fingerprint(idx, &fingerprint) || header.dir_fingerprint != fingerprint) {
+        /* foreign or the tree changed after it was written */
+        goto out;
+    }
+    for (uint64_t i = 0; i < header.count; i++) {
+        unsigned char key[KV_KEY_MAX_LENGTH];
+        int key_len = fgetc(file);
+        if (key_len == EOF || key_len > KV_KEY_MAX_LENGTH ||
+            (key_len && fread(key, key_len, 1, file) != 1)) {
+            kv_index_clear(idx);
+            goto out;
+        }
+        kv_index_insert(idx, key, key_len);
+    }
+    ok = true;
+out:
+    fclose(file);
+    return ok;
+}
+
+static int kv_index_scan_object(const unsigned char *key, size_t key_len, const char *path_str,
+                                void *opaque) {
+    kv_index_insert(opaque, key, key_len);
+    return 0;
+}
+
+static void kv_index_save_snapshot(KvIndex *idx) {
+    KvIndexSnapshotHeader header;
+    const char *dir_path = get_path_str(idx->bus_number, idx->namespace_id, NULL, 0, false);
+    if (!dir_path) {
+        return;
+    }
+    char *snapshot_path = kv_index_snapshot_path(dir_path);
+    char *tmp_path = g_strdup_printf("%s.tmp", snapshot_path);
+    FILE *file = NULL;
+
+    memcpy(header.magic, KV_INDEX_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.count = idx->length;
+    if (kv_index_fingerprint(idx, &header.dir_fingerprint)) {
+        goto out;
+    }
+
+    file = fopen(tmp_path, "wb");
+    if (!file) {
+        goto out;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (KvIndexNode *x = idx->head->link[0].next; x && ok; x = x->link[0].next) {
+        ok = fputc(x->key_len, file) != EOF &&
+             (!x->key_len || fwrite(x->key, x->key_len, 1, file) == 1);
+    }
+    if (fclose(file) || !ok) {
+        remove(tmp_path);
+        goto out;
+    }
+    rename(tmp_path, snapshot_path);
+out:
+    g_free(tmp_path);
+    g_free(snapshot_path);
+    free((void *)dir_path);
+}
+
+static KvIndex *kv_index_get(uint32_t bus_number, uint32_t namespace_id) {
+    uint64_t id = ((uint64_t)bus_number << 32) | namespace_id;
+    KvIndex *idx;
+
+    /* kv_store_init() has been called */
+    assert(init);
+    qemu_mutex_lock(&indexes_mutex);
+    idx = g_hash_table_lookup(indexes, &id);
+    if (!idx) {
+        idx = g_new0(KvIndex, 1);
+        idx->id = id;
+        idx->bus_number = bus_number;
+        idx->namespace_id = namespace_id;
+        qemu_mutex_init(&idx->lock);
+        idx->head = kv_index_node_new(KV_INDEX_MAX_LEVEL, NULL, 0);
+        idx->level = 1;
+        idx->rand_state = (uint32_t)(id * 2654435761u) | 1;
+        g_hash_table_insert(indexes, &idx->id, idx);
+    }
+    qemu_mutex_unlock(&indexes_mutex);
+    return idx;
+}
+
+/* called with idx->lock held */
+static int kv_index_load(KvIndex *idx) {
+    if (idx->loaded) {
+        return 0;
+    }
+    int res = 0;
+    bool loaded = false;
+    if (kv_store_backend(idx->namespace_id)->index_snapshots) {
+        const char *dir_path = get_path_str(idx->bus_number, idx->namespace_id, NULL, 0, true);
+        if (!dir_path) {
+            return KV_ERROR_FILE_PATH;
+        }
+        loaded = kv_index_load_snapshot(idx, dir_path);
+        free((void *)dir_path);
+    }
+    if (!loaded) {
+        res = kv_store_walk_keys(idx->bus_number, idx->namespace_id, kv_index_scan_object, idx);
+    }
+    if (!res) {
+        idx->loaded = true;
+    }
+    return res;
+}
+
+void kv_index_begin_update(uint32_t bus_number, uint32_t namespace_id) {
+    KvIndex *idx = kv_index_get(bus_number, namespace_id);
+    qemu_mutex_lock(&idx->lock);
+    idx->pending++;
+    qemu_mutex_unlock(&idx->lock);
+}
+
+void kv_index_end_update(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                         size_t key_len, const char *path_str) {
+    KvIndex *idx = kv_index_get(bus_number, namespace_id);
+    qemu_mutex_lock(&idx->lock);
+    /* an unloaded index picks the change up from the directory when it loads */
+    if (idx->loaded && key_len <= KV_KEY_MAX_LENGTH) {
+        /* creates and removes of the same key may race, so whoever finishes
+         * last records what is actually on disk
+         */
+        if (access(path_str, F_OK) == 0) {
+            kv_index_insert(idx, key, key_len);
+        } else {
+            kv_index_remove(idx, key, key_len);
+        }
+    }
+    idx->pending--;
+    qemu_mutex_unlock(&idx->lock);
+}
+
+void kv_index_set(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                  size_t key_len, bool present) {
+    KvIndex *idx = kv_index_get(bus_number, namespace_id);
+    qemu_mutex_lock(&idx->lock);
+    if (idx->loaded && key_len <= KV_KEY_MAX_LENGTH) {
+        if (present) {
+            kv_index_insert(idx, key, key_len);
+        } else {
+            kv_index_remove(idx, key, key_len);
+        }
+    }
+    qemu_mutex_unlock(&idx->lock);
+}
+
+int kv_index_list(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key_prefix,
+                  size_t key_prefix_len, size_t offset, size_t max_to_return,
+                  size_t *num_objects_returned, ObjectKey **objects) {
+    KvIndex *idx = kv_index_get(bus_number, namespace_id);
+
+    *num_objects_returned = 0;
+    *objects = NULL;
+    qemu_mutex_lock(&idx->lock);
+    int res = kv_index_load(idx);
+    if (res) {
+        qemu_mutex_unlock(&idx->lock);
+        return res;
+    }
+
+    size_t start = kv_index_lower_bound_rank(idx, key_prefix, key_prefix_len);
+    if (start + offset >= idx->length) {
+        qemu_mutex_unlock(&idx->lock);
+        return 0;
+    }
+    size_t count = MIN(idx->length - start - offset, max_to_return);
+    ObjectKey *list = malloc(count * sizeof(ObjectKey));
+    if (!list) {
+        qemu_mutex_unlock(&idx->lock);
+        return KV_ERROR_MEMORY_ALLOCATION;
+    }
+
+    KvIndexNode *x = kv_index_get_by_rank(idx, start + offset + 1);
+    for (size_t i = 0; i < count; i++, x = x->link[0].next) {
+        memcpy(list[i].key, x->key, x->key_len);
+        list[i].key_len = x->key_len;
+    }
+    qemu_mutex_unlock(&idx->lock);
+
+    *num_objects_returned = count;
+    *objects = list;
+    return 0;
+}
+
+int kv_index_lookup(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                    size_t key_len) {
+    if (key_len > KV_KEY_MAX_LENGTH) {
+        return KV_ERROR_KEY_TOO_LONG;
+    }
+    KvIndex *idx = kv_index_get(bus_number, namespace_id);
+    qemu_mutex_lock(&idx->lock);
+    int res = kv_index_load(idx);
+    if (!res) {
+        res = kv_index_contains(idx, key, key_len);
+    }
+    qemu_mutex_unlock(&idx->lock);
+    return res;
+}
+
+static void kv_index_save_locked(KvIndex *idx) {
+    /* a create/remove in flight may already be visible in the directory
+     * mtime but not in the index, so don't record that state
+     */
+    if (idx->loaded && !idx->pending &&
+        kv_store_backend(idx->namespace_id)->index_snapshots) {
+        kv_index_save_snapshot(idx);
+    }
+}
+
+void kv_index_save_all(void) {
+    GHashTableIter iter;
+    gpointer value;
+
+    if (!init) {
+        return;
+    }
+    qemu_mutex_lock(&indexes_mutex);
+    g_hash_table_iter_init(&iter, indexes);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        KvIndex *idx = value;
+        qemu_mutex_lock(&idx->lock);
+        kv_index_save_locked(idx);
+        qemu_mutex_unlock(&idx->lock);
+    }
+    qemu_mutex_unlock(&indexes_mutex);
+}
+
+void kv_index_reset(void) {
+    GHashTableIter iter;
+    gpointer value;
+
+    kv_index_init();
+    qemu_mutex_lock(&indexes_mutex);
+    g_hash_table_iter_init(&iter, indexes);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        KvIndex *idx = value;
+        qemu_mutex_lock(&idx->lock);
+        kv_index_save_locked(idx);
+        kv_index_clear(idx);
+        qemu_mutex_unlock(&idx->lock);
+        g_hash_table_iter_remove(&iter);
+        qemu_mutex_destroy(&idx->lock);
+        g_free(idx->head);
+        g_free(idx);
+    }
+    qemu_mutex_unlock(&indexes_mutex);
+}
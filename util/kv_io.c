@@ -0,0 +1,252 @@
+/*
+ * KV Storage I/O
+ *
+ * Copyright (C) 2023 AirMettle, Inc.
+ *
+ * This code is licensed under the GNU GPL v2 or later.
+ */
+
+#include "qemu/osdep.h"
+#include <poll.h>
+#include "qemu/coroutine.h"
+#include "qemu/kv_io.h"
+#ifdef CONFIG_LINUX_IO_URING
+#include <liburing.h>
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING
+
+struct KvIoRing {
+    struct io_uring ring;
+    int wakeup_fd;
+    bool wakeup_armed;
+};
+
+/* one operation of a yielded coroutine */
+typedef struct KvIoRequest {
+    Coroutine *co;
+    int ret;
+} KvIoRequest;
+
+static __thread KvIoRing *current_ring;
+
+KvIoRing *kv_io_ring_new(unsigned int entries, int wakeup_fd) {
+    KvIoRing *ring = g_new0(KvIoRing, 1);
+    struct io_uring_probe *probe;
+    static const int ops[] = {
+        IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_READV, IORING_OP_WRITEV,
+        IORING_OP_UNLINKAT, IORING_OP_STATX, IORING_OP_POLL_ADD,
+    };
+    int ret;
+
+    ret = io_uring_queue_init(entries, &ring->ring, 0);
+    if (ret < 0) {
+        g_free(ring);
+        return NULL;
+    }
+    /* the file system operations need Linux 5.11 */
+    probe = io_uring_get_probe_ring(&ring->ring);
+    for (int i = 0; i < ARRAY_SIZE(ops); i++) {
+        if (!probe || !io_uring_opcode_supported(probe, ops[i])) {
+            io_uring_free_probe(probe);
+            io_uring_queue_exit(&ring->ring);
+            g_free(ring);
+            return NULL;
+        }
+    }
+    io_uring_free_probe(probe);
+    ring->wakeup_fd = wakeup_fd;
+    return ring;
+}
+
+void kv_io_ring_free(KvIoRing *ring) {
+    if (!ring) {
+        return;
+    }
+    if (current_ring == ring) {
+        current_ring = NULL;
+    }
+    io_uring_queue_exit(&ring->ring);
+    g_free(ring);
+}
+
+void kv_io_ring_attach(KvIoRing *ring) {
+    current_ring = ring;
+}
+
+static KvIoRing *kv_io_ring(void) {
+    return current_ring && qemu_in_coroutine() ? current_ring : NULL;
+}
+
+static struct io_uring_sqe *kv_io_get_sqe(KvIoRing *ring) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring->ring);
+
+    while (!sqe) {
+        /* the submission queue is full, hand it to the kernel */
+        io_uring_submit(&ring->ring);
+        sqe = io_uring_get_sqe(&ring->ring);
+    }
+    return sqe;
+}
+
+/* waits for the prepared sqe, submission happens in kv_io_ring_wait() */
+static int coroutine_fn kv_io_co_wait(struct io_uring_sqe *sqe) {
+    KvIoRequest req = {
+        .co = qemu_coroutine_self(),
+    };
+
+    io_uring_sqe_set_data(sqe, &req);
+    qemu_coroutine_yield();
+    if (req.ret < 0) {
+        errno = -req.ret;
+        return -1;
+    }
+    return req.ret;
+}
+
+bool kv_io_ring_wait(KvIoRing *ring) {
+    struct io_uring_cqe *cqe;
+    bool woken = false;
+    int ret;
+
+    if (!ring->wakeup_armed) {
+        struct io_uring_sqe *sqe = kv_io_get_sqe(ring);
+
+        io_uring_prep_poll_add(sqe, ring->wakeup_fd, POLLIN);
+        io_uring_sqe_set_data(sqe, NULL);
+        ring->wakeup_armed = true;
+    }
+    do {
+        ret = io_uring_submit_and_wait(&ring->ring, 1);
+    } while (ret == -EINTR);
+    assert(ret >= 0);
+
+    while (io_uring_peek_cqe(&ring->ring, &cqe) == 0) {
+        KvIoRequest *req = io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+
+        io_uring_cqe_seen(&ring->ring, cqe);
+        if (!req) {
+            ring->wakeup_armed = false;
+            woken = true;
+            continue;
+        }
+        req->ret = res;
+        qemu_coroutine_enter(req->co);
+    }
+    return woken;
+}
+
+#else
+
+KvIoRing *kv_io_ring_new(unsigned int entries, int wakeup_fd) {
+    return NULL;
+}
+
+void kv_io_ring_free(KvIoRing *ring) {
+}
+
+void kv_io_ring_attach(KvIoRing *ring) {
+}
+
+bool kv_io_ring_wait(KvIoRing *ring) {
+    g_assert_not_reached();
+}
+
+#endif
+
+int kv_io_open(const char *path, int flags, mode_t mode) {
+#ifdef CONFIG_LINUX_IO_URING
+    KvIoRing *ring = kv_io_ring();
+    if (ring) {
+        struct io_uring_sqe *sqe = kv_io_get_sqe(ring);
+
+        io_uring_prep_openat(sqe, AT_FDCWD, path, flags, mode);
+        return kv_io_co_wait(sqe);
+    }
+#endif
+    return open(path, flags, mode);
+}
+
+int kv_io_close(int fd) {
+#ifdef CONFIG_LINUX_IO_URING
+    KvIoRing *ring = kv_io_ring();
+    if (ring) {
+        struct io_uring_sqe *sqe = kv_io_get_sqe(ring);
+
+        io_uring_prep_close(sqe, fd);
+        return kv_io_co_wait(sqe);
+    }
+#endif
+    return close(fd);
+}
+
+ssize_t kv_io_preadv(int fd, const struct iovec *iov, int iov_count, off_t offset) {
+#ifdef CONFIG_LINUX_IO_URING
+    KvIoRing *ring = kv_io_ring();
+    if (ring) {
+        struct io_uring_sqe *sqe = kv_io_get_sqe(ring);
+
+        io_uring_prep_readv(sqe, fd, iov, iov_count, offset);
+        return kv_io_co_wait(sqe);
+    }
+#endif
+    return offset < 0 ? readv(fd, iov, iov_count) : preadv(fd, iov, iov_count, offset);
+}
+
+ssize_t kv_io_pwritev(int fd, const struct iovec *iov, int iov_count, off_t offset) {
+#ifdef CONFIG_LINUX_IO_URING
+    KvIoRing *ring = kv_io_ring();
+    if (ring) {
+        struct io_uring_sqe *sqe = kv_io_get_sqe(ring);
+
+        io_uring_prep_writev(sqe, fd, iov, iov_count, offset);
+        return kv_io_co_wait(sqe);
+    }
+#endif
+    return offset < 0 ? writev(fd, iov, iov_count) : pwritev(fd, iov, iov_count, offset);
+}
+
+int kv_io_unlink(const char *path) {
+#ifdef CONFIG_LINUX_IO_URING
+    KvIoRing *ring = kv_io_ring();
+    if (ring) {
+        struct io_uring_sqe *sqe = kv_io_get_sqe(ring);
+
+        io_uring_prep_unlinkat(sqe, AT_FDCWD, path, 0);
+        return kv_io_co_wait(sqe);
+    }
+#endif
+    return unlink(path);
+}
+
+int kv_io_stat(int fd, const char *path, struct stat *st) {
+#ifdef CONFIG_LINUX_IO_URING
+    KvIoRing *ring = kv_io_ring();
+    if (ring) {
+        struct io_uring_sqe *sqe = kv_io_get_sqe(ring);
+        struct statx stx;
+        int ret;
+
+        io_uring_prep_statx(sqe, path ? AT_FDCWD : fd, path ? path : "",
+                            path ? 0 : AT_EMPTY_PATH, STATX_BASIC_STATS, &stx);
+        ret = kv_io_co_wait(sqe);
+        if (ret < 0) {
+            return ret;
+        }
+        memset(st, 0, sizeof(*st));
+        st->st_mode = stx.stx_mode;
+        st->st_nlink = stx.stx_nlink;
+        st->st_uid = stx.stx_uid;
+        st->st_gid = stx.stx_gid;
+        st->st_ino = stx.stx_ino;
+        st->st_size = stx.stx_size;
+        st->st_blocks = stx.stx_blocks;
+        st->st_blksize = stx.stx_blksize;
+        st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+        st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+        return 0;
+    }
+#endif
+    return path ? stat(path, st) : fstat(fd, st);
+}
@@ -0,0 +1,1241 @@
+/*
+ * KV Storage Log-Structured Backend
+ *
+ * Copyright (C) 2023 AirMettle, Inc.
+ *
+ * This code is licensed under the GNU GPL v2 or later.
+ */
+
+/*
+ * Every namespace in this backend is a directory of segment files,
+ * <base>/<bus>/<nsid>.log/<8 hex digit id>.seg, which are only ever
+ * appended to.  A STORE or DELETE appends one record to the newest (active)
+ * segment and an in-memory hash table maps each live key to its latest
+ * record, so small objects cost one sequential write instead of a file
+ * create, and a RETRIEVE one pread.
+ *
+ * An APPEND stores only the new bytes, in a record which extends the key's
+ * previous record, so an object is a short chain of extents.  To keep the
+ * chain short the new record also takes over trailing extents no longer
+ * than the data behind them, which makes every byte be rewritten a
+ * logarithmic number of times at most.
+ *
+ * Records carry a sequence number; on open the segments are replayed and
+ * the record with the highest sequence number wins, a torn record at the
+ * tail of the active segment is cut off.  A background thread per log
+ * rewrites the live records of sealed segments which are mostly garbage
+ * into the active segment and then drops the segment file.
+ *
+ * Queries read text objects through a pipe which one feeder thread fills
+ * from the segments, with splice() where available, instead of a copy of
+ * the object in a file.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/kv_backend.h"
+#include "qemu/kv_index.h"
+#include "qemu/crc32c.h"
+#include "qemu/iov.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include <dirent.h>
+#include <poll.h>
+#include <sys/uio.h>
+
+#define KV_LOG_DIR_SUFFIX ".log"
+#define KV_LOG_SEGMENT_SUFFIX ".seg"
+#define KV_LOG_SEGMENT_SIZE (64 * 1024 * 1024)
+#define KV_LOG_RECORD_MAGIC 0x524C564B /* "KVLR" */
+#define KV_LOG_TOMBSTONE 0x1
+/* the value starts with a KvLogAppend */
+#define KV_LOG_APPEND 0x2
+/* extents of an object above which an append rewrites the last one too */
+#define KV_LOG_MAX_EXTENTS 16
+/* sealed segments with less live data than this are compacted */
+#define KV_LOG_COMPACT_LIVE_PERCENT 50
+#define KV_LOG_COPY_CHUNK (1024 * 1024)
+/* bytes moved into a stream per turn, the default pipe size */
+#define KV_LOG_FEED_CHUNK (64 * 1024)
+
+extern const char *base_dir;
+
+typedef struct KvLogRecord {
+    uint32_t magic;
+    /* crc32c of the rest of the header and the key */
+    uint32_t crc;
+    uint64_t seq;
+    uint64_t value_len;
+    uint32_t value_crc;
+    uint8_t key_len;
+    uint8_t flags;
+    uint16_t reserved;
+} KvLogRecord;
+
+QEMU_BUILD_BUG_ON(sizeof(KvLogRecord) != 32);
+
+/* an append record replaces the object's data from offset on, and only
+ * applies to the record with sequence number prev_seq
+ */
+typedef struct KvLogAppend {
+    uint64_t prev_seq;
+    uint64_t offset;
+} KvLogAppend;
+
+typedef struct KvLogSegment {
+    uint32_t id;
+    int fd;
+    char *path;
+    /* bytes of complete records */
+    uint64_t size;
+    /* bytes of records the key table points at */
+    uint64_t live;
+    /* the segment list, readers and the compactor hold references */
+    int refcnt;
+    bool compact_failed;
+} KvLogSegment;
+
+/* a piece of an object's value, the data is at the end of the record */
+typedef struct KvLogExtent {
+    KvLogSegment *segment;
+    /* of the record header */
+    uint64_t offset;
+    uint64_t record_size;
+    uint64_t len;
+} KvLogExtent;
+
+typedef struct KvLogEntry {
+    unsigned char key[KV_KEY_MAX_LENGTH];
+    uint8_t key_len;
+    /* of the last record */
+    uint64_t seq;
+    uint64_t value_len;
+    /* most objects are a single record, further extents are in more */
+    uint32_t num_extents;
+    KvLogExtent first;
+    KvLogExtent *more;
+} KvLogEntry;
+
+typedef struct KvLog {
+    uint64_t id;
+    uint32_t bus_number;
+    uint32_t namespace_id;
+    char *dir_path;
+    /* serializes appends, held across the write of a record */
+    QemuMutex write_lock;
+    /* protects entries, segments and the segment counters, never held
+     * across I/O and taken after write_lock
+     */
+    QemuMutex lock;
+    QemuCond compact_cond;
+    QemuThread compact_thread;
+    bool stopping;
+    GHashTable *entries;
+    /* ordered by id, the last one is active */
+    GPtrArray *segments;
+    uint64_t next_seq;
+} KvLog;
+
+static GHashTable *logs;
+static QemuMutex logs_mutex;
+static bool init;
+
+/* the part of a segment holding an extent of a streamed object, the
+ * segment fd is a dup so the stream does not depend on the log
+ */
+typedef struct KvLogFeedExtent {
+    int fd;
+    uint64_t offset;
+    uint64_t len;
+} KvLogFeedExtent;
+
+typedef struct KvLogFeed {
+    /* write end of the stream, non-blocking */
+    int fd;
+    uint32_t num_extents;
+    KvLogFeedExtent *extents;
+    /* position in the value */
+    uint32_t next;
+    uint64_t done;
+} KvLogFeed;
+
+/* protects new_feeds and starting the feeder thread */
+static QemuMutex feeds_mutex;
+static GPtrArray *new_feeds;
+static bool feeder_started;
+static QemuThread feeder_thread;
+/* written to when new_feeds gets a stream */
+static int feeder_wakeup[2];
+
+static uint64_t kv_log_record_size(size_t key_len, uint64_t value_len) {
+    return sizeof(KvLogRecord) + key_len + value_len;
+}
+
+static guint kv_log_entry_hash(gconstpointer data) {
+    const KvLogEntry *entry = data;
+    guint h = 2166136261u;
+    for (int i = 0; i < entry->key_len; i++) {
+        h ^= entry->key[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static gboolean kv_log_entry_equal(gconstpointer a, gconstpointer b) {
+    const KvLogEntry *ea = a, *eb = b;
+    return ea->key_len == eb->key_len && !memcmp(ea->key, eb->key, ea->key_len);
+}
+
+static KvLogExtent *kv_log_extent(KvLogEntry *entry, uint32_t i) {
+    return i ? &entry->more[i - 1] : &entry->first;
+}
+
+static void kv_log_entry_free(gpointer data) {
+    KvLogEntry *entry = data;
+    g_free(entry->more);
+    g_free(entry);
+}
+
+static KvLogEntry *kv_log_lookup(GHashTable *entries, const unsigned char *key, size_t key_len) {
+    KvLogEntry probe;
+    probe.key_len = key_len;
+    memcpy(probe.key, key, key_len);
+    return g_hash_table_lookup(entries, &probe);
+}
+
+/* crc32c() finalizes its result, undo that so a crc can be continued,
+ * start with 0
+ */
+static uint32_t kv_log_crc(uint32_t crc, const void *data, size_t len) {
+    return crc32c(crc ^ 0xffffffff, data, len);
+}
+
+static uint32_t kv_log_header_crc(const KvLogRecord *rec, const unsigned char *key) {
+    uint32_t crc = kv_log_crc(0, (const uint8_t *)rec + offsetof(KvLogRecord, seq),
+                              sizeof(*rec) - offsetof(KvLogRecord, seq));
+    return kv_log_crc(crc, key, rec->key_len);
+}
+
+static int kv_log_pread_full(int fd, void *buf, size_t len, uint64_t offset) {
+    while (len) {
+        ssize_t n = pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf = (char *)buf + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* called with log->lock held */
+static void kv_log_segment_unref_locked(KvLogSegment *seg) {
+    if (--seg->refcnt) {
+        return;
+    }
+    close(seg->fd);
+    g_free(seg->path);
+    g_free(seg);
+}
+
+static KvLogSegment *kv_log_segment_open(KvLog *log, uint32_t id, bool create) {
+    KvLogSegment *seg = g_new0(KvLogSegment, 1);
+    seg->id = id;
+    seg->path = g_strdup_printf("%s/%08X" KV_LOG_SEGMENT_SUFFIX, log->dir_path, id);
+    seg->fd = open(seg->path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (seg->fd < 0) {
+        error_report("kv log: cannot open %s: %s", seg->path, strerror(errno));
+        g_free(seg->path);
+        g_free(seg);
+        return NULL;
+    }
+    seg->refcnt = 1;
+    return seg;
+}
+
+static KvLogSegment *kv_log_active(KvLog *log) {
+    return g_ptr_array_index(log->segments, log->segments->len - 1);
+}
+
+/* wake the compactor if seg just became worth compacting, log->lock held */
+static void kv_log_check_compact(KvLog *log, KvLogSegment *seg) {
+    if (seg != kv_log_active(log) && !seg->compact_failed &&
+        seg->live * 100 < seg->size * KV_LOG_COMPACT_LIVE_PERCENT) {
+        qemu_cond_signal(&log->compact_cond);
+    }
+}
+
+/* returns the index of the extent of entry starting at base, -1 if none */
+static int kv_log_extent_at(KvLogEntry *entry, uint64_t base) {
+    uint64_t pos = 0;
+    for (uint32_t i = 0; i < entry->num_extents; i++) {
+        if (pos == base) {
+            return i;
+        }
+        pos += kv_log_extent(entry, i)->len;
+    }
+    return pos == base ? entry->num_extents : -1;
+}
+
+/* point key at a new record holding its data from base on, base being
+ * where an extent starts, or drop it when seg is NULL; log->lock held
+ */
+static void kv_log_publish(KvLog *log, const unsigned char *key, size_t key_len, uint64_t seq,
+                           KvLogSegment *seg, uint64_t offset, uint64_t record_size,
+                           uint64_t base, uint64_t len) {
+    KvLogEntry *entry = kv_log_lookup(log->entries, key, key_len);
+    if (entry) {
+        int keep = seg ? kv_log_extent_at(entry, base) : 0;
+        assert(keep >= 0);
+        for (uint32_t i = keep; i < entry->num_extents; i++) {
+            KvLogExtent *ext = kv_log_extent(entry, i);
+            ext->segment->live -= ext->record_size;
+            kv_log_check_compact(log, ext->segment);
+        }
+        entry->num_extents = keep;
+        if (!seg) {
+            g_hash_table_remove(log->entries, entry);
+        }
+    } else if (seg) {
+        entry = g_new0(KvLogEntry, 1);
+        entry->key_len = key_len;
+        memcpy(entry->key, key, key_len);
+        g_hash_table_add(log->entries, entry);
+    }
+    if (seg) {
+        if (entry->num_extents) {
+            entry->more = g_renew(KvLogExtent, entry->more, entry->num_extents);
+        } else {
+            g_clear_pointer(&entry->more, g_free);
+        }
+        *kv_log_extent(entry, entry->num_extents++) = (KvLogExtent) {
+            .segment = seg,
+            .offset = offset,
+            .record_size = record_size,
+            .len = len,
+        };
+        entry->seq = seq;
+        entry->value_len = base + len;
+        seg->live += record_size;
+    }
+}
+
+/* appends a record to the active segment, called with log->write_lock held */
+static int kv_log_append(KvLog *log, uint64_t seq, uint8_t flags, const unsigned char *key,
+                         size_t key_len, const struct iovec *value, int value_cnt,
+                         KvLogSegment **segment, uint64_t *offset) {
+    KvLogRecord rec = {
+        .magic = KV_LOG_RECORD_MAGIC,
+        .seq = seq,
+        .key_len = key_len,
+        .flags = flags,
+    };
+    g_autofree struct iovec *iov = g_new(struct iovec, value_cnt + 2);
+
+    for (int i = 0; i < value_cnt; i++) {
+        rec.value_len += value[i].iov_len;
+        rec.value_crc = kv_log_crc(rec.value_crc, value[i].iov_base, value[i].iov_len);
+    }
+    rec.crc = kv_log_header_crc(&rec, key);
+    iov[0] = (struct iovec) { .iov_base = &rec, .iov_len = sizeof(rec) };
+    iov[1] = (struct iovec) { .iov_base = (void *)key, .iov_len = key_len };
+    if (value_cnt) {
+        memcpy(iov + 2, value, value_cnt * sizeof(*value));
+    }
+
+    uint64_t rec_size = kv_log_record_size(key_len, rec.value_len);
+    /* only appends change the active segment, the compactor may be
+     * removing others from the list
+     */
+    qemu_mutex_lock(&log->lock);
+    KvLogSegment *seg = kv_log_active(log);
+    qemu_mutex_unlock(&log->lock);
+    if (seg->size && seg->size + rec_size > KV_LOG_SEGMENT_SIZE) {
+        /* sealed segments are complete on disk, so compaction only has to
+         * sync the active one before dropping what it copied
+         */
+        if (fdatasync(seg->fd)) {
+            return KV_ERROR_FILE_WRITE;
+        }
+        KvLogSegment *next = kv_log_segment_open(log, seg->id + 1, true);
+        if (!next) {
+            return KV_ERROR_CANNOT_OPEN;
+        }
+        qemu_mutex_lock(&log->lock);
+        g_ptr_array_add(log->segments, next);
+        kv_log_check_compact(log, seg);
+        qemu_mutex_unlock(&log->lock);
+        seg = next;
+    }
+
+    if (kv_writev_full(seg->fd, iov, value_cnt + 2, seg->size)) {
+        /* the next append overwrites a partial record, and recovery cuts
+         * it off if that never happens
+         */
+        return KV_ERROR_FILE_WRITE;
+    }
+    *segment = seg;
+    *offset = seg->size;
+    qemu_mutex_lock(&log->lock);
+    seg->size += rec_size;
+    qemu_mutex_unlock(&log->lock);
+    return 0;
+}
+
+/* looks a key up and pins its segments, returns false if it doesn't
+ * exist; release the copy with kv_log_put_entry()
+ */
+static bool kv_log_get_entry(KvLog *log, const unsigned char *key, size_t key_len,
+                             KvLogEntry *copy) {
+    qemu_mutex_lock(&log->lock);
+    KvLogEntry *entry = kv_log_lookup(log->entries, key, key_len);
+    if (entry) {
+        *copy = *entry;
+        if (entry->num_extents > 1) {
+            copy->more = g_memdup2(entry->more,
+                                   (entry->num_extents - 1) * sizeof(KvLogExtent));
+        }
+        for (uint32_t i = 0; i < copy->num_extents; i++) {
+            kv_log_extent(copy, i)->segment->refcnt++;
+        }
+    }
+    qemu_mutex_unlock(&log->lock);
+    return entry != NULL;
+}
+
+static void kv_log_put_entry(KvLog *log, KvLogEntry *copy) {
+    qemu_mutex_lock(&log->lock);
+    for (uint32_t i = 0; i < copy->num_extents; i++) {
+        kv_log_segment_unref_locked(kv_log_extent(copy, i)->segment);
+    }
+    qemu_mutex_unlock(&log->lock);
+    g_free(copy->more);
+}
+
+static uint64_t kv_log_extent_data(const KvLogExtent *ext) {
+    return ext->offset + ext->record_size - ext->len;
+}
+
+/* reads len bytes of the value of a pinned entry from offset on into iov */
+static int kv_log_read_value(KvLogEntry *entry, uint64_t offset, const struct iovec *iov,
+                             int iov_count, uint64_t len) {
+    g_autofree struct iovec *part = g_new(struct iovec, iov_count);
+    uint64_t pos = 0, done = 0;
+
+    for (uint32_t i = 0; i < entry->num_extents && done < len; i++) {
+        KvLogExtent *ext = kv_log_extent(entry, i);
+        if (offset + done < pos + ext->len) {
+            uint64_t skip = offset + done - pos;
+            uint64_t n = MIN(ext->len - skip, len - done);
+            int part_count = iov_copy(part, iov_count, iov, iov_count, done, n);
+            if (kv_readv_full(ext->segment->fd, part, part_count,
+                              kv_log_extent_data(ext) + skip) != n) {
+                return KV_ERROR_FILE_READ;
+            }
+            done += n;
+        }
+        pos += ext->len;
+    }
+    return 0;
+}
+
+/* replays one record found while opening the log, deleted holds the
+ * highest tombstone sequence number seen for each removed key
+ */
+static void kv_log_replay(KvLog *log, GHashTable *deleted, const KvLogRecord *rec,
+                          const unsigned char *key, KvLogSegment *seg, uint64_t offset) {
+    KvLogEntry *entry = kv_log_lookup(log->entries, key, rec->key_len);
+    KvLogEntry *tombstone = kv_log_lookup(deleted, key, rec->key_len);
+    uint64_t record_size = kv_log_record_size(rec->key_len, rec->value_len);
+
+    log->next_seq = MAX(log->next_seq, rec->seq + 1);
+    if (rec->flags & KV_LOG_TOMBSTONE) {
+        if (entry && entry->seq < rec->seq) {
+            kv_log_publish(log, key, rec->key_len, rec->seq, NULL, 0, 0, 0, 0);
+        }
+        if (!tombstone) {
+            tombstone = g_new0(KvLogEntry, 1);
+            tombstone->key_len = rec->key_len;
+            memcpy(tombstone->key, key, rec->key_len);
+            g_hash_table_add(deleted, tombstone);
+        }
+        tombstone->seq = MAX(tombstone->seq, rec->seq);
+        return;
+    }
+    if (rec->flags & KV_LOG_APPEND) {
+        /* the record it extends may have been compacted into a full record
+         * behind this one, which then holds its data too
+         */
+        KvLogAppend app;
+        if (rec->value_len < sizeof(app) ||
+            kv_log_pread_full(seg->fd, &app, sizeof(app),
+                              offset + sizeof(*rec) + rec->key_len) ||
+            !entry || entry->seq != app.prev_seq || kv_log_extent_at(entry, app.offset) < 0) {
+            return;
+        }
+        kv_log_publish(log, key, rec->key_len, rec->seq, seg, offset, record_size, app.offset,
+                       rec->value_len - sizeof(app));
+        return;
+    }
+    /* compaction copies older records forward, so file order is not enough */
+    if ((tombstone && tombstone->seq > rec->seq) || (entry && entry->seq > rec->seq)) {
+        return;
+    }
+    kv_log_publish(log, key, rec->key_len, rec->seq, seg, offset, record_size, 0,
+                   rec->value_len);
+}
+
+static bool kv_log_check_value(int fd, const KvLogRecord *rec, uint64_t offset,
+                               unsigned char *buf) {
+    uint32_t crc = 0;
+    for (uint64_t done = 0; done < rec->value_len;) {
+        size_t len = MIN(rec->value_len - done, KV_LOG_COPY_CHUNK);
+        if (kv_log_pread_full(fd, buf, len, offset + done)) {
+            return false;
+        }
+        crc = kv_log_crc(crc, buf, len);
+        done += len;
+    }
+    return crc == rec->value_crc;
+}
+
+static void kv_log_scan_segment(KvLog *log, GHashTable *deleted, KvLogSegment *seg, bool active,
+                                unsigned char *buf) {
+    struct stat st;
+    uint64_t offset = 0;
+
+    if (fstat(seg->fd, &st)) {
+        st.st_size = 0;
+    }
+    while (offset + sizeof(KvLogRecord) <= st.st_size) {
+        KvLogRecord rec;
+        unsigned char key[KV_KEY_MAX_LENGTH];
+        if (kv_log_pread_full(seg->fd, &rec, sizeof(rec), offset) ||
+            rec.magic != KV_LOG_RECORD_MAGIC || rec.key_len > KV_KEY_MAX_LENGTH ||
+            kv_log_pread_full(seg->fd, key, rec.key_len, offset + sizeof(rec)) ||
+            rec.crc != kv_log_header_crc(&rec, key) ||
+            rec.value_len > st.st_size - offset - sizeof(rec) - rec.key_len) {
+            break;
+        }
+        /* only the last record of the active segment can have been cut
+         * short by a crash.  Values are written straight from guest memory,
+         * which the guest may change under a STORE, so a mismatch anywhere
+         * else is not a reason to drop the records behind it
+         */
+        if (active && !kv_log_check_value(seg->fd, &rec, offset + sizeof(rec) + rec.key_len,
+                                          buf)) {
+            if (offset + kv_log_record_size(rec.key_len, rec.value_len) == st.st_size) {
+                break;
+            }
+            warn_report("kv log: %s: value checksum mismatch at %" PRIu64, seg->path, offset);
+        }
+        kv_log_replay(log, deleted, &rec, key, seg, offset);
+        offset += kv_log_record_size(rec.key_len, rec.value_len);
+    }
+    if (offset != st.st_size) {
+        warn_report("kv log: %s: dropping %" PRIu64 " bytes of invalid records", seg->path,
+                    (uint64_t)st.st_size - offset);
+        if (active && ftruncate(seg->fd, offset)) {
+            error_report("kv log: cannot truncate %s: %s", seg->path, strerror(errno));
+        }
+    }
+    seg->size = offset;
+}
+
+static gint kv_log_id_cmp(gconstpointer a, gconstpointer b) {
+    uint32_t ia = *(const uint32_t *)a, ib = *(const uint32_t *)b;
+    return ia < ib ? -1 : (ia > ib);
+}
+
+static int kv_log_recover(KvLog *log) {
+    GArray *ids = g_array_new(false, false, sizeof(uint32_t));
+    DIR *dir = opendir(log->dir_path);
+    struct dirent *ent;
+
+    if (!dir) {
+        g_array_free(ids, true);
+        return KV_ERROR_FILE_PATH;
+    }
+    while ((ent = readdir(dir))) {
+        unsigned char id_bytes[4];
+        if (strlen(ent->d_name) == 8 + strlen(KV_LOG_SEGMENT_SUFFIX) &&
+            !strcmp(ent->d_name + 8, KV_LOG_SEGMENT_SUFFIX) && !unhex(ent->d_name, 8, id_bytes)) {
+            uint32_t id = (id_bytes[0] << 24) | (id_bytes[1] << 16) | (id_bytes[2] << 8) |
+                          id_bytes[3];
+            g_array_append_val(ids, id);
+        } else if (g_str_has_prefix(ent->d_name, "select-")) {
+            /* a copy handed to the query engine before a crash */
+            g_autofree char *path = g_strdup_printf("%s/%s", log->dir_path, ent->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+    g_array_sort(ids, kv_log_id_cmp);
+
+    GHashTable *deleted = g_hash_table_new_full(kv_log_entry_hash, kv_log_entry_equal,
+                                                kv_log_entry_free, NULL);
+    unsigned char *buf = g_malloc(KV_LOG_COPY_CHUNK);
+    int res = 0;
+    for (guint i = 0; i < ids->len; i++) {
+        KvLogSegment *seg = kv_log_segment_open(log, g_array_index(ids, uint32_t, i), false);
+        if (!seg) {
+            res = KV_ERROR_CANNOT_OPEN;
+            break;
+        }
+        g_ptr_array_add(log->segments, seg);
+        kv_log_scan_segment(log, deleted, seg, i == ids->len - 1, buf);
+    }
+    g_free(buf);
+    g_hash_table_destroy(deleted);
+    g_array_free(ids, true);
+    if (!res && !log->segments->len) {
+        KvLogSegment *seg = kv_log_segment_open(log, 0, true);
+        if (seg) {
+            g_ptr_array_add(log->segments, seg);
+        } else {
+            res = KV_ERROR_CANNOT_OPEN;
+        }
+    }
+    return res;
+}
+
+/* rewrites the live records of seg into the active segment, returns 0 once
+ * nothing refers to seg any more
+ */
+static int kv_log_compact_segment(KvLog *log, KvLogSegment *seg, bool oldest) {
+    unsigned char *buf = NULL;
+    size_t buf_len = 0;
+    int res = 0;
+
+    for (uint64_t offset = 0; offset < seg->size && !res;) {
+        KvLogRecord rec;
+        unsigned char key[KV_KEY_MAX_LENGTH];
+        if (qatomic_read(&log->stopping)) {
+            res = -1;
+            break;
+        }
+        if (kv_log_pread_full(seg->fd, &rec, sizeof(rec), offset) || rec.key_len > KV_KEY_MAX_LENGTH ||
+            kv_log_pread_full(seg->fd, key, rec.key_len, offset + sizeof(rec))) {
+            res = KV_ERROR_FILE_READ;
+            break;
+        }
+        uint64_t rec_size = kv_log_record_size(rec.key_len, rec.value_len);
+
+        qemu_mutex_lock(&log->write_lock);
+        qemu_mutex_lock(&log->lock);
+        KvLogEntry *entry = kv_log_lookup(log->entries, key, rec.key_len);
+        bool copy = false, whole = false;
+        if (rec.flags & KV_LOG_TOMBSTONE) {
+            /* older records of the key can only be in older segments, and
+             * a newer record makes the tombstone irrelevant
+             */
+            copy = !oldest && !(entry && entry->seq > rec.seq);
+        } else if (entry) {
+            for (uint32_t i = 0; i < entry->num_extents && !copy; i++) {
+                KvLogExtent *ext = kv_log_extent(entry, i);
+                copy = ext->segment == seg && ext->offset == offset;
+            }
+            /* a chain is rewritten as one record, an append record only
+             * makes sense behind the one it extends
+             */
+            whole = entry->num_extents > 1 || (rec.flags & KV_LOG_APPEND);
+        }
+        qemu_mutex_unlock(&log->lock);
+
+        if (copy) {
+            KvLogEntry value = { 0 };
+            uint64_t seq = rec.seq;
+            uint64_t len = rec.value_len;
+            if (whole) {
+                kv_log_get_entry(log, key, rec.key_len, &value);
+                seq = value.seq;
+                len = value.value_len;
+            }
+            struct iovec iov = { .iov_len = len };
+            if (len > buf_len) {
+                g_free(buf);
+                buf_len = len;
+                buf = g_try_malloc(buf_len);
+            }
+            iov.iov_base = buf;
+            KvLogSegment *new_seg;
+            uint64_t new_offset;
+            if (len && !buf) {
+                buf_len = 0;
+                res = KV_ERROR_MEMORY_ALLOCATION;
+            } else if (whole ? kv_log_read_value(&value, 0, &iov, 1, len) :
+                       kv_log_pread_full(seg->fd, buf, len, offset + sizeof(rec) + rec.key_len)) {
+                res = KV_ERROR_FILE_READ;
+            } else {
+                res = kv_log_append(log, seq, whole ? 0 : rec.flags, key, rec.key_len, &iov,
+                                    len ? 1 : 0, &new_seg, &new_offset);
+            }
+            if (whole) {
+                kv_log_put_entry(log, &value);
+            }
+            if (!res && !(rec.flags & KV_LOG_TOMBSTONE)) {
+                qemu_mutex_lock(&log->lock);
+                kv_log_publish(log, key, rec.key_len, seq, new_seg, new_offset,
+                               kv_log_record_size(rec.key_len, len), 0, len);
+                qemu_mutex_unlock(&log->lock);
+            }
+        }
+        qemu_mutex_unlock(&log->write_lock);
+        offset += rec_size;
+    }
+    g_free(buf);
+    if (res) {
+        return res;
+    }
+
+    /* the copies have to be on disk before the originals go away */
+    qemu_mutex_lock(&log->write_lock);
+    qemu_mutex_lock(&log->lock);
+    int fd = kv_log_active(log)->fd;
+    qemu_mutex_unlock(&log->lock);
+    res = fdatasync(fd);
+    qemu_mutex_unlock(&log->write_lock);
+    if (res) {
+        return KV_ERROR_FILE_WRITE;
+    }
+    if (unlink(seg->path)) {
+        return KV_ERROR_REMOVE;
+    }
+    qemu_mutex_lock(&log->lock);
+    g_ptr_array_remove(log->segments, seg);
+    kv_log_segment_unref_locked(seg);
+    qemu_mutex_unlock(&log->lock);
+    return 0;
+}
+
+/* called with log->lock held, returns a referenced segment */
+static KvLogSegment *kv_log_pick_victim(KvLog *log) {
+    for (guint i = 0; i + 1 < log->segments->len; i++) {
+        KvLogSegment *seg = g_ptr_array_index(log->segments, i);
+        if (!seg->compact_failed &&
+            seg->live * 100 < seg->size * KV_LOG_COMPACT_LIVE_PERCENT) {
+            seg->refcnt++;
+            return seg;
+        }
+    }
+    return NULL;
+}
+
+static void *kv_log_compact_thread(void *opaque) {
+    KvLog *log = opaque;
+
+    qemu_mutex_lock(&log->lock);
+    while (!log->stopping) {
+        KvLogSegment *seg = kv_log_pick_victim(log);
+        if (!seg) {
+            qemu_cond_wait(&log->compact_cond, &log->lock);
+            continue;
+        }
+        bool oldest = seg == g_ptr_array_index(log->segments, 0);
+        qemu_mutex_unlock(&log->lock);
+
+        int res = kv_log_compact_segment(log, seg, oldest);
+
+        qemu_mutex_lock(&log->lock);
+        if (res && !log->stopping) {
+            error_report("kv log: compaction of %s failed (%d)", seg->path, res);
+            seg->compact_failed = true;
+        }
+        kv_log_segment_unref_locked(seg);
+    }
+    qemu_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+static void kv_log_free(KvLog *log) {
+    if (log->segments) {
+        for (guint i = 0; i < log->segments->len; i++) {
+            kv_log_segment_unref_locked(g_ptr_array_index(log->segments, i));
+        }
+        g_ptr_array_free(log->segments, true);
+    }
+    g_hash_table_destroy(log->entries);
+    qemu_cond_destroy(&log->compact_cond);
+    qemu_mutex_destroy(&log->lock);
+    qemu_mutex_destroy(&log->write_lock);
+    g_free(log->dir_path);
+    g_free(log);
+}
+
+static KvLog *kv_log_get(uint32_t bus_number, uint32_t namespace_id) {
+    uint64_t id = ((uint64_t)bus_number << 32) | namespace_id;
+    KvLog *log;
+
+    /* kv_store_init() has been called */
+    assert(init);
+    qemu_mutex_lock(&logs_mutex);
+    log = g_hash_table_lookup(logs, &id);
+    if (log) {
+        qemu_mutex_unlock(&logs_mutex);
+        return log;
+    }
+
+    log = g_new0(KvLog, 1);
+    log->id = id;
+    log->bus_number = bus_number;
+    log->namespace_id = namespace_id;
+    log->dir_path = g_strdup_printf("%s%s%u/%u" KV_LOG_DIR_SUFFIX, base_dir,
+                                    g_str_has_suffix(base_dir, "/") ? "" : "/",
+                                    bus_number, namespace_id);
+    qemu_mutex_init(&log->write_lock);
+    qemu_mutex_init(&log->lock);
+    qemu_cond_init(&log->compact_cond);
+    log->entries = g_hash_table_new_full(kv_log_entry_hash, kv_log_entry_equal,
+                                         kv_log_entry_free, NULL);
+    log->segments = g_ptr_array_new();
+    log->next_seq = 1;
+    if (g_mkdir_with_parents(log->dir_path, 0777) || kv_log_recover(log)) {
+        error_report("kv log: cannot open %s", log->dir_path);
+        kv_log_free(log);
+        qemu_mutex_unlock(&logs_mutex);
+        return NULL;
+    }
+    qemu_thread_create(&log->compact_thread, "kv-log-compact", kv_log_compact_thread, log,
+                       QEMU_THREAD_JOINABLE);
+    g_hash_table_insert(logs, &log->id, log);
+    qemu_mutex_unlock(&logs_mutex);
+    return log;
+}
+
+void kv_log_reset(void) {
+    GHashTableIter iter;
+    gpointer value;
+
+    if (!init) {
+        init = true;
+        qemu_mutex_init(&logs_mutex);
+        logs = g_hash_table_new(g_int64_hash, g_int64_equal);
+        qemu_mutex_init(&feeds_mutex);
+        new_feeds = g_ptr_array_new();
+    }
+    qemu_mutex_lock(&logs_mutex);
+    g_hash_table_iter_init(&iter, logs);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        KvLog *log = value;
+        qemu_mutex_lock(&log->lock);
+        qatomic_set(&log->stopping, true);
+        qemu_cond_signal(&log->compact_cond);
+        qemu_mutex_unlock(&log->lock);
+        qemu_thread_join(&log->compact_thread);
+        g_hash_table_iter_remove(&iter);
+        kv_log_free(log);
+    }
+    qemu_mutex_unlock(&logs_mutex);
+}
+
+static ssize_t kv_log_store(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                            size_t key_len, const struct iovec *value, int value_count,
+                            bool append, bool must_exist, bool must_not_exist) {
+    if (must_exist && must_not_exist) {
+        return KV_ERROR_INVALID_PARAMETER;
+    }
+    if (key_len > KV_KEY_MAX_LENGTH) {
+        return KV_ERROR_KEY_TOO_LONG;
+    }
+    KvLog *log = kv_log_get(bus_number, namespace_id);
+    if (!log) {
+        return KV_ERROR_FILE_PATH;
+    }
+
+    qemu_mutex_lock(&log->write_lock);
+    KvLogEntry old;
+    bool exist = kv_log_get_entry(log, key, key_len, &old);
+    ssize_t res = 0;
+    if (must_exist && !exist) {
+        res = KV_ERROR_FILE_NOT_FOUND;
+    } else if (must_not_exist && exist) {
+        res = KV_ERROR_FILE_EXISTS;
+    }
+
+    /* an append writes the new bytes and the trailing extents which are
+     * not longer than what follows them, a full record if that is all
+     */
+    g_autofree struct iovec *iov = g_new(struct iovec, value_count + 2);
+    int iovcnt = 0;
+    size_t value_len = iov_size(value, value_count);
+    uint64_t base = 0;
+    KvLogAppend app;
+    unsigned char *old_value = NULL;
+    size_t old_len = 0;
+    if (!res && append && exist && old.value_len) {
+        uint32_t keep = old.num_extents;
+        uint64_t len = value_len;
+        base = old.value_len;
+        while (keep && (kv_log_extent(&old, keep - 1)->len <= len ||
+                        keep >= KV_LOG_MAX_EXTENTS)) {
+            keep--;
+            len += kv_log_extent(&old, keep)->len;
+            base -= kv_log_extent(&old, keep)->len;
+        }
+        if (base) {
+            app = (KvLogAppend) { .prev_seq = old.seq, .offset = base };
+            iov[iovcnt++] = (struct iovec) { .iov_base = &app, .iov_len = sizeof(app) };
+        }
+        old_len = old.value_len - base;
+        old_value = old_len ? g_try_malloc(old_len) : NULL;
+        struct iovec old_iov = { .iov_base = old_value, .iov_len = old_len };
+        if (old_len && !old_value) {
+            res = KV_ERROR_MEMORY_ALLOCATION;
+        } else if (old_len && kv_log_read_value(&old, base, &old_iov, 1, old_len)) {
+            res = KV_ERROR_FILE_READ;
+        } else if (old_len) {
+            iov[iovcnt++] = old_iov;
+        }
+    }
+    if (exist) {
+        kv_log_put_entry(log, &old);
+    }
+    if (value_count) {
+        memcpy(iov + iovcnt, value, value_count * sizeof(*value));
+        iovcnt += value_count;
+    }
+
+    if (!res) {
+        KvLogSegment *seg;
+        uint64_t offset;
+        uint64_t seq = log->next_seq++;
+        res = kv_log_append(log, seq, base ? KV_LOG_APPEND : 0, key, key_len, iov, iovcnt, &seg,
+                            &offset);
+        if (!res) {
+            qemu_mutex_lock(&log->lock);
+            kv_log_publish(log, key, key_len, seq, seg, offset,
+                           kv_log_record_size(key_len, iov_size(iov, iovcnt)), base,
+                           old_len + value_len);
+            qemu_mutex_unlock(&log->lock);
+            kv_index_set(bus_number, namespace_id, key, key_len, true);
+            res = value_len;
+        }
+    }
+    qemu_mutex_unlock(&log->write_lock);
+    g_free(old_value);
+    return res;
+}
+
+static ssize_t kv_log_read(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                           size_t key_len, size_t offset, const struct iovec *iov,
+                           int iov_count, size_t *total_object_size) {
+    KvLogEntry entry;
+    if (key_len > KV_KEY_MAX_LENGTH) {
+        return KV_ERROR_CANNOT_OPEN;
+    }
+    KvLog *log = kv_log_get(bus_number, namespace_id);
+    if (!log) {
+        return KV_ERROR_FILE_PATH;
+    }
+    if (!kv_log_get_entry(log, key, key_len, &entry)) {
+        return KV_ERROR_CANNOT_OPEN;
+    }
+
+    *total_object_size = entry.value_len;
+    size_t len = offset < entry.value_len ?
+                 MIN(iov_size(iov, iov_count), entry.value_len - offset) : 0;
+    ssize_t res = len;
+    /* the segments go on with the next record */
+    if (len && kv_log_read_value(&entry, offset, iov, iov_count, len)) {
+        res = KV_ERROR_FILE_READ;
+    }
+    kv_log_put_entry(log, &entry);
+    return res;
+}
+
+static int kv_log_delete(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                         size_t key_len) {
+    if (key_len > KV_KEY_MAX_LENGTH) {
+        return KV_ERROR_FILE_NOT_FOUND;
+    }
+    KvLog *log = kv_log_get(bus_number, namespace_id);
+    if (!log) {
+        return KV_ERROR_FILE_PATH;
+    }
+
+    qemu_mutex_lock(&log->write_lock);
+    qemu_mutex_lock(&log->lock);
+    bool exist = kv_log_lookup(log->entries, key, key_len) != NULL;
+    qemu_mutex_unlock(&log->lock);
+    int res = KV_ERROR_FILE_NOT_FOUND;
+    if (exist) {
+        KvLogSegment *seg;
+        uint64_t offset;
+        uint64_t seq = log->next_seq++;
+        res = kv_log_append(log, seq, KV_LOG_TOMBSTONE, key, key_len, NULL, 0, &seg, &offset);
+        if (!res) {
+            qemu_mutex_lock(&log->lock);
+            kv_log_publish(log, key, key_len, seq, NULL, 0, 0, 0, 0);
+            qemu_mutex_unlock(&log->lock);
+            kv_index_set(bus_number, namespace_id, key, key_len, false);
+        } else {
+            res = KV_ERROR_REMOVE;
+        }
+    }
+    qemu_mutex_unlock(&log->write_lock);
+    return res;
+}
+
+static int kv_log_exist(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                        size_t key_len) {
+    if (key_len > KV_KEY_MAX_LENGTH) {
+        return 0;
+    }
+    KvLog *log = kv_log_get(bus_number, namespace_id);
+    if (!log) {
+        return KV_ERROR_FILE_PATH;
+    }
+    qemu_mutex_lock(&log->lock);
+    int res = kv_log_lookup(log->entries, key, key_len) != NULL;
+    qemu_mutex_unlock(&log->lock);
+    return res;
+}
+
+static int kv_log_walk_keys(uint32_t bus_number, uint32_t namespace_id, KvWalkObjectFunc func,
+                            void *opaque) {
+    GHashTableIter iter;
+    gpointer value;
+    int res = 0;
+
+    KvLog *log = kv_log_get(bus_number, namespace_id);
+    if (!log) {
+        return KV_ERROR_FILE_PATH;
+    }
+    qemu_mutex_lock(&log->lock);
+    g_hash_table_iter_init(&iter, log->entries);
+    while (!res && g_hash_table_iter_next(&iter, &value, NULL)) {
+        KvLogEntry *entry = value;
+        res = func(entry->key, entry->key_len, NULL, opaque);
+    }
+    qemu_mutex_unlock(&log->lock);
+    return res;
+}
+
+static char *kv_log_object_path(uint32_t bus_number, uint32_t namespace_id,
+                                const unsigned char *key, size_t key_len, bool *is_temp) {
+    KvLogEntry entry;
+    *is_temp = true;
+    if (key_len > KV_KEY_MAX_LENGTH) {
+        return NULL;
+    }
+    KvLog *log = kv_log_get(bus_number, namespace_id);
+    if (!log || !kv_log_get_entry(log, key, key_len, &entry)) {
+        return NULL;
+    }
+
+    char *path = g_strdup_printf("%s/select-XXXXXX", log->dir_path);
+    unsigned char *buf = g_malloc(MIN(entry.value_len, KV_LOG_COPY_CHUNK) + 1);
+    int fd = mkstemp(path);
+    bool ok = fd >= 0;
+    for (uint64_t done = 0; ok && done < entry.value_len;) {
+        size_t len = MIN(entry.value_len - done, KV_LOG_COPY_CHUNK);
+        struct iovec iov = { .iov_base = buf, .iov_len = len };
+        ok = !kv_log_read_value(&entry, done, &iov, 1, len) &&
+             qemu_write_full(fd, buf, len) == len;
+        done += len;
+    }
+    kv_log_put_entry(log, &entry);
+    g_free(buf);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!ok) {
+        if (fd >= 0) {
+            unlink(path);
+        }
+        g_free(path);
+        return NULL;
+    }
+    /* callers release the path with free() */
+    char *res = strdup(path);
+    g_free(path);
+    return res;
+}
+
+static void kv_log_feed_free(KvLogFeed *feed) {
+    close(feed->fd);
+    for (uint32_t i = 0; i < feed->num_extents; i++) {
+        /* extents in the same segment share the fd */
+        if (!i || feed->extents[i].fd != feed->extents[i - 1].fd) {
+            close(feed->extents[i].fd);
+        }
+    }
+    g_free(feed->extents);
+    g_free(feed);
+}
+
+/* moves up to len bytes at offset of in to the pipe out */
+static ssize_t kv_log_feed_chunk(int in, uint64_t offset, int out, size_t len,
+                                 unsigned char *buf) {
+    ssize_t n;
+#ifdef CONFIG_SPLICE
+    loff_t off = offset;
+    n = splice(in, &off, out, NULL, len, SPLICE_F_NONBLOCK);
+    if (n >= 0 || errno != EINVAL) {
+        return n;
+    }
+#endif
+    /* the pipe is writable, so this writes at least part of it */
+    n = pread(in, buf, len, offset);
+    return n > 0 ? write(out, buf, n) : n;
+}
+
+/* writes the next chunk of a stream, returns false once it is done */
+static bool kv_log_feed_write(KvLogFeed *feed, unsigned char *buf) {
+    KvLogFeedExtent *ext = &feed->extents[feed->next];
+    ssize_t n = kv_log_feed_chunk(ext->fd, ext->offset + feed->done, feed->fd,
+                                  MIN(ext->len - feed->done, KV_LOG_FEED_CHUNK), buf);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return true;
+    }
+    if (n <= 0) {
+        /* the reader went away, a short segment ends the stream early */
+        return false;
+    }
+    feed->done += n;
+    if (feed->done == ext->len) {
+        feed->next++;
+        feed->done = 0;
+    }
+    return feed->next < feed->num_extents;
+}
+
+/* serves every stream as its reader drains it; SIGPIPE is blocked in
+ * QEMU threads, so a reader closing early only fails the write
+ */
+static void *kv_log_feeder_thread(void *opaque) {
+    GPtrArray *feeds = g_ptr_array_new();
+    GArray *pfds = g_array_new(false, false, sizeof(struct pollfd));
+    unsigned char *buf = g_malloc(KV_LOG_FEED_CHUNK);
+
+    while (1) {
+        qemu_mutex_lock(&feeds_mutex);
+        for (guint i = 0; i < new_feeds->len; i++) {
+            g_ptr_array_add(feeds, new_feeds->pdata[i]);
+        }
+        g_ptr_array_set_size(new_feeds, 0);
+        qemu_mutex_unlock(&feeds_mutex);
+
+        g_array_set_size(pfds, feeds->len + 1);
+        g_array_index(pfds, struct pollfd, 0) =
+            (struct pollfd) { .fd = feeder_wakeup[0], .events = POLLIN };
+        for (guint i = 0; i < feeds->len; i++) {
+            KvLogFeed *feed = feeds->pdata[i];
+            g_array_index(pfds, struct pollfd, i + 1) =
+                (struct pollfd) { .fd = feed->fd, .events = POLLOUT };
+        }
+        if (poll((struct pollfd *)pfds->data, pfds->len, -1) < 0) {
+            continue;
+        }
+        if (g_array_index(pfds, struct pollfd, 0).revents) {
+            while (read(feeder_wakeup[0], buf, KV_LOG_FEED_CHUNK) > 0) {
+                continue;
+            }
+        }
+        for (guint i = feeds->len; i > 0; i--) {
+            KvLogFeed *feed = feeds->pdata[i - 1];
+            short revents = g_array_index(pfds, struct pollfd, i).revents;
+            if (!revents) {
+                continue;
+            }
+            if ((revents & (POLLERR | POLLHUP | POLLNVAL)) || !kv_log_feed_write(feed, buf)) {
+                kv_log_feed_free(feed);
+                g_ptr_array_remove_index_fast(feeds, i - 1);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* hands a stream to the feeder thread, starting it on first use */
+static bool kv_log_feed_start(KvLogFeed *feed) {
+    qemu_mutex_lock(&feeds_mutex);
+    if (!feeder_started) {
+        if (!g_unix_open_pipe(feeder_wakeup, FD_CLOEXEC, NULL)) {
+            qemu_mutex_unlock(&feeds_mutex);
+            return false;
+        }
+        g_unix_set_fd_nonblocking(feeder_wakeup[0], true, NULL);
+        g_unix_set_fd_nonblocking(feeder_wakeup[1], true, NULL);
+        qemu_thread_create(&feeder_thread, "kv-log-feed", kv_log_feeder_thread, NULL,
+                           QEMU_THREAD_DETACHED);
+        feeder_started = true;
+    }
+    g_ptr_array_add(new_feeds, feed);
+    /* a full wakeup pipe already has the thread coming */
+    if (write(feeder_wakeup[1], "", 1) < 0) {
+        /* nothing to do */
+    }
+    qemu_mutex_unlock(&feeds_mutex);
+    return true;
+}
+
+static int kv_log_object_stream(uint32_t bus_number, uint32_t namespace_id,
+                                const unsigned char *key, size_t key_len) {
+    KvLogEntry entry;
+    int fds[2];
+
+    if (key_len > KV_KEY_MAX_LENGTH) {
+        return KV_ERROR_CANNOT_OPEN;
+    }
+    KvLog *log = kv_log_get(bus_number, namespace_id);
+    if (!log) {
+        return KV_ERROR_FILE_PATH;
+    }
+    if (!kv_log_get_entry(log, key, key_len, &entry)) {
+        return KV_ERROR_CANNOT_OPEN;
+    }
+    if (!g_unix_open_pipe(fds, FD_CLOEXEC, NULL)) {
+        kv_log_put_entry(log, &entry);
+        return KV_ERROR_PIPE;
+    }
+
+    KvLogFeed *feed = g_new0(KvLogFeed, 1);
+    feed->fd = fds[1];
+    feed->extents = g_new(KvLogFeedExtent, entry.num_extents);
+    bool ok = g_unix_set_fd_nonblocking(feed->fd, true, NULL);
+    KvLogSegment *prev = NULL;
+    for (uint32_t i = 0; ok && i < entry.num_extents; i++) {
+        KvLogExtent *ext = kv_log_extent(&entry, i);
+        KvLogFeedExtent *fext = &feed->extents[feed->num_extents];
+        if (!ext->len) {
+            continue;
+        }
+        fext->fd = ext->segment == prev ? fext[-1].fd :
+                   fcntl(ext->segment->fd, F_DUPFD_CLOEXEC, 0);
+        fext->offset = kv_log_extent_data(ext);
+        fext->len = ext->len;
+        ok = fext->fd >= 0;
+        if (ok) {
+            feed->num_extents++;
+            prev = ext->segment;
+        }
+    }
+    kv_log_put_entry(log, &entry);
+
+    if (!ok || (feed->num_extents && !kv_log_feed_start(feed))) {
+        kv_log_feed_free(feed);
+        close(fds[0]);
+        return KV_ERROR_PIPE;
+    }
+    if (!feed->num_extents) {
+        /* the reader gets EOF right away */
+        kv_log_feed_free(feed);
+    }
+    return fds[0];
+}
+
+const KvStoreBackend kv_log_backend = {
+    .name = "log",
+    .store = kv_log_store,
+    .read = kv_log_read,
+    .delete = kv_log_delete,
+    .exist = kv_log_exist,
+    .walk_keys = kv_log_walk_keys,
+    .object_path = kv_log_object_path,
+    .object_stream = kv_log_object_stream,
+    .index_snapshots = false,
+};
@@ -0,0 +1,189 @@
+/*
+ * KV Storage Parquet Shadow Copies
+ *
+ * Copyright (C) 2023 AirMettle, Inc.
+ *
+ * This code is licensed under the GNU GPL v2 or later.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "qemu/kv_utils.h"
+#include "qemu/kv_shadow.h"
+
+#define KV_SHADOW_DIR_SUFFIX ".parquet"
+#define KV_SHADOW_SUFFIX ".parquet"
+/* updates are tracked per shard of keys */
+#define KV_SHADOW_SHARDS 64
+
+typedef struct KvShadowPolicy {
+    uint32_t namespace_id;
+    Query_Data_Type input_format;
+    bool use_csv_headers;
+} KvShadowPolicy;
+
+extern const char *base_dir;
+static GArray *policies;
+static uint64_t generation[KV_SHADOW_SHARDS];
+static QemuMutex lock;
+static bool init;
+
+bool kv_shadow_policy(uint32_t namespace_id, Query_Data_Type *input_format,
+                      bool *use_csv_headers) {
+    for (guint i = 0; policies && i < policies->len; i++) {
+        KvShadowPolicy *policy = &g_array_index(policies, KvShadowPolicy, i);
+
+        if (policy->namespace_id == namespace_id) {
+            *input_format = policy->input_format;
+            *use_csv_headers = policy->use_csv_headers;
+            return true;
+        }
+    }
+    return false;
+}
+
+char *kv_shadow_path(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                     size_t key_len, bool create_folder_on_absence) {
+    g_autofree char *dir_path = g_strdup_printf("%s%s%u/%u" KV_SHADOW_DIR_SUFFIX, base_dir,
+                                                g_str_has_suffix(base_dir, "/") ? "" : "/",
+                                                bus_number, namespace_id);
+    char key_hex[2 * KV_KEY_MAX_LENGTH + 1];
+
+    if (key_len > KV_KEY_MAX_LENGTH) {
+        return NULL;
+    }
+    if (create_folder_on_absence && g_mkdir_with_parents(dir_path, 0777)) {
+        return NULL;
+    }
+    hex(key, key_len, key_hex);
+    key_hex[2 * key_len] = '\0';
+    return g_strdup_printf("%s/%s" KV_SHADOW_SUFFIX, dir_path, key_hex);
+}
+
+static uint64_t *kv_shadow_generation(uint32_t bus_number, uint32_t namespace_id,
+                                      const unsigned char *key, size_t key_len) {
+    KvObjectId id;
+
+    kv_object_id_init(&id, bus_number, namespace_id, key, MIN(key_len, KV_KEY_MAX_LENGTH));
+    return &generation[kv_object_id_hash(&id) % KV_SHADOW_SHARDS];
+}
+
+uint64_t kv_shadow_begin(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                         size_t key_len) {
+    qemu_mutex_lock(&lock);
+    uint64_t gen = *kv_shadow_generation(bus_number, namespace_id, key, key_len);
+    qemu_mutex_unlock(&lock);
+    return gen;
+}
+
+bool kv_shadow_commit(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                      size_t key_len, uint64_t gen, const char *tmp_path) {
+    g_autofree char *path = kv_shadow_path(bus_number, namespace_id, key, key_len, false);
+    bool committed = false;
+
+    qemu_mutex_lock(&lock);
+    if (path && gen == *kv_shadow_generation(bus_number, namespace_id, key, key_len)) {
+        committed = !rename(tmp_path, path);
+    }
+    qemu_mutex_unlock(&lock);
+    if (!committed) {
+        unlink(tmp_path);
+    }
+    return committed;
+}
+
+void kv_shadow_invalidate(uint32_t bus_number, uint32_t namespace_id,
+                          const unsigned char *key, size_t key_len) {
+    Query_Data_Type input_format;
+    bool use_csv_headers;
+
+    if (!init || !kv_shadow_policy(namespace_id, &input_format, &use_csv_headers)) {
+        return;
+    }
+    g_autofree char *path = kv_shadow_path(bus_number, namespace_id, key, key_len, false);
+    qemu_mutex_lock(&lock);
+    (*kv_shadow_generation(bus_number, namespace_id, key, key_len))++;
+    if (path) {
+        unlink(path);
+    }
+    qemu_mutex_unlock(&lock);
+}
+
+char *kv_shadow_lookup(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                       size_t key_len, const char *object_path,
+                       Query_Data_Type input_format, bool use_csv_headers) {
+    Query_Data_Type policy_format;
+    bool policy_headers;
+    struct stat object_st, shadow_st;
+
+    if (!init || !kv_shadow_policy(namespace_id, &policy_format, &policy_headers) ||
+        input_format != policy_format ||
+        (input_format == QUERY_TYPE_CSV && use_csv_headers != policy_headers)) {
+        return NULL;
+    }
+    char *path = kv_shadow_path(bus_number, namespace_id, key, key_len, false);
+    /* an object changed behind the store's back is newer than its shadow */
+    if (!path || stat(path, &shadow_st) || stat(object_path, &object_st) ||
+        shadow_st.st_mtim.tv_sec < object_st.st_mtim.tv_sec ||
+        (shadow_st.st_mtim.tv_sec == object_st.st_mtim.tv_sec &&
+         shadow_st.st_mtim.tv_nsec < object_st.st_mtim.tv_nsec)) {
+        g_free(path);
+        return NULL;
+    }
+    return path;
+}
+
+static bool kv_shadow_parse_format(const char *name, KvShadowPolicy *policy) {
+    if (!g_ascii_strcasecmp(name, "csv")) {
+        policy->input_format = QUERY_TYPE_CSV;
+        policy->use_csv_headers = false;
+    } else if (!g_ascii_strcasecmp(name, "csv-header")) {
+        policy->input_format = QUERY_TYPE_CSV;
+        policy->use_csv_headers = true;
+    } else if (!g_ascii_strcasecmp(name, "json")) {
+        policy->input_format = QUERY_TYPE_JSON;
+        policy->use_csv_headers = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void kv_shadow_reset(void) {
+    const char *env = getenv("KV_PARQUET_NAMESPACES");
+
+    if (!init) {
+        init = true;
+        qemu_mutex_init(&lock);
+        policies = g_array_new(false, false, sizeof(KvShadowPolicy));
+    }
+    qemu_mutex_lock(&lock);
+    for (int i = 0; i < KV_SHADOW_SHARDS; i++) {
+        generation[i]++;
+    }
+    qemu_mutex_unlock(&lock);
+    g_array_set_size(policies, 0);
+    if (!env) {
+        return;
+    }
+    gchar **entries = g_strsplit(env, ",", -1);
+    for (gchar **entry = entries; *entry; entry++) {
+        KvShadowPolicy policy;
+        guint64 namespace_id;
+
+        g_strstrip(*entry);
+        gchar **parts = g_strsplit(*entry, ":", 2);
+        if (parts[0] && parts[1] &&
+            g_ascii_string_to_unsigned(g_strstrip(parts[0]), 10, 0, UINT32_MAX,
+                                       &namespace_id, NULL) &&
+            kv_shadow_parse_format(g_strstrip(parts[1]), &policy)) {
+            policy.namespace_id = namespace_id;
+            g_array_append_val(policies, policy);
+        } else if (**entry) {
+            warn_report("KV_PARQUET_NAMESPACES: ignoring '%s'", *entry);
+        }
+        g_strfreev(parts);
+    }
+    g_strfreev(entries);
+}
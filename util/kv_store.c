@@ -8,58 +8,86 @@
  * This code is licensed under the GNU GPL v2 or later.
  */ 
 
-#include <dirent.h>
+#include "qemu/osdep.h"
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include "qemu/iov.h"
 #include "qemu/kv_utils.h"
 #include "qemu/kv_store.h"
+#include "qemu/kv_index.h"
+#include "qemu/kv_backend.h"
+#include "qemu/kv_io.h"
+#include "qemu/kv_fd_cache.h"
+#include "qemu/kv_value_cache.h"
+#include "qemu/kv_shadow.h"
 
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
-
+/* returns whether the file exists given a key.
+ * 1 means file exists, 0 means file doesn't exist
+ * negative values on errors
+ * The index answers without touching the file system once it is loaded.
+ */
+static int kv_file_exist(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                         size_t key_len) {
+    int res = kv_index_lookup(bus_number, namespace_id, key, key_len);
+    if (res >= 0) {
+        return res;
+    }
+    const char *path_str = get_path_str(bus_number, namespace_id, key, key_len, false);
+    if (!path_str) return KV_ERROR_FILE_PATH;
+    struct stat st;
+    res = kv_io_stat(-1, path_str, &st) == 0;
+    free((void*)path_str);
+    return res;
+}
 
 /* returns number of bytes written, -1 on error
 If append is false, create new file overwriting and truncating if one already exists
 If append is true, append to existing file or create file if it does not exist.
 */
-ssize_t store_object(uint32_t bus_number, uint32_t namespace_id, unsigned char *key, size_t key_len,
-                     unsigned char *value, size_t value_len, bool append, bool must_exist,
-                     bool must_not_exist) {
+static ssize_t kv_file_store(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                             size_t key_len, const struct iovec *value, int value_count,
+                             bool append, bool must_exist, bool must_not_exist) {
     if (must_exist && must_not_exist) {
         return KV_ERROR_INVALID_PARAMETER;
     }
+    if (must_exist || must_not_exist) {
+        int exist = kv_file_exist(bus_number, namespace_id, key, key_len);
+        if (exist < 0) {
+            return exist;
+        }
+        if (must_exist && !exist) {
+            return KV_ERROR_FILE_NOT_FOUND;
+        }
+        if (must_not_exist && exist) {
+            return KV_ERROR_FILE_EXISTS;
+        }
+    }
     const char *path_str = get_path_str(bus_number, namespace_id, key, key_len, true);
     if (!path_str) {
         return KV_ERROR_FILE_PATH;
     }
-    // test the file is already exist for append
-    int exist = access(path_str, F_OK);
-    if (must_exist && exist == -1) {
-        free((void*)path_str);
-        return KV_ERROR_FILE_NOT_FOUND;
-    }
-    if (must_not_exist && exist == 0) {
-        free((void*)path_str);
-        return KV_ERROR_FILE_EXISTS;
-    }
 
-    FILE *filePtr;
-    if (append) filePtr = fopen(path_str, "ab");
-    else filePtr = fopen(path_str, "wb");
-    if (filePtr == NULL) {
+    kv_index_begin_update(bus_number, namespace_id);
+    int fd = kv_io_open(path_str, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC),
+                        0644);
+    if (fd < 0) {
+        kv_index_end_update(bus_number, namespace_id, key, key_len, path_str);
         free((void*)path_str);
         return KV_ERROR_CANNOT_OPEN;
     }
 
-    size_t elementsWritten = fwrite(value, sizeof(unsigned char), value_len, filePtr);
+    int res = kv_writev_full(fd, value, value_count, -1);
 
-    fclose(filePtr);
+    kv_io_close(fd);
+    kv_index_end_update(bus_number, namespace_id, key, key_len, path_str);
+    kv_fd_cache_invalidate(bus_number, namespace_id, key, key_len);
     free((void*)path_str);
-    if (elementsWritten != value_len) {
+    if (res) {
         return KV_ERROR_FILE_WRITE;
     }
-    return elementsWritten;
+    return iov_size(value, value_count);
 }
 
 /* returns number of bytes read, -1 on error
@@ -67,37 +95,48 @@ if offset is non-zero, begin reading at that offset
 buffer is where the data should be read into
 total_object_size is the total size of the object
 */
-ssize_t read_object(uint32_t bus_number, uint32_t namespace_id, unsigned char *key, size_t key_len,
-                    size_t offset, unsigned char *buffer, size_t max_buffer_len,
-                    size_t *total_object_size) {
-    const char *path_str = get_path_str(bus_number, namespace_id, key, key_len, true);
-    if (!path_str) return KV_ERROR_FILE_PATH;
-    FILE *filePtr = fopen(path_str, "rb");
-    if (filePtr == NULL) {
+static ssize_t kv_file_read(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                            size_t key_len, size_t offset, const struct iovec *iov,
+                            int iov_count, size_t *total_object_size) {
+    uint64_t generation;
+    KvFdCacheEntry *entry = kv_fd_cache_get(bus_number, namespace_id, key, key_len,
+                                            &generation);
+    if (!entry) {
+        const char *path_str = get_path_str(bus_number, namespace_id, key, key_len, false);
+        if (!path_str) return KV_ERROR_FILE_PATH;
+        int fd = kv_io_open(path_str, O_RDONLY | O_CLOEXEC, 0);
         free((void*)path_str);
-        return KV_ERROR_CANNOT_OPEN;
-    }
-
-    fseek(filePtr, 0, SEEK_END);
-    *total_object_size = ftell(filePtr);
+        if (fd < 0) {
+            return KV_ERROR_CANNOT_OPEN;
+        }
 
-    if (fseek(filePtr, offset, SEEK_SET) != 0) {
-        fclose(filePtr);
-        free((void*)path_str);
-        return KV_ERROR_FILE_OFFSET;
+        struct stat st;
+        if (kv_io_stat(fd, NULL, &st)) {
+            kv_io_close(fd);
+            return KV_ERROR_FILE_READ;
+        }
+        entry = kv_fd_cache_insert(bus_number, namespace_id, key, key_len, fd, st.st_size,
+                                   generation);
     }
+    *total_object_size = entry->size;
 
-    size_t bytesRead = fread(buffer, sizeof(unsigned char), max_buffer_len, filePtr);
-    free((void*)path_str);
-    fclose(filePtr);
+    ssize_t bytesRead = kv_readv_full(entry->fd, iov, iov_count, offset);
+    kv_fd_cache_put(entry);
+    if (bytesRead < 0) {
+        return KV_ERROR_FILE_READ;
+    }
     return bytesRead;
 }
 
 /* return 0 on success */
-int delete_object(uint32_t bus_number, uint32_t namespace_id, unsigned char *key, size_t key_len) {
+static int kv_file_delete(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                          size_t key_len) {
     const char *path_str = get_path_str(bus_number, namespace_id, key, key_len, true);
     if (!path_str) return KV_ERROR_FILE_PATH;
-    int res = remove(path_str);
+    kv_index_begin_update(bus_number, namespace_id);
+    int res = kv_io_unlink(path_str);
+    kv_index_end_update(bus_number, namespace_id, key, key_len, path_str);
+    kv_fd_cache_invalidate(bus_number, namespace_id, key, key_len);
     free((void*)path_str);
     if (!res) {
         return 0;
@@ -108,19 +147,6 @@ int delete_object(uint32_t bus_number, uint32_t namespace_id, unsigned char *key
     return KV_ERROR_REMOVE;
 }
 
-int compareStrings(const void *a, const void *b);
-int compareStrings(const void *a, const void *b) {
-    const char *str1 = *(const char **) a;
-    const char *str2 = *(const char **) b;
-    return strcmp(str1, str2);
-}
-
-unsigned char hex_str_to_uchar(char hex);
-unsigned char hex_str_to_uchar(char hex) {
-    if (hex <= '9') return hex - '0';
-    return hex - 'A' + 10;
-}
-
 /* return keys in order that are greater or equal to key prefix*/
 int list_objects(uint32_t bus_number, uint32_t namespace_id, unsigned char *key_prefix,
                         size_t key_prefix_len, size_t offset, size_t max_to_return,
@@ -129,105 +155,114 @@ int list_objects(uint32_t bus_number, uint32_t namespace_id, unsigned char *key_
     if (!max_to_return) {
         max_to_return = 0xFFFFFFFF;
     }
-    DIR *dir = opendir(get_path_str(bus_number, namespace_id, NULL, 0, true));
-    struct dirent *entry;
-    if (dir == NULL) {
-        return KV_ERROR_FILE_PATH;
-    }
+    return kv_index_list(bus_number, namespace_id, key_prefix, key_prefix_len, offset,
+                         max_to_return, num_objects_returned, objects);
+}
 
-    char prefix_hex_str[2 * key_prefix_len + 1];
-    hex(key_prefix, key_prefix_len, prefix_hex_str);
-    prefix_hex_str[2 * key_prefix_len] = '\0';
+static int kv_file_walk_keys(uint32_t bus_number, uint32_t namespace_id, KvWalkObjectFunc func,
+                             void *opaque) {
+    return kv_walk_objects(bus_number, namespace_id, func, NULL, opaque);
+}
 
-    // get all keys in string that are >= prefix
-    size_t dir_list_size = 0, dir_list_capacity = 128, max_key_str_len = 2 * 16 + 1;
-    char **dir_list = malloc(dir_list_capacity * sizeof(char *));
-    if (!dir_list) {
-        closedir(dir);
-        return KV_ERROR_MEMORY_ALLOCATION;
-    }
+static char *kv_file_object_path(uint32_t bus_number, uint32_t namespace_id,
+                                 const unsigned char *key, size_t key_len, bool *is_temp) {
+    *is_temp = false;
+    return (char *)get_path_str(bus_number, namespace_id, key, key_len, false);
+}
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (dir_list_size == dir_list_capacity) {
-            dir_list_capacity = MIN(dir_list_capacity * 2, max_to_return + offset);
-            char **new_dir_list = realloc(dir_list, dir_list_capacity * sizeof(char *));
-            if (!new_dir_list) {
-                free(dir_list);
-                closedir(dir);
-                return KV_ERROR_MEMORY_ALLOCATION;
-            }
-            dir_list = new_dir_list;
-        }
-        if (entry->d_type != DT_REG) continue;
-        if (key_prefix_len && strcmp(entry->d_name, prefix_hex_str) < 0) continue;
-        dir_list[dir_list_size] = malloc(max_key_str_len);
-        if (!dir_list[dir_list_size]) {
-            for (int i = 0; i < dir_list_size; ++i) {
-                free(dir_list[i]);
-            }
-            free(dir_list);
-            closedir(dir);
-            return KV_ERROR_MEMORY_ALLOCATION;
-        }
-        strcpy(dir_list[dir_list_size++], entry->d_name);
-    }
-    closedir(dir);
-    if (dir_list_size <= offset) {
-        for (int i = 0; i < dir_list_size; ++i) {
-            free(dir_list[i]);
-        }
-        free(dir_list);
-        *num_objects_returned = 0;
-        *objects = NULL;
-        return 0;
-    }
+const KvStoreBackend kv_file_backend = {
+    .name = "file",
+    .store = kv_file_store,
+    .read = kv_file_read,
+    .delete = kv_file_delete,
+    .exist = kv_file_exist,
+    .walk_keys = kv_file_walk_keys,
+    .object_path = kv_file_object_path,
+    .index_snapshots = true,
+};
 
-    // sort the keys
-    qsort(dir_list, dir_list_size, sizeof(char *), compareStrings);
+const KvStoreBackend *kv_store_backend(uint32_t namespace_id) {
+    return kv_namespace_uses_log(namespace_id) ? &kv_log_backend : &kv_file_backend;
+}
 
-    // convert string to unsigned char and put into ObjectKey list
-    *num_objects_returned = MIN(dir_list_size - offset, max_to_return);
-    *objects = malloc((*num_objects_returned) * sizeof(ObjectKey));
-    if (!(*objects)) {
-        for (int i = 0; i < dir_list_size; ++i) {
-            free(dir_list[i]);
-        }
-        free(dir_list);
-        return KV_ERROR_MEMORY_ALLOCATION;
-    }
+ssize_t store_object(uint32_t bus_number, uint32_t namespace_id, unsigned char *key, size_t key_len,
+                     unsigned char *value, size_t value_len, bool append, bool must_exist,
+                     bool must_not_exist) {
+    struct iovec iov = { .iov_base = value, .iov_len = value_len };
+    return store_object_iov(bus_number, namespace_id, key, key_len, &iov, 1, append, must_exist,
+                            must_not_exist);
+}
 
-    for (size_t i = offset; i < offset + (*num_objects_returned); ++i) {
-        size_t key_len = strlen(dir_list[i]) / 2;
-        (*objects)[i - offset].key_len = key_len;
-        if (key_len > 16) {
-            for (int j = 0; j < dir_list_size; ++j) {
-                free(dir_list[j]);
-            }
-            free(dir_list);
-            free(*objects);
-            return KV_ERROR_KEY_TOO_LONG;
-        }
-        for (int j = 0; j < key_len; ++j) {
-            (*objects)[i - offset].key[j] =
-                    hex_str_to_uchar(dir_list[i][j * 2]) * 16 +
-                    hex_str_to_uchar(dir_list[i][j * 2 + 1]);
-        }
-    }
+ssize_t store_object_iov(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                         size_t key_len, const struct iovec *iov, int iov_count, bool append,
+                         bool must_exist, bool must_not_exist) {
+    uint64_t generation = kv_value_cache_begin_update(bus_number, namespace_id, key, key_len);
+    ssize_t res = kv_store_backend(namespace_id)->store(bus_number, namespace_id, key, key_len,
+                                                        iov, iov_count, append, must_exist,
+                                                        must_not_exist);
+    /* write-through, appends only drop the cached value */
+    kv_value_cache_end_update(bus_number, namespace_id, key, key_len,
+                              res >= 0 && !append ? iov : NULL, iov_count, generation);
+    kv_shadow_invalidate(bus_number, namespace_id, key, key_len);
+    return res;
+}
 
-    for (int i = 0; i < dir_list_size; ++i) {
-        free(dir_list[i]);
+ssize_t read_object(uint32_t bus_number, uint32_t namespace_id, unsigned char *key, size_t key_len,
+                    size_t offset, unsigned char *buffer, size_t max_buffer_len,
+                    size_t *total_object_size) {
+    struct iovec iov = { .iov_base = buffer, .iov_len = max_buffer_len };
+    return read_object_iov(bus_number, namespace_id, key, key_len, offset, &iov, 1,
+                           total_object_size);
+}
+
+ssize_t read_object_iov(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                        size_t key_len, size_t offset, const struct iovec *iov, int iov_count,
+                        size_t *total_object_size) {
+    uint64_t generation;
+    ssize_t res;
+
+    if (kv_value_cache_read(bus_number, namespace_id, key, key_len, offset, iov, iov_count, &res,
+                            total_object_size, &generation)) {
+        return res;
+    }
+    res = kv_store_backend(namespace_id)->read(bus_number, namespace_id, key, key_len, offset,
+                                               iov, iov_count, total_object_size);
+    if (res >= 0 && !offset && res == *total_object_size) {
+        kv_value_cache_fill(bus_number, namespace_id, key, key_len, iov, iov_count, res,
+                            generation);
     }
-    free(dir_list);
-    return 0;
+    return res;
+}
+
+int delete_object(uint32_t bus_number, uint32_t namespace_id, unsigned char *key, size_t key_len) {
+    uint64_t generation = kv_value_cache_begin_update(bus_number, namespace_id, key, key_len);
+    int res = kv_store_backend(namespace_id)->delete(bus_number, namespace_id, key, key_len);
+    kv_value_cache_end_update(bus_number, namespace_id, key, key_len, NULL, 0, generation);
+    kv_shadow_invalidate(bus_number, namespace_id, key, key_len);
+    return res;
 }
 
-/* returns whether the file exists given a key.
- * 1 means file exists, 0 means file doesn't exist
- * negative values on errors
- */
 int file_exist(uint32_t bus_number, uint32_t namespace_id, unsigned char *key, size_t key_len) {
-    const char *path_str = get_path_str(bus_number, namespace_id, key, key_len, false);
-    if (!path_str) return KV_ERROR_FILE_PATH;
-    // test the file is already exist for append
-    return access(path_str, F_OK) + 1;
+    return kv_store_backend(namespace_id)->exist(bus_number, namespace_id, key, key_len);
+}
+
+int kv_store_walk_keys(uint32_t bus_number, uint32_t namespace_id, KvWalkObjectFunc func,
+                       void *opaque) {
+    return kv_store_backend(namespace_id)->walk_keys(bus_number, namespace_id, func, opaque);
+}
+
+char *kv_store_object_path(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                           size_t key_len, bool *is_temp) {
+    return kv_store_backend(namespace_id)->object_path(bus_number, namespace_id, key, key_len,
+                                                       is_temp);
+}
+
+int kv_store_object_stream(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                           size_t key_len) {
+    const KvStoreBackend *backend = kv_store_backend(namespace_id);
+
+    if (!backend->object_stream) {
+        return KV_ERROR_INVALID_PARAMETER;
+    }
+    return backend->object_stream(bus_number, namespace_id, key, key_len);
 }
@@ -8,19 +8,162 @@
  * This code is licensed under the GNU GPL v2 or later.
  */ 
 
+#include "qemu/osdep.h"
 #include "qemu/kv_utils.h"
+#include "qemu/kv_index.h"
+#include "qemu/kv_backend.h"
+#include "qemu/kv_io.h"
+#include "qemu/kv_fd_cache.h"
+#include "qemu/kv_value_cache.h"
+#include "qemu/kv_shadow.h"
+#include "qemu/bitmap.h"
+#include "qemu/iov.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <dirent.h>
+
+#define KV_DIR_MAX_LEVELS 2
+#define KV_DIR_LAYOUT_FILE ".layout"
 
 const char *base_dir = NULL;
+static int dir_levels;
+static bool log_all_namespaces;
+static GArray *log_namespaces;
+
+/*
+ * per (bus, namespace) directory state; the flags only ever go from false to
+ * true, so once set they are read without a lock
+ */
+typedef struct KvNamespaceDir {
+    uint64_t id;
+    /* serializes mkdir and layout migration of this namespace */
+    QemuMutex setup_mutex;
+    /* the namespace directory has been checked against dir_levels */
+    bool layout_checked;
+    /* base, bus and namespace directories exist */
+    bool dirs_created;
+    /* level 1 shard dirs in bits 0-255, level 2 shard dirs after that */
+    unsigned long *shards_created;
+} KvNamespaceDir;
+
+/* namespace_dirs_mutex only covers lookup and insertion */
+static GHashTable *namespace_dirs;
+static QemuMutex namespace_dirs_mutex;
+
+static void kv_namespace_dir_free(gpointer data) {
+    KvNamespaceDir *nsd = data;
+    qemu_mutex_destroy(&nsd->setup_mutex);
+    g_free(nsd->shards_created);
+    g_free(nsd);
+}
+
+bool kv_object_id_init(KvObjectId *id, uint32_t bus_number, uint32_t namespace_id,
+                       const unsigned char *key, size_t key_len) {
+    if (key_len > KV_KEY_MAX_LENGTH) {
+        return false;
+    }
+    memset(id, 0, sizeof(*id));
+    id->bus_number = bus_number;
+    id->namespace_id = namespace_id;
+    id->key_len = key_len;
+    if (key_len) {
+        memcpy(id->key, key, key_len);
+    }
+    return true;
+}
+
+unsigned int kv_object_id_hash(const void *v) {
+    const KvObjectId *id = v;
+    uint32_t h = 2166136261u;
+
+    h = (h ^ id->bus_number) * 16777619u;
+    h = (h ^ id->namespace_id) * 16777619u;
+    for (size_t i = 0; i < id->key_len; i++) {
+        h = (h ^ id->key[i]) * 16777619u;
+    }
+    return h;
+}
+
+int kv_object_id_equal(const void *a, const void *b) {
+    const KvObjectId *ia = a, *ib = b;
+
+    return ia->bus_number == ib->bus_number && ia->namespace_id == ib->namespace_id &&
+           ia->key_len == ib->key_len && !memcmp(ia->key, ib->key, ia->key_len);
+}
 
 void kv_store_init(void) {
+    /* indexes, logs and files opened so far belong to the previous base dir */
+    kv_index_reset();
+    kv_log_reset();
+    kv_fd_cache_reset();
+    kv_value_cache_reset();
+    kv_shadow_reset();
     base_dir = getenv("KV_BASE_DIR");
     if (!base_dir) {
         /* use current dir */
         base_dir = ".";
     }
+
+    dir_levels = 0;
+    const char *dir_levels_env = getenv("KV_DIR_LEVELS");
+    if (dir_levels_env) {
+        dir_levels = atoi(dir_levels_env);
+    }
+    if (dir_levels < 0 || dir_levels > KV_DIR_MAX_LEVELS) {
+        dir_levels = 0;
+    }
+
+    log_all_namespaces = false;
+    if (!log_namespaces) {
+        log_namespaces = g_array_new(false, false, sizeof(uint32_t));
+    }
+    g_array_set_size(log_namespaces, 0);
+    const char *log_namespaces_env = getenv("KV_LOG_NAMESPACES");
+    if (log_namespaces_env) {
+        gchar **ids = g_strsplit(log_namespaces_env, ",", -1);
+        for (gchar **id = ids; *id; id++) {
+            guint64 namespace_id;
+            g_strstrip(*id);
+            if (!g_ascii_strcasecmp(*id, "all")) {
+                log_all_namespaces = true;
+            } else if (g_ascii_string_to_unsigned(*id, 10, 0, UINT32_MAX, &namespace_id, NULL)) {
+                uint32_t nsid = namespace_id;
+                g_array_append_val(log_namespaces, nsid);
+            } else if (**id) {
+                warn_report("KV_LOG_NAMESPACES: ignoring '%s'", *id);
+            }
+        }
+        g_strfreev(ids);
+    }
+
+    if (!namespace_dirs) {
+        qemu_mutex_init(&namespace_dirs_mutex);
+        namespace_dirs = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL,
+                                               kv_namespace_dir_free);
+    }
+    /* no operation is in flight, entries are used outside the lock */
+    qemu_mutex_lock(&namespace_dirs_mutex);
+    g_hash_table_remove_all(namespace_dirs);
+    qemu_mutex_unlock(&namespace_dirs_mutex);
+}
+
+int kv_dir_levels(void) {
+    return dir_levels;
+}
+
+bool kv_namespace_uses_log(uint32_t namespace_id) {
+    if (log_all_namespaces) {
+        return true;
+    }
+    for (guint i = 0; log_namespaces && i < log_namespaces->len; i++) {
+        if (g_array_index(log_namespaces, uint32_t, i) == namespace_id) {
+            return true;
+        }
+    }
+    return false;
 }
 
 void hex(const unsigned char *key, size_t key_len, char *buffer) {
@@ -32,33 +175,388 @@ void hex(const unsigned char *key, size_t key_len, char *buffer) {
     }
 }
 
+static int unhex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+int unhex(const char *str, size_t str_len, unsigned char *key) {
+    if (str_len % 2) {
+        return -1;
+    }
+    for (size_t i = 0; i < str_len / 2; ++i) {
+        int hi = unhex_digit(str[2 * i]);
+        int lo = unhex_digit(str[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return -1;
+        }
+        key[i] = hi * 16 + lo;
+    }
+    return 0;
+}
+
+/* FNV-1a, the shard dirs of a key are the low bytes of its hash */
+static uint32_t kv_key_hash(const unsigned char *key, size_t key_len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < key_len; ++i) {
+        h ^= key[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static size_t kv_dir_path(char *path_str, uint32_t bus_number, uint32_t namespace_id) {
+    size_t pos = strlen(base_dir);
+    memcpy(path_str, base_dir, pos);
+    if (path_str[pos - 1] != '/') {
+        path_str[pos++] = '/';
+    }
+    pos += sprintf(path_str + pos, "%u/%u/", bus_number, namespace_id);
+    return pos;
+}
+
+static size_t kv_object_path(char *path_str, size_t pos, const unsigned char *key, size_t key_len,
+                             int levels) {
+    uint32_t h = kv_key_hash(key, key_len);
+    for (int i = 0; i < levels; ++i) {
+        unsigned char shard = h >> (8 * i);
+        hex(&shard, 1, path_str + pos);
+        pos += 2;
+        path_str[pos++] = '/';
+    }
+    hex(key, key_len, path_str + pos);
+    pos += 2 * key_len;
+    path_str[pos] = '\0';
+    return pos;
+}
+
+static int kv_read_layout(const char *dir_path) {
+    char *layout_path = g_strdup_printf("%s" KV_DIR_LAYOUT_FILE, dir_path);
+    FILE *file = fopen(layout_path, "r");
+    int levels = 0;
+    g_free(layout_path);
+    if (file) {
+        if (fscanf(file, "%d", &levels) != 1 || levels < 0 || levels > KV_DIR_MAX_LEVELS) {
+            levels = 0;
+        }
+        fclose(file);
+    }
+    return levels;
+}
+
+static int kv_write_layout(const char *dir_path, int levels) {
+    char *layout_path = g_strdup_printf("%s" KV_DIR_LAYOUT_FILE, dir_path);
+    int res = 0;
+    if (!levels) {
+        if (remove(layout_path) && errno != ENOENT) {
+            res = KV_ERROR_FILE_WRITE;
+        }
+    } else {
+        FILE *file = fopen(layout_path, "w");
+        if (!file) {
+            res = KV_ERROR_CANNOT_OPEN;
+        } else {
+            if (fprintf(file, "%d\n", levels) < 0) {
+                res = KV_ERROR_FILE_WRITE;
+            }
+            if (fclose(file)) {
+                res = KV_ERROR_FILE_WRITE;
+            }
+        }
+    }
+    g_free(layout_path);
+    return res;
+}
+
+static int kv_walk_dir(char *path_str, size_t pos, int depth, int levels,
+                       KvWalkObjectFunc object_func, KvWalkDirFunc dir_func, void *opaque) {
+    DIR *dir = opendir(path_str);
+    struct dirent *entry;
+    int res = 0;
+    if (dir == NULL) {
+        return KV_ERROR_FILE_PATH;
+    }
+    if (dir_func) {
+        res = dir_func(path_str, opaque);
+    }
+    while (!res && (entry = readdir(dir)) != NULL) {
+        unsigned char key[KV_KEY_MAX_LENGTH];
+        size_t name_len = strlen(entry->d_name);
+        if (depth < levels) {
+            /* shard dirs are two hex digits */
+            if (entry->d_type != DT_DIR || name_len != 2 || unhex(entry->d_name, 2, key)) {
+                continue;
+            }
+            memcpy(path_str + pos, entry->d_name, 2);
+            path_str[pos + 2] = '/';
+            path_str[pos + 3] = '\0';
+            res = kv_walk_dir(path_str, pos + 3, depth + 1, levels, object_func, dir_func, opaque);
+            continue;
+        }
+        if (!object_func || entry->d_type != DT_REG || name_len > 2 * KV_KEY_MAX_LENGTH ||
+            unhex(entry->d_name, name_len, key)) {
+            continue;
+        }
+        memcpy(path_str + pos, entry->d_name, name_len + 1);
+        res = object_func(key, name_len / 2, path_str, opaque);
+    }
+    path_str[pos] = '\0';
+    closedir(dir);
+    return res;
+}
+
+typedef struct KvMigrateState {
+    char *new_path;
+    size_t new_pos;
+    int new_levels;
+    size_t moved;
+} KvMigrateState;
+
+static int kv_migrate_object(const unsigned char *key, size_t key_len, const char *path_str,
+                             void *opaque) {
+    KvMigrateState *s = opaque;
+    uint32_t h = kv_key_hash(key, key_len);
+    size_t pos = s->new_pos;
+
+    for (int i = 0; i < s->new_levels; ++i) {
+        unsigned char shard = h >> (8 * i);
+        hex(&shard, 1, s->new_path + pos);
+        pos += 2;
+        s->new_path[pos] = '\0';
+        mkdir(s->new_path, 0777);
+        s->new_path[pos++] = '/';
+    }
+    kv_object_path(s->new_path, s->new_pos, key, key_len, s->new_levels);
+    if (rename(path_str, s->new_path)) {
+        return KV_ERROR_FILE_WRITE;
+    }
+    s->moved++;
+    return 0;
+}
+
+static int kv_remove_shard_dir(const char *path_str, void *opaque) {
+    const char *dir_path = opaque;
+    /* fails harmlessly on shard dirs still in use */
+    if (strcmp(path_str, dir_path)) {
+        rmdir(path_str);
+    }
+    return 0;
+}
+
+/* move every object of an existing namespace dir from old_levels to new_levels */
+static int kv_migrate_layout(const char *dir_path, int old_levels, int new_levels) {
+    size_t dir_len = strlen(dir_path);
+    size_t path_size = dir_len + 3 * KV_DIR_MAX_LEVELS + 2 * KV_KEY_MAX_LENGTH + 1;
+    char *old_path = g_malloc(path_size);
+    KvMigrateState s = {
+        .new_path = g_malloc(path_size),
+        .new_pos = dir_len,
+        .new_levels = new_levels,
+    };
+
+    memcpy(old_path, dir_path, dir_len + 1);
+    memcpy(s.new_path, dir_path, dir_len + 1);
+    /* a key's depth always changes, so moved objects are never walked again */
+    int res = kv_walk_dir(old_path, dir_len, 0, old_levels, kv_migrate_object, NULL, &s);
+    if (!res) {
+        if (old_levels > new_levels) {
+            /* deepest dirs first */
+            for (int depth = old_levels; depth > new_levels; depth--) {
+                kv_walk_dir(old_path, dir_len, 0, depth, NULL, kv_remove_shard_dir,
+                            (void *)dir_path);
+            }
+        }
+        res = kv_write_layout(dir_path, new_levels);
+    }
+    if (!res && s.moved) {
+        info_report("KV: moved %zu objects of %s to a %d level layout", s.moved, dir_path,
+                    new_levels);
+    }
+    g_free(old_path);
+    g_free(s.new_path);
+    return res;
+}
+
+static KvNamespaceDir *kv_namespace_dir_lookup(uint32_t bus_number, uint32_t namespace_id) {
+    uint64_t id = ((uint64_t)bus_number << 32) | namespace_id;
+
+    qemu_mutex_lock(&namespace_dirs_mutex);
+    KvNamespaceDir *nsd = g_hash_table_lookup(namespace_dirs, &id);
+    if (!nsd) {
+        nsd = g_new0(KvNamespaceDir, 1);
+        nsd->id = id;
+        qemu_mutex_init(&nsd->setup_mutex);
+        if (dir_levels) {
+            nsd->shards_created = bitmap_new(256 + (dir_levels > 1 ? 256 * 256 : 0));
+        }
+        g_hash_table_insert(namespace_dirs, &nsd->id, nsd);
+    }
+    qemu_mutex_unlock(&namespace_dirs_mutex);
+    return nsd;
+}
+
+/* called with nsd->setup_mutex held */
+static void kv_namespace_dir_setup(KvNamespaceDir *nsd, const char *dir_path, size_t dir_pos,
+                                   bool create_folder_on_absence) {
+    if (create_folder_on_absence && !nsd->dirs_created) {
+        /* dir_path is "<base>/<bus>/<nsid>/", create each component */
+        char *p = g_strdup(dir_path);
+        for (size_t i = 1; i < dir_pos; i++) {
+            if (p[i] == '/') {
+                p[i] = '\0';
+                mkdir(p, 0777);
+                p[i] = '/';
+            }
+        }
+        g_free(p);
+        qatomic_store_release(&nsd->dirs_created, true);
+    }
+
+    if (!nsd->layout_checked) {
+        struct stat st;
+        if (stat(dir_path, &st)) {
+            /* nothing stored yet, a new namespace dir starts in the configured layout */
+            if (!create_folder_on_absence) {
+                return;
+            }
+        }
+        int old_levels = kv_read_layout(dir_path);
+        if (old_levels != dir_levels) {
+            int res = kv_migrate_layout(dir_path, old_levels, dir_levels);
+            if (res) {
+                error_report("KV: failed to migrate %s to a %d level layout: %d", dir_path,
+                             dir_levels, res);
+                return;
+            }
+        }
+        qatomic_store_release(&nsd->layout_checked, true);
+    }
+}
+
+static KvNamespaceDir *kv_namespace_dir_get(uint32_t bus_number, uint32_t namespace_id,
+                                            const char *dir_path, size_t dir_pos,
+                                            bool create_folder_on_absence) {
+    KvNamespaceDir *nsd = kv_namespace_dir_lookup(bus_number, namespace_id);
+
+    if (!qatomic_load_acquire(&nsd->layout_checked) ||
+        (create_folder_on_absence && !qatomic_load_acquire(&nsd->dirs_created))) {
+        qemu_mutex_lock(&nsd->setup_mutex);
+        kv_namespace_dir_setup(nsd, dir_path, dir_pos, create_folder_on_absence);
+        qemu_mutex_unlock(&nsd->setup_mutex);
+    }
+    return nsd;
+}
+
+static void kv_create_shard_dirs(KvNamespaceDir *nsd, char *path_str, size_t pos,
+                                 const unsigned char *key, size_t key_len) {
+    uint32_t h = kv_key_hash(key, key_len);
+    long bit = 0;
+    for (int i = 0; i < dir_levels; ++i) {
+        unsigned char shard = h >> (8 * i);
+        bit = i == 0 ? shard : 256 + bit * 256 + shard;
+        pos += 2;
+        /* racing threads may both mkdir, which is harmless */
+        if (!test_bit(bit, nsd->shards_created)) {
+            char c = path_str[pos];
+            path_str[pos] = '\0';
+            mkdir(path_str, 0777);
+            path_str[pos] = c;
+            set_bit_atomic(bit, nsd->shards_created);
+        }
+        pos++;
+    }
+}
+
 const char *
 get_path_str(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key, size_t key_len,
              bool create_folder_on_absence) {
     size_t base_dir_len = strlen(base_dir);
-    char *path_str = malloc(base_dir_len + 2 + 33 + 33 + 2 * key_len + 1);
+    char *path_str = malloc(base_dir_len + 2 + 33 + 33 + 3 * KV_DIR_MAX_LEVELS + 2 * key_len + 1);
     if (!path_str) {
         return NULL;
     }
-    size_t pos = 0;
-    strcpy(path_str, base_dir);
-    pos += strlen(base_dir);
-    if (create_folder_on_absence) mkdir(path_str, 0777);
-    if (path_str[pos - 1] != '/') {
-        path_str[pos++] = '/';
-    }
-    pos += sprintf(path_str + pos, "%u", bus_number);
-    if (create_folder_on_absence) mkdir(path_str, 0777);
-    path_str[pos++] = '/';
-
-    pos += sprintf(path_str + pos, "%u", namespace_id);
-    if (create_folder_on_absence) mkdir(path_str, 0777);
-    path_str[pos++] = '/';
+    size_t pos = kv_dir_path(path_str, bus_number, namespace_id);
 
+    KvNamespaceDir *nsd = kv_namespace_dir_get(bus_number, namespace_id, path_str, pos,
+                                               create_folder_on_absence);
     if (key_len) { // get file path
-        hex(key, key_len, path_str + pos);
-        pos += 2 * key_len;
+        kv_object_path(path_str, pos, key, key_len, dir_levels);
+        if (create_folder_on_absence && dir_levels) {
+            kv_create_shard_dirs(nsd, path_str, pos, key, key_len);
+        }
     } // else get dir path
-    path_str[pos] = '\0';
     return path_str;
-}
\ No newline at end of file
+}
+
+int kv_walk_objects(uint32_t bus_number, uint32_t namespace_id, KvWalkObjectFunc object_func,
+                    KvWalkDirFunc dir_func, void *opaque) {
+    /* make sure the layout is settled before walking it */
+    const char *dir_path = get_path_str(bus_number, namespace_id, NULL, 0, true);
+    if (!dir_path) {
+        return KV_ERROR_FILE_PATH;
+    }
+    size_t dir_len = strlen(dir_path);
+    char *path_str = g_malloc(dir_len + 3 * KV_DIR_MAX_LEVELS + 2 * KV_KEY_MAX_LENGTH + 1);
+    memcpy(path_str, dir_path, dir_len + 1);
+    int res = kv_walk_dir(path_str, dir_len, 0, dir_levels, object_func, dir_func, opaque);
+    g_free(path_str);
+    free((void *)dir_path);
+    return res;
+}
+
+int kv_writev_full(int fd, const struct iovec *iov, int iov_count, off_t offset) {
+    /* partial writes are continued on a copy of the array */
+    struct iovec *copy = g_memdup2(iov, iov_count * sizeof(*iov));
+    struct iovec *cur = copy;
+    unsigned int cnt = iov_count;
+    int res = 0;
+
+    while (cnt) {
+        ssize_t n = kv_io_pwritev(fd, cur, MIN(cnt, IOV_MAX), offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 || (n == 0 && iov_size(cur, cnt))) {
+            res = -1;
+            break;
+        }
+        if (offset >= 0) {
+            offset += n;
+        }
+        iov_discard_front(&cur, &cnt, n);
+    }
+    g_free(copy);
+    return res;
+}
+
+ssize_t kv_readv_full(int fd, const struct iovec *iov, int iov_count, off_t offset) {
+    struct iovec *copy = g_memdup2(iov, iov_count * sizeof(*iov));
+    struct iovec *cur = copy;
+    unsigned int cnt = iov_count;
+    ssize_t total = 0;
+
+    while (cnt) {
+        ssize_t n = kv_io_preadv(fd, cur, MIN(cnt, IOV_MAX), offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            total = -1;
+            break;
+        }
+        if (n == 0) {
+            /* end of file */
+            break;
+        }
+        offset += n;
+        total += n;
+        iov_discard_front(&cur, &cnt, n);
+    }
+    g_free(copy);
+    return total;
+}
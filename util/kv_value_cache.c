@@ -0,0 +1,260 @@
+/*
+ * KV Storage Value Cache
+ *
+ * Copyright (C) 2023 AirMettle, Inc.
+ *
+ * This code is licensed under the GNU GPL v2 or later.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
+#include "qemu/kv_utils.h"
+#include "qemu/kv_value_cache.h"
+
+#define KV_VALUE_CACHE_SIZE (64 * MiB)
+#define KV_VALUE_CACHE_MAX_OBJECT (256 * KiB)
+/* percentage of the budget the protected segment may take */
+#define KV_VALUE_CACHE_PROTECTED 80
+/* updates are tracked per shard of keys so unrelated stores do not keep
+ * reads from filling the cache
+ */
+#define KV_VALUE_CACHE_SHARDS 64
+
+typedef enum KvValueSegment {
+    KV_VALUE_PROBATION,
+    KV_VALUE_PROTECTED,
+    KV_VALUE__MAX
+} KvValueSegment;
+
+typedef struct KvValueNode {
+    KvObjectId id;
+    unsigned char *data;
+    size_t size;
+    KvValueSegment segment;
+    QTAILQ_ENTRY(KvValueNode) lru;
+} KvValueNode;
+
+static GHashTable *nodes;
+/* most recently used first */
+static QTAILQ_HEAD(, KvValueNode) lists[KV_VALUE__MAX];
+static uint64_t bytes[KV_VALUE__MAX];
+static uint64_t budget;
+static uint64_t max_object;
+static bool enabled;
+static uint64_t generation[KV_VALUE_CACHE_SHARDS];
+static KvValueCacheStats stats;
+static QemuMutex lock;
+static bool init;
+
+static uint64_t *kv_value_cache_generation(const KvObjectId *id) {
+    return &generation[kv_object_id_hash(id) % KV_VALUE_CACHE_SHARDS];
+}
+
+static void kv_value_cache_link(KvValueNode *node, KvValueSegment segment) {
+    node->segment = segment;
+    QTAILQ_INSERT_HEAD(&lists[segment], node, lru);
+    bytes[segment] += node->size;
+}
+
+static void kv_value_cache_unlink(KvValueNode *node) {
+    QTAILQ_REMOVE(&lists[node->segment], node, lru);
+    bytes[node->segment] -= node->size;
+}
+
+/* called with lock held */
+static void kv_value_cache_remove_locked(KvValueNode *node) {
+    g_hash_table_remove(nodes, &node->id);
+    kv_value_cache_unlink(node);
+    stats.entries--;
+    g_free(node->data);
+    g_free(node);
+}
+
+/* called with lock held */
+static void kv_value_cache_evict_locked(void) {
+    while (bytes[KV_VALUE_PROBATION] + bytes[KV_VALUE_PROTECTED] > budget) {
+        KvValueNode *victim = QTAILQ_LAST(&lists[KV_VALUE_PROBATION]);
+        if (!victim) {
+            victim = QTAILQ_LAST(&lists[KV_VALUE_PROTECTED]);
+        }
+        kv_value_cache_remove_locked(victim);
+        stats.evictions++;
+    }
+}
+
+/* called with lock held, replaces a cached value of the key */
+static void kv_value_cache_insert_locked(const KvObjectId *id, const struct iovec *iov,
+                                         int iov_count, size_t size) {
+    KvValueNode *node = g_hash_table_lookup(nodes, id);
+
+    if (node) {
+        kv_value_cache_remove_locked(node);
+    }
+    if (size > max_object || size > budget) {
+        return;
+    }
+    node = g_new0(KvValueNode, 1);
+    node->id = *id;
+    node->size = size;
+    node->data = g_malloc(size);
+    iov_to_buf(iov, iov_count, 0, node->data, size);
+    g_hash_table_insert(nodes, &node->id, node);
+    kv_value_cache_link(node, KV_VALUE_PROBATION);
+    stats.entries++;
+    kv_value_cache_evict_locked();
+}
+
+/* called with lock held */
+static void kv_value_cache_touch_locked(KvValueNode *node) {
+    kv_value_cache_unlink(node);
+    kv_value_cache_link(node, KV_VALUE_PROTECTED);
+    /* demoted values get another chance in the probationary segment */
+    while (bytes[KV_VALUE_PROTECTED] > budget * KV_VALUE_CACHE_PROTECTED / 100) {
+        KvValueNode *demoted = QTAILQ_LAST(&lists[KV_VALUE_PROTECTED]);
+        kv_value_cache_unlink(demoted);
+        kv_value_cache_link(demoted, KV_VALUE_PROBATION);
+    }
+}
+
+static bool kv_value_cache_enabled(void) {
+    return init && qatomic_read(&enabled);
+}
+
+bool kv_value_cache_read(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                         size_t key_len, size_t offset, const struct iovec *iov, int iov_count,
+                         ssize_t *res, size_t *total_object_size, uint64_t *gen) {
+    KvValueNode *node;
+    KvObjectId id;
+
+    *gen = 0;
+    if (!kv_value_cache_enabled() ||
+        !kv_object_id_init(&id, bus_number, namespace_id, key, key_len)) {
+        return false;
+    }
+    qemu_mutex_lock(&lock);
+    *gen = *kv_value_cache_generation(&id);
+    node = g_hash_table_lookup(nodes, &id);
+    if (!node) {
+        stats.misses++;
+        qemu_mutex_unlock(&lock);
+        return false;
+    }
+    stats.hits++;
+    kv_value_cache_touch_locked(node);
+    size_t len = offset < node->size ? MIN(iov_size(iov, iov_count), node->size - offset) : 0;
+    iov_from_buf(iov, iov_count, 0, node->data + offset, len);
+    *total_object_size = node->size;
+    *res = len;
+    qemu_mutex_unlock(&lock);
+    return true;
+}
+
+void kv_value_cache_fill(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                         size_t key_len, const struct iovec *iov, int iov_count, size_t size,
+                         uint64_t gen) {
+    KvObjectId id;
+
+    if (!kv_value_cache_enabled() ||
+        !kv_object_id_init(&id, bus_number, namespace_id, key, key_len)) {
+        return;
+    }
+    qemu_mutex_lock(&lock);
+    if (gen == *kv_value_cache_generation(&id) && !g_hash_table_contains(nodes, &id)) {
+        kv_value_cache_insert_locked(&id, iov, iov_count, size);
+    }
+    qemu_mutex_unlock(&lock);
+}
+
+uint64_t kv_value_cache_begin_update(uint32_t bus_number, uint32_t namespace_id,
+                                     const unsigned char *key, size_t key_len) {
+    uint64_t gen;
+    KvObjectId id;
+
+    if (!kv_value_cache_enabled() ||
+        !kv_object_id_init(&id, bus_number, namespace_id, key, key_len)) {
+        return 0;
+    }
+    qemu_mutex_lock(&lock);
+    gen = *kv_value_cache_generation(&id);
+    qemu_mutex_unlock(&lock);
+    return gen;
+}
+
+void kv_value_cache_end_update(uint32_t bus_number, uint32_t namespace_id,
+                               const unsigned char *key, size_t key_len,
+                               const struct iovec *value, int value_count, uint64_t gen) {
+    uint64_t *shard_gen;
+    KvValueNode *node;
+    KvObjectId id;
+
+    if (!kv_value_cache_enabled() ||
+        !kv_object_id_init(&id, bus_number, namespace_id, key, key_len)) {
+        return;
+    }
+    qemu_mutex_lock(&lock);
+    shard_gen = kv_value_cache_generation(&id);
+    if (value && gen == *shard_gen) {
+        kv_value_cache_insert_locked(&id, value, value_count, iov_size(value, value_count));
+    } else {
+        node = g_hash_table_lookup(nodes, &id);
+        if (node) {
+            kv_value_cache_remove_locked(node);
+        }
+    }
+    (*shard_gen)++;
+    qemu_mutex_unlock(&lock);
+}
+
+void kv_value_cache_get_stats(KvValueCacheStats *result) {
+    if (!init) {
+        memset(result, 0, sizeof(*result));
+        return;
+    }
+    qemu_mutex_lock(&lock);
+    *result = stats;
+    result->bytes = bytes[KV_VALUE_PROBATION] + bytes[KV_VALUE_PROTECTED];
+    qemu_mutex_unlock(&lock);
+}
+
+static uint64_t kv_value_cache_size_env(const char *name, uint64_t default_value) {
+    const char *env = getenv(name);
+    uint64_t size;
+
+    if (!env) {
+        return default_value;
+    }
+    if (qemu_strtosz(env, NULL, &size)) {
+        warn_report("%s: invalid size '%s'", name, env);
+        return default_value;
+    }
+    return size;
+}
+
+void kv_value_cache_reset(void) {
+    if (!init) {
+        init = true;
+        qemu_mutex_init(&lock);
+        nodes = g_hash_table_new(kv_object_id_hash, kv_object_id_equal);
+        for (int i = 0; i < KV_VALUE__MAX; i++) {
+            QTAILQ_INIT(&lists[i]);
+        }
+    }
+    qemu_mutex_lock(&lock);
+    for (int i = 0; i < KV_VALUE__MAX; i++) {
+        while (!QTAILQ_EMPTY(&lists[i])) {
+            kv_value_cache_remove_locked(QTAILQ_FIRST(&lists[i]));
+        }
+    }
+    for (int i = 0; i < KV_VALUE_CACHE_SHARDS; i++) {
+        generation[i]++;
+    }
+    budget = kv_value_cache_size_env("KV_VALUE_CACHE_SIZE", KV_VALUE_CACHE_SIZE);
+    qatomic_set(&enabled, budget != 0);
+    max_object = kv_value_cache_size_env("KV_VALUE_CACHE_MAX_OBJECT", KV_VALUE_CACHE_MAX_OBJECT);
+    qemu_mutex_unlock(&lock);
+}
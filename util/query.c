@@ -13,211 +13,1440 @@
 #include <unistd.h>
 #include "duckdb/duckdb.h"
 #include "qemu/kv_utils.h"
+#include "qemu/kv_store.h"
+#include "qemu/kv_shadow.h"
 #include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/memfd.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
 #include "qemu/job.h"
-#include <stdatomic.h>
 
-duckdb_database db;
-duckdb_connection* cons;
-bool* busy;
-int num_connections;
-QemuMutex connection_mutex;
+#define QUERY_PLAN_CACHE_SIZE 64
+/* keys listed at once when collecting the objects of a key prefix */
+#define QUERY_LIST_BATCH 1024
+/* bytes of a SELECT INTO result stored at once */
+#define QUERY_INTO_CHUNK (1 << 20)
 
-int query_init_db(int num_connection) {
-    num_connections = num_connection;
-    if (duckdb_open(NULL, &db) == DuckDBError) {
-        return KV_ERROR_DUCKDB;
+/* A prepared query. read_csv_auto and read_json_auto sniff the schema of
+ * the object when the statement is bound, so a plan is only reused while
+ * the object is unchanged.
+ */
+typedef struct QueryPlan {
+    char *key;
+    duckdb_prepared_statement statement;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    QTAILQ_ENTRY(QueryPlan) lru;
+} QueryPlan;
+
+/* a pooled connection, its plans are only used by the thread holding it */
+typedef struct QueryConnection {
+    duckdb_connection con;
+    GHashTable *plans;
+    /* most recently used first */
+    QTAILQ_HEAD(, QueryPlan) lru;
+    unsigned int num_plans;
+    /* the result fd is duplicated onto this fd number, so the statement
+     * text does not change between runs
+     */
+    int result_slot;
+    QTAILQ_ENTRY(QueryConnection) next;
+} QueryConnection;
+
+/* the queries of a namespace of a controller being run */
+typedef struct QueryNamespace {
+    /* bus number << 32 | namespace id */
+    uint64_t key;
+    unsigned int running;
+    QemuCond cond;
+} QueryNamespace;
+
+/* a thread waiting for a connection, waiters are served in arrival order */
+typedef struct QueryWaiter {
+    QemuCond cond;
+    QueryConnection *connection;
+    QSIMPLEQ_ENTRY(QueryWaiter) next;
+} QueryWaiter;
+
+static duckdb_database db;
+static QemuMutex pool_mutex;
+static QTAILQ_HEAD(, QueryConnection) idle_connections =
+    QTAILQ_HEAD_INITIALIZER(idle_connections);
+static QSIMPLEQ_HEAD(, QueryWaiter) waiters = QSIMPLEQ_HEAD_INITIALIZER(waiters);
+/* connections the pool should have, and has open */
+static unsigned int pool_size;
+static unsigned int num_open;
+static unsigned int num_busy;
+static QueryPoolStats pool_stats;
+static unsigned int plan_cache_size;
+/* the arrow extension is loaded into db */
+static bool arrow_loaded;
+static int null_fd = -1;
+static bool pool_init;
+/* KV_QUERY_TIMEOUT_MS, 0 for none */
+static uint64_t default_timeout;
+static GHashTable *namespace_timeouts;
+/* KV_QUERY_NAMESPACE_LIMIT, 0 for none */
+static uint64_t default_namespace_limit;
+static GHashTable *namespace_limits;
+/* QueryNamespace by its key, under pool_mutex */
+static GHashTable *namespaces;
+
+static void query_plan_free(QueryPlan *plan) {
+    duckdb_destroy_prepare(&plan->statement);
+    g_free(plan->key);
+    g_free(plan);
+}
+
+static void query_plan_remove(QueryConnection *connection, QueryPlan *plan) {
+    g_hash_table_remove(connection->plans, plan->key);
+    QTAILQ_REMOVE(&connection->lru, plan, lru);
+    connection->num_plans--;
+    query_plan_free(plan);
+}
+
+static bool query_plan_matches(QueryPlan *plan, const struct stat *st) {
+    return plan->dev == st->st_dev && plan->ino == st->st_ino && plan->size == st->st_size &&
+           plan->mtime.tv_sec == st->st_mtim.tv_sec &&
+           plan->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           plan->ctime.tv_sec == st->st_ctim.tv_sec &&
+           plan->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+static QueryConnection *query_connection_open(duckdb_database database) {
+    QueryConnection *connection = g_new0(QueryConnection, 1);
+
+    if (duckdb_connect(database, &connection->con) == DuckDBError) {
+        g_free(connection);
+        return NULL;
     }
-    cons = malloc(num_connection * sizeof(duckdb_connection));
-    if (!cons) {
-        return KV_ERROR_MEMORY_ALLOCATION;
+    connection->plans = g_hash_table_new(g_str_hash, g_str_equal);
+    QTAILQ_INIT(&connection->lru);
+    connection->result_slot = dup(null_fd);
+    if (connection->result_slot >= 0) {
+        qemu_set_cloexec(connection->result_slot);
     }
-    for (int i = 0; i < num_connection; ++i) {
-        if (duckdb_connect(db, &cons[i]) == DuckDBError) {
-            for (int j = 0; j < i; ++i) {
-                duckdb_disconnect(&cons[j]);
-            }
-            free(cons);
-            duckdb_close(&db);
-            return KV_ERROR_DUCKDB;
+    return connection;
+}
+
+static void query_connection_close(QueryConnection *connection) {
+    while (!QTAILQ_EMPTY(&connection->lru)) {
+        query_plan_remove(connection, QTAILQ_FIRST(&connection->lru));
+    }
+    g_hash_table_destroy(connection->plans);
+    if (connection->result_slot >= 0) {
+        close(connection->result_slot);
+    }
+    duckdb_disconnect(&connection->con);
+    g_free(connection);
+}
+
+/* called with pool_mutex held, hands the connection to the longest waiting
+ * thread or puts it back on the idle list
+ */
+static void query_connection_put_locked(QueryConnection *connection) {
+    QueryWaiter *waiter = QSIMPLEQ_FIRST(&waiters);
+
+    if (waiter) {
+        QSIMPLEQ_REMOVE_HEAD(&waiters, next);
+        waiter->connection = connection;
+        qemu_cond_signal(&waiter->cond);
+        return;
+    }
+    num_busy--;
+    QTAILQ_INSERT_HEAD(&idle_connections, connection, next);
+}
+
+/* parses the "<value>[,[<bus number>:]<namespace id>:<value>...]" setting
+ * name, a bare value applying to the namespaces not listed and a namespace
+ * without bus number to that namespace of every controller
+ */
+static void query_parse_namespace_setting(const char *name, uint64_t max,
+                                          uint64_t *default_value, GHashTable **values) {
+    const char *env = getenv(name);
+
+    *default_value = 0;
+    if (!*values) {
+        *values = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    }
+    g_hash_table_remove_all(*values);
+    if (!env) {
+        return;
+    }
+    gchar **entries = g_strsplit(env, ",", -1);
+    for (gchar **entry = entries; *entry; entry++) {
+        gchar **parts = g_strsplit(g_strstrip(*entry), ":", 3);
+        guint len = g_strv_length(parts);
+        guint64 bus_number, namespace_id, value;
+
+        if (len == 1 && g_ascii_string_to_unsigned(parts[0], 10, 0, max, &value, NULL)) {
+            *default_value = value;
+        } else if ((len == 2 || len == 3) &&
+                   g_ascii_string_to_unsigned(parts[len - 2], 10, 0, UINT32_MAX,
+                                              &namespace_id, NULL) &&
+                   g_ascii_string_to_unsigned(parts[len - 1], 10, 0, max, &value, NULL) &&
+                   (len == 2 || g_ascii_string_to_unsigned(parts[0], 10, 0, UINT32_MAX,
+                                                           &bus_number, NULL))) {
+            uint64_t *namespace_value = g_new(uint64_t, 1);
+            char *key = len == 2 ?
+                g_strdup_printf("%" PRIu64, namespace_id) :
+                g_strdup_printf("%" PRIu64 ":%" PRIu64, bus_number, namespace_id);
+
+            *namespace_value = value;
+            g_hash_table_replace(*values, key, namespace_value);
+        } else if (**entry) {
+            warn_report("%s: ignoring '%s'", name, *entry);
         }
+        g_strfreev(parts);
     }
-    busy = malloc(num_connection * sizeof(bool));
-    if (!busy) {
-        for (int i = 0; i < num_connection; ++i) {
-            duckdb_disconnect(&cons[i]);
+    g_strfreev(entries);
+}
+
+static uint64_t query_namespace_setting(GHashTable *values, uint64_t default_value,
+                                        uint32_t bus_number, uint32_t namespace_id) {
+    char key[24];
+    uint64_t *value = NULL;
+
+    if (values) {
+        snprintf(key, sizeof(key), "%" PRIu32 ":%" PRIu32, bus_number, namespace_id);
+        value = g_hash_table_lookup(values, key);
+        if (!value) {
+            snprintf(key, sizeof(key), "%" PRIu32, namespace_id);
+            value = g_hash_table_lookup(values, key);
         }
-        free(cons);
-        duckdb_close(&db);
-        return KV_ERROR_MEMORY_ALLOCATION;
     }
-    for (int i = 0; i < num_connection; ++i) {
-        busy[i] = false;
+    return value ? *value : default_value;
+}
+
+QueryCancel *query_cancel_new(uint32_t bus_number, uint32_t namespace_id) {
+    QueryCancel *cancel = g_new0(QueryCancel, 1);
+    uint64_t ms = query_namespace_setting(namespace_timeouts, default_timeout, bus_number,
+                                          namespace_id);
+
+    if (ms) {
+        cancel->deadline = g_get_monotonic_time() + ms * 1000;
+    }
+    return cancel;
+}
+
+void query_cancel(QueryCancel *cancel) {
+    qatomic_set(&cancel->cancelled, true);
+    if (!qatomic_read(&pool_init)) {
+        return;
+    }
+    /* the waiters check their token once woken, cancels are rare enough to
+     * wake them all
+     */
+    qemu_mutex_lock(&pool_mutex);
+    QueryWaiter *waiter;
+    QSIMPLEQ_FOREACH(waiter, &waiters, next) {
+        qemu_cond_signal(&waiter->cond);
+    }
+    GHashTableIter iter;
+    QueryNamespace *ns;
+    g_hash_table_iter_init(&iter, namespaces);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&ns)) {
+        qemu_cond_broadcast(&ns->cond);
+    }
+    qemu_mutex_unlock(&pool_mutex);
+}
+
+/* 0 while the query may go on */
+static int query_cancel_status(QueryCancel *cancel) {
+    if (!cancel) {
+        return 0;
+    }
+    if (qatomic_read(&cancel->cancelled) ||
+        (cancel->parent && qatomic_read(&cancel->parent->cancelled))) {
+        return KV_ERROR_QUERY_CANCELLED;
+    }
+    if (cancel->deadline && g_get_monotonic_time() >= cancel->deadline) {
+        return KV_ERROR_QUERY_TIMEOUT;
     }
-    qemu_mutex_init(&connection_mutex);
     return 0;
 }
 
+/* waits on cond with pool_mutex held until it is signalled or the deadline
+ * of cancel passes; query_cancel() signals it
+ */
+static void query_wait_locked(QemuCond *cond, QueryCancel *cancel) {
+    int64_t left;
+
+    if (!cancel || !cancel->deadline) {
+        qemu_cond_wait(cond, &pool_mutex);
+        return;
+    }
+    left = cancel->deadline - g_get_monotonic_time();
+    if (left > 0) {
+        qemu_cond_timedwait(cond, &pool_mutex, MIN((left + 999) / 1000, INT_MAX));
+    }
+}
+
+static void query_namespace_free(gpointer data) {
+    QueryNamespace *ns = data;
+
+    qemu_cond_destroy(&ns->cond);
+    g_free(ns);
+}
+
+/* waits until the namespace of the controller is below its
+ * KV_QUERY_NAMESPACE_LIMIT, or cancel is cancelled or expires; the returned
+ * slot is handed to query_leave_namespace()
+ */
+static int query_enter_namespace(uint32_t bus_number, uint32_t namespace_id,
+                                 QueryCancel *cancel, QueryNamespace **slot) {
+    uint64_t limit = query_namespace_setting(namespace_limits, default_namespace_limit,
+                                             bus_number, namespace_id);
+    uint64_t key = (uint64_t)bus_number << 32 | namespace_id;
+    int status = 0;
+
+    *slot = NULL;
+    if (!limit) {
+        return 0;
+    }
+    qemu_mutex_lock(&pool_mutex);
+    QueryNamespace *ns = g_hash_table_lookup(namespaces, &key);
+    if (!ns) {
+        ns = g_new0(QueryNamespace, 1);
+        ns->key = key;
+        qemu_cond_init(&ns->cond);
+        g_hash_table_insert(namespaces, &ns->key, ns);
+    }
+    if (ns->running >= limit) {
+        int64_t start = g_get_monotonic_time();
+
+        pool_stats.admission_waits++;
+        while (ns->running >= limit && !(status = query_cancel_status(cancel))) {
+            query_wait_locked(&ns->cond, cancel);
+        }
+        pool_stats.admission_wait_us += g_get_monotonic_time() - start;
+    }
+    if (!status) {
+        ns->running++;
+        *slot = ns;
+    } else if (ns->running < limit) {
+        /* the wakeup of query_leave_namespace() may have been for us */
+        qemu_cond_signal(&ns->cond);
+    }
+    qemu_mutex_unlock(&pool_mutex);
+    return status;
+}
+
+static void query_leave_namespace(QueryNamespace *ns) {
+    if (!ns) {
+        return;
+    }
+    qemu_mutex_lock(&pool_mutex);
+    ns->running--;
+    qemu_cond_signal(&ns->cond);
+    qemu_mutex_unlock(&pool_mutex);
+}
+
+/* opens the database with the KV_QUERY_THREADS, KV_QUERY_MEMORY_LIMIT and
+ * KV_QUERY_TEMP_DIR settings, which bound all queries together
+ */
+static int query_open_db(duckdb_database *database) {
+    static const struct {
+        const char *env;
+        const char *option;
+    } settings[] = {
+        { "KV_QUERY_THREADS", "threads" },
+        { "KV_QUERY_MEMORY_LIMIT", "memory_limit" },
+        { "KV_QUERY_TEMP_DIR", "temp_directory" },
+    };
+    duckdb_config config;
+    char *error = NULL;
+
+    if (duckdb_create_config(&config) == DuckDBError) {
+        return KV_ERROR_DUCKDB;
+    }
+    for (int i = 0; i < ARRAY_SIZE(settings); i++) {
+        const char *value = getenv(settings[i].env);
+
+        if (value && duckdb_set_config(config, settings[i].option, value) == DuckDBError) {
+            error_report("%s: invalid value '%s'", settings[i].env, value);
+            duckdb_destroy_config(&config);
+            return KV_ERROR_DUCKDB;
+        }
+    }
+    duckdb_state state = duckdb_open_ext(NULL, database, config, &error);
+    duckdb_destroy_config(&config);
+    if (state == DuckDBError) {
+        error_report("cannot open duckdb: %s", error ? error : "unknown error");
+        duckdb_free(error);
+        return KV_ERROR_DUCKDB;
+    }
+    return 0;
+}
+
+int query_init_db(int num_connection) {
+    int res = query_open_db(&db);
+    if (res) {
+        return res;
+    }
+    const char *cache_size_env = getenv("KV_QUERY_PLAN_CACHE_SIZE");
+    plan_cache_size = QUERY_PLAN_CACHE_SIZE;
+    if (cache_size_env) {
+        int size = atoi(cache_size_env);
+        plan_cache_size = size < 0 ? QUERY_PLAN_CACHE_SIZE : size;
+    }
+    query_parse_namespace_setting("KV_QUERY_TIMEOUT_MS", INT64_MAX / 1000, &default_timeout,
+                                  &namespace_timeouts);
+    query_parse_namespace_setting("KV_QUERY_NAMESPACE_LIMIT", UINT_MAX,
+                                  &default_namespace_limit, &namespace_limits);
+    namespaces = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL,
+                                       query_namespace_free);
+    null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    qemu_mutex_init(&pool_mutex);
+    memset(&pool_stats, 0, sizeof(pool_stats));
+    pool_size = 0;
+    arrow_loaded = false;
+    pool_init = true;
+    res = query_resize_pool(num_connection);
+    if (res) {
+        query_close_db();
+    }
+    return res;
+}
+
 void query_close_db(void) {
-    for (int i = 0; i < num_connections; ++i) {
-        duckdb_disconnect(&cons[i]);
+    QueryConnection *connection;
+
+    /* all queries are done, so every connection is idle */
+    assert(!num_busy);
+    while ((connection = QTAILQ_FIRST(&idle_connections))) {
+        QTAILQ_REMOVE(&idle_connections, connection, next);
+        query_connection_close(connection);
     }
-    free(cons);
-    free(busy);
-    qemu_mutex_destroy(&connection_mutex);
+    num_open = 0;
+    if (null_fd >= 0) {
+        close(null_fd);
+        null_fd = -1;
+    }
+    pool_init = false;
+    g_hash_table_destroy(namespaces);
+    namespaces = NULL;
+    qemu_mutex_destroy(&pool_mutex);
     duckdb_close(&db);
 }
 
-int
-run_query(uint32_t bus_number, uint32_t namespace_id, unsigned char *key, size_t key_length,
-          char *sql, size_t *output_len, Query_Data_Type input_format,
-          Query_Data_Type output_format, bool use_csv_headers_input,
-          bool use_csv_headers_output, unsigned char **result) {
-    // construct the command string
-    const char *path = get_path_str(bus_number, namespace_id, key, key_length, false);
-    if (!path) {
-        return KV_ERROR_FILE_PATH;
+int query_resize_pool(int num_connection) {
+    QueryConnection *connection;
+    int res = 0;
+
+    if (!pool_init || num_connection <= 0) {
+        return KV_ERROR_INVALID_PARAMETER;
+    }
+    qemu_mutex_lock(&pool_mutex);
+    pool_size = num_connection;
+    while (num_open < pool_size) {
+        connection = query_connection_open(db);
+        if (!connection) {
+            res = KV_ERROR_DUCKDB;
+            break;
+        }
+        num_open++;
+        num_busy++;
+        query_connection_put_locked(connection);
+    }
+    /* busy connections beyond the size are closed when they are released */
+    while (num_open > pool_size && (connection = QTAILQ_LAST(&idle_connections))) {
+        QTAILQ_REMOVE(&idle_connections, connection, next);
+        num_open--;
+        query_connection_close(connection);
+    }
+    qemu_mutex_unlock(&pool_mutex);
+    return res;
+}
+
+void query_get_pool_stats(QueryPoolStats *stats) {
+    if (!pool_init) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    qemu_mutex_lock(&pool_mutex);
+    *stats = pool_stats;
+    stats->size = pool_size;
+    stats->open = num_open;
+    stats->busy = num_busy;
+    QueryWaiter *waiter;
+    QSIMPLEQ_FOREACH(waiter, &waiters, next) {
+        stats->waiting++;
+    }
+    qemu_mutex_unlock(&pool_mutex);
+}
+
+/* takes a connection, preferring an idle one which has prepared key before,
+ * and blocks in arrival order while all of them are busy, until cancel is
+ * cancelled or expires
+ */
+static int query_acquire_connection(const char *key, QueryCancel *cancel,
+                                    QueryConnection **acquired) {
+    QueryConnection *connection;
+    int status = 0;
+
+    qemu_mutex_lock(&pool_mutex);
+    pool_stats.acquisitions++;
+    QTAILQ_FOREACH(connection, &idle_connections, next) {
+        if (g_hash_table_contains(connection->plans, key)) {
+            break;
+        }
+    }
+    if (!connection) {
+        connection = QTAILQ_FIRST(&idle_connections);
+    }
+    /* queued waiters go first, even if a connection is idle */
+    if (connection && QSIMPLEQ_EMPTY(&waiters)) {
+        QTAILQ_REMOVE(&idle_connections, connection, next);
+        num_busy++;
+        qemu_mutex_unlock(&pool_mutex);
+        *acquired = connection;
+        return 0;
     }
-    size_t path_len = strlen(path);
-    char *end = strcasestr(sql, "from");
+
+    QueryWaiter waiter = { .connection = NULL };
+    int64_t start = g_get_monotonic_time();
+    qemu_cond_init(&waiter.cond);
+    QSIMPLEQ_INSERT_TAIL(&waiters, &waiter, next);
+    while (!waiter.connection && !(status = query_cancel_status(cancel))) {
+        query_wait_locked(&waiter.cond, cancel);
+    }
+    if (!waiter.connection) {
+        QSIMPLEQ_REMOVE(&waiters, &waiter, QueryWaiter, next);
+    }
+    qemu_cond_destroy(&waiter.cond);
+    uint64_t waited = g_get_monotonic_time() - start;
+    pool_stats.waits++;
+    pool_stats.wait_us += waited;
+    pool_stats.max_wait_us = MAX(pool_stats.max_wait_us, waited);
+    qemu_mutex_unlock(&pool_mutex);
+    *acquired = waiter.connection;
+    return status;
+}
+
+static void query_release_connection(QueryConnection *connection) {
+    qemu_mutex_lock(&pool_mutex);
+    if (num_open > pool_size) {
+        num_open--;
+        num_busy--;
+        qemu_mutex_unlock(&pool_mutex);
+        query_connection_close(connection);
+        return;
+    }
+    query_connection_put_locked(connection);
+    qemu_mutex_unlock(&pool_mutex);
+}
+
+/* collapses whitespace and line comments outside of quotes and drops a
+ * trailing ';', so queries that only differ in layout share a plan. The
+ * result keys plans and is checked, but the query text itself is run.
+ */
+static char *query_normalize_sql(const char *sql) {
+    char *normalized = g_malloc(strlen(sql) + 1);
+    char quote = 0;
+    size_t len = 0;
+
+    for (const char *p = sql; *p; p++) {
+        if (quote) {
+            if (*p == quote) {
+                quote = 0;
+            }
+        } else if (*p == '\'' || *p == '"') {
+            quote = *p;
+        } else if (p[0] == '-' && p[1] == '-') {
+            /* the comment ends with its line, which is layout */
+            p += strcspn(p, "\n");
+            if (!*p) {
+                break;
+            }
+            if (len && normalized[len - 1] != ' ') {
+                normalized[len++] = ' ';
+            }
+            continue;
+        } else if (g_ascii_isspace(*p)) {
+            if (len && normalized[len - 1] != ' ') {
+                normalized[len++] = ' ';
+            }
+            continue;
+        }
+        normalized[len++] = *p;
+    }
+    while (len && (normalized[len - 1] == ' ' || normalized[len - 1] == ';')) {
+        len--;
+    }
+    normalized[len] = '\0';
+    return normalized;
+}
+
+/* appends s as a duckdb string literal */
+static void query_append_literal(GString *command, const char *s) {
+    g_string_append_c(command, '\'');
+    for (; *s; s++) {
+        if (*s == '\'') {
+            g_string_append_c(command, '\'');
+        }
+        g_string_append_c(command, *s);
+    }
+    g_string_append_c(command, '\'');
+}
+
+/* returns the first from keyword of sql outside of quotes and line
+ * comments, or NULL
+ */
+static const char *query_find_from(const char *sql) {
+    char quote = 0;
+
+    for (const char *p = sql; *p; p++) {
+        if (quote) {
+            if (*p == quote) {
+                quote = 0;
+            }
+        } else if (*p == '\'' || *p == '"') {
+            quote = *p;
+        } else if (p[0] == '-' && p[1] == '-') {
+            p += strcspn(p, "\n");
+            if (!*p) {
+                break;
+            }
+        } else if (!g_ascii_strncasecmp(p, "from", 4)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* builds the duckdb command copying the result of sql over the objects at
+ * paths, scanned as one table, into the file at result_path; NULL if sql
+ * has no from clause. Arrow input reads the buffers of query_map_arrow()
+ * instead of paths, and an Arrow result is returned as rows of blobs.
+ */
+static char *
+query_build_command(const char *sql, const char *const *paths, size_t num_paths,
+                    Query_Data_Type input_format, const char *input_compression,
+                    Query_Data_Type output_format,
+                    bool use_csv_headers_input, bool use_csv_headers_output,
+                    const char *result_path) {
+    // construct the command string
+    const char *end = query_find_from(sql);
     if (!end) {
-         return KV_ERROR_INVALID_PARAMETER;
+         return NULL;
     }
     size_t sql_first_part_len = end - sql + 5;
     size_t total_sql_len = strlen(sql);
+    if (sql_first_part_len > total_sql_len) {
+        return NULL;
+    }
 
     // remove the ';' at the end
-    if (sql[total_sql_len - 1] == ';') {
+    while (total_sql_len > sql_first_part_len &&
+           (g_ascii_isspace(sql[total_sql_len - 1]) || sql[total_sql_len - 1] == ';')) {
         --total_sql_len;
     }
 
     // find the position of the start of sql clause
     size_t sql_second_part_pos = sql_first_part_len;
-    while (sql_second_part_pos < total_sql_len && sql[sql_second_part_pos] != ' ') {
+    while (sql_second_part_pos < total_sql_len && g_ascii_isspace(sql[sql_second_part_pos])) {
         ++sql_second_part_pos;
     }
-
-    char command[6 + sql_first_part_len + 16 + path_len + 84 + total_sql_len - sql_second_part_pos];
-    size_t pos = 0;
-    strcpy(command, "copy (");
-    pos += 6;
-    strncpy(command + pos, sql, sql_first_part_len);
-    pos += sql_first_part_len;
-    switch (input_format) {
-        case QUERY_TYPE_JSON:
-            strcpy(command + pos, "read_json_auto('");
-            pos += 16;
-            break;
-        case QUERY_TYPE_CSV:
-            strcpy(command + pos, "read_csv_auto('");
-            pos += 15;
-            break;
-        case QUERY_TYPE_PARQUET:
-            strcpy(command + pos, "read_parquet('");
-            pos += 14;
-            break;
+    while (sql_second_part_pos < total_sql_len && !g_ascii_isspace(sql[sql_second_part_pos])) {
+        ++sql_second_part_pos;
     }
 
-    strcpy(command + pos, path);
-    pos += path_len;
-    free((void*)path);
+    GString *command = g_string_new(output_format == QUERY_TYPE_ARROW ?
+                                    "select ipc from to_arrow_ipc((" : "copy (");
+    g_string_append_len(command, sql, sql_first_part_len);
+    if (input_format == QUERY_TYPE_ARROW) {
+        // every object is a stream with its own schema
+        g_string_append_c(command, '(');
+        for (size_t i = 0; i < num_paths; i++) {
+            if (i) {
+                g_string_append(command, " union all by name ");
+            }
+            g_string_append_printf(command, "select * from scan_arrow_ipc([%s])", paths[i]);
+        }
+        g_string_append_c(command, ')');
+    } else {
+        switch (input_format) {
+            case QUERY_TYPE_JSON:
+                g_string_append(command, "read_json_auto(");
+                break;
+            case QUERY_TYPE_CSV:
+                g_string_append(command, "read_csv_auto(");
+                break;
+            case QUERY_TYPE_PARQUET:
+            case QUERY_TYPE_ARROW:
+                g_string_append(command, "read_parquet(");
+                break;
+        }
 
-    command[pos++] = '\'';
-    if (input_format == QUERY_TYPE_CSV) {
-        if (use_csv_headers_input) {
-            strcpy(command + pos, ", HEADER=TRUE");
-            pos += 13;
-        } else {
-            strcpy(command + pos, ", HEADER=FALSE");
-            pos += 14;
+        if (num_paths > 1) {
+            g_string_append_c(command, '[');
+        }
+        for (size_t i = 0; i < num_paths; i++) {
+            if (i) {
+                g_string_append(command, ", ");
+            }
+            query_append_literal(command, paths[i]);
         }
+        if (num_paths > 1) {
+            g_string_append_c(command, ']');
+        }
+        if (input_format == QUERY_TYPE_CSV) {
+            if (use_csv_headers_input) {
+                g_string_append(command, ", HEADER=TRUE");
+            } else {
+                g_string_append(command, ", HEADER=FALSE");
+            }
+        }
+        if (input_compression) {
+            g_string_append_printf(command, ", COMPRESSION='%s'", input_compression);
+        }
+        g_string_append_c(command, ')');
     }
-    command[pos++] = ')';
-    strcpy(command + pos, sql + sql_second_part_pos);
-    pos += total_sql_len - sql_second_part_pos;
+    g_string_append_len(command, sql + sql_second_part_pos,
+                        total_sql_len - sql_second_part_pos);
+    // a line comment at the end must not swallow the rest of the command
+    g_string_append_c(command, '\n');
 
-    strcpy(command + pos, ") to '");
-    pos += 6;
+    if (output_format == QUERY_TYPE_ARROW) {
+        g_string_append(command, "))");
+        return g_string_free(command, false);
+    }
+    g_string_append(command, ") to ");
+    query_append_literal(command, result_path);
 
-    char result_path[32 + 8 + 1];
-    size_t result_path_pos = 0;
-    // use a counter to avoid file name conflicts of result files
-    static atomic_uint counter = ATOMIC_VAR_INIT(0);
-    result_path_pos += sprintf(result_path + result_path_pos, "%u", atomic_fetch_add(&counter, 1));
+    // the format cannot be inferred from the file name
     switch (output_format) {
         case QUERY_TYPE_JSON:
-            strcpy(result_path + result_path_pos, ".json");
-            result_path_pos += 5;
+            g_string_append(command, " ( format json )");
             break;
         case QUERY_TYPE_CSV:
-            strcpy(result_path + result_path_pos, ".csv");
-            result_path_pos += 4;
+            if (use_csv_headers_output) {
+                g_string_append(command, " ( format csv, header )");
+            } else {
+                g_string_append(command, " ( format csv )");
+            }
             break;
         case QUERY_TYPE_PARQUET:
-            strcpy(result_path + result_path_pos, ".parquet");
-            result_path_pos += 8;
+        case QUERY_TYPE_ARROW:
+            g_string_append(command, " ( format parquet )");
             break;
     }
-    strcpy(command + pos, result_path);
-    pos += result_path_pos;
-    command[pos++] = '\'';
+    return g_string_free(command, false);
+}
+
+/* writes the stream to_arrow_ipc() returns a message per row of */
+static duckdb_state query_write_blobs(duckdb_result *result, int fd) {
+    idx_t num_rows = duckdb_row_count(result);
 
-    if (output_format == QUERY_TYPE_CSV && use_csv_headers_output) {
-        strcpy(command + pos, " ( header )");
-        pos += 11;
-    } else if (output_format == QUERY_TYPE_PARQUET) {
-        strcpy(command + pos, " ( format parquet )");
-        pos += 19;
+    for (idx_t row = 0; row < num_rows; row++) {
+        duckdb_blob blob = duckdb_value_blob(result, 0, row);
+        struct iovec iov = { .iov_base = blob.data, .iov_len = blob.size };
+        int status = kv_writev_full(fd, &iov, 1, -1);
+        duckdb_free(blob.data);
+        if (status) {
+            return DuckDBError;
+        }
     }
-    command[pos] = '\0';
+    return DuckDBSuccess;
+}
 
-    int con_id = -1;
-    do {
-        qemu_mutex_lock(&connection_mutex);
-        for (int i = 0; i < num_connections; ++i) {
-            if (!busy[i]) {
-                busy[i] = true;
-                con_id = i;
+/* executes the statement a task at a time, which lets cancel stop it in
+ * between; destroying the pending result interrupts the query. The result
+ * is written to blob_fd unless it is negative, otherwise the number of rows
+ * copied is returned in *rows.
+ */
+static duckdb_state
+query_execute_statement(duckdb_prepared_statement statement, QueryCancel *cancel,
+                        int blob_fd, uint64_t *rows) {
+    duckdb_pending_result pending;
+    duckdb_pending_state pending_state = DUCKDB_PENDING_RESULT_NOT_READY;
+    duckdb_result result;
+    duckdb_state state = DuckDBError;
+
+    memset(&result, 0, sizeof(result));
+    if (!cancel) {
+        state = duckdb_execute_prepared(statement, &result);
+    } else if (duckdb_pending_prepared(statement, &pending) == DuckDBError) {
+        duckdb_destroy_pending(&pending);
+        return DuckDBError;
+    } else {
+        while (pending_state == DUCKDB_PENDING_RESULT_NOT_READY &&
+               !query_cancel_status(cancel)) {
+            pending_state = duckdb_pending_execute_task(pending);
+        }
+        if (pending_state == DUCKDB_PENDING_RESULT_READY) {
+            state = duckdb_execute_pending(pending, &result);
+        }
+        duckdb_destroy_pending(&pending);
+    }
+    if (state == DuckDBSuccess && blob_fd >= 0) {
+        state = query_write_blobs(&result, blob_fd);
+    } else if (state == DuckDBSuccess) {
+        /* copy returns the row count */
+        *rows = duckdb_value_uint64(&result, 0, 0);
+    }
+    duckdb_destroy_result(&result);
+    return state;
+}
+
+/* runs the query on the connection, preparing it unless the cache holds a
+ * plan for the same object; st is NULL when the plan cannot be kept
+ */
+static duckdb_state
+query_execute(QueryConnection *connection, const char *key, const char *sql,
+              const char *const *paths, size_t num_paths, const struct stat *st,
+              Query_Data_Type input_format, const char *input_compression,
+              Query_Data_Type output_format, bool use_csv_headers_input,
+              bool use_csv_headers_output, QueryCancel *cancel, uint64_t *rows) {
+    QueryPlan *plan = g_hash_table_lookup(connection->plans, key);
+    /* an Arrow result is not written by duckdb but from its rows */
+    int blob_fd = output_format == QUERY_TYPE_ARROW ? connection->result_slot : -1;
+    duckdb_prepared_statement statement;
+    duckdb_state state;
+
+    if (plan && (!st || !query_plan_matches(plan, st))) {
+        query_plan_remove(connection, plan);
+        plan = NULL;
+    }
+    if (plan) {
+        QTAILQ_REMOVE(&connection->lru, plan, lru);
+        QTAILQ_INSERT_HEAD(&connection->lru, plan, lru);
+        state = query_execute_statement(plan->statement, cancel, blob_fd, rows);
+        if (state == DuckDBError) {
+            query_plan_remove(connection, plan);
+        }
+        return state;
+    }
+
+    /* duckdb reopens the result slot through /dev/fd */
+    g_autofree char *result_path = g_strdup_printf("/dev/fd/%d", connection->result_slot);
+    char *command = query_build_command(sql, paths, num_paths, input_format,
+                                        input_compression, output_format,
+                                        use_csv_headers_input, use_csv_headers_output,
+                                        result_path);
+    if (!command) {
+        return DuckDBError;
+    }
+    state = duckdb_prepare(connection->con, command, &statement);
+    g_free(command);
+    if (state == DuckDBError) {
+        duckdb_destroy_prepare(&statement);
+        return state;
+    }
+    state = query_execute_statement(statement, cancel, blob_fd, rows);
+    if (state == DuckDBError || !st) {
+        duckdb_destroy_prepare(&statement);
+        return state;
+    }
+
+    plan = g_new0(QueryPlan, 1);
+    plan->key = g_strdup(key);
+    plan->statement = statement;
+    plan->dev = st->st_dev;
+    plan->ino = st->st_ino;
+    plan->size = st->st_size;
+    plan->mtime = st->st_mtim;
+    plan->ctime = st->st_ctim;
+    g_hash_table_insert(connection->plans, plan->key, plan);
+    QTAILQ_INSERT_HEAD(&connection->lru, plan, lru);
+    if (++connection->num_plans > plan_cache_size) {
+        query_plan_remove(connection, QTAILQ_LAST(&connection->lru));
+    }
+    return state;
+}
+
+/* the host files a query reads, see query_collect_objects() */
+typedef struct QueryObjects {
+    /* released with free() */
+    GPtrArray *paths;
+    /* the paths which are copies to remove */
+    GPtrArray *temp_paths;
+    GPtrArray *shadows;
+    /* read ends of the pipes the paths of streamed objects refer to */
+    GArray *streams;
+    /* of each path, a static string or NULL */
+    GPtrArray *compressions;
+} QueryObjects;
+
+static void query_objects_init(QueryObjects *objects) {
+    objects->paths = g_ptr_array_new_with_free_func(free);
+    objects->temp_paths = g_ptr_array_new();
+    objects->shadows = g_ptr_array_new_with_free_func(g_free);
+    objects->streams = g_array_new(false, false, sizeof(int));
+    objects->compressions = g_ptr_array_new();
+}
+
+/* closes the streams, removes the copies and frees the lists */
+static void query_free_objects(QueryObjects *objects) {
+    for (guint i = 0; i < objects->streams->len; i++) {
+        close(g_array_index(objects->streams, int, i));
+    }
+    for (guint i = 0; i < objects->temp_paths->len; i++) {
+        remove(objects->temp_paths->pdata[i]);
+    }
+    g_array_free(objects->streams, true);
+    g_ptr_array_free(objects->compressions, true);
+    g_ptr_array_free(objects->temp_paths, true);
+    g_ptr_array_free(objects->shadows, true);
+    g_ptr_array_free(objects->paths, true);
+}
+
+/* returns the compression of a text object from its magic bytes, or NULL;
+ * duckdb would only infer it from a .gz or .zst file name
+ */
+static const char *query_detect_compression(uint32_t bus_number, uint32_t namespace_id,
+                                            const unsigned char *key, size_t key_length) {
+    static const unsigned char gzip_magic[] = { 0x1f, 0x8b };
+    static const unsigned char zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+    unsigned char magic[4];
+    size_t total_object_size;
+    ssize_t len = read_object(bus_number, namespace_id, (unsigned char *)key, key_length, 0,
+                              magic, sizeof(magic), &total_object_size);
+
+    if (len >= (ssize_t)sizeof(gzip_magic) && !memcmp(magic, gzip_magic, sizeof(gzip_magic))) {
+        return "gzip";
+    }
+    if (len >= (ssize_t)sizeof(zstd_magic) && !memcmp(magic, zstd_magic, sizeof(zstd_magic))) {
+        return "zstd";
+    }
+    return NULL;
+}
+
+/* adds the host file of the object to objects; a text object of a backend
+ * without a file per object is streamed through a pipe, which duckdb reads
+ * once, rather than copied.  Its shadow is added while every object so far
+ * had one
+ */
+static int
+query_add_object(uint32_t bus_number, uint32_t namespace_id, const unsigned char *key,
+                 size_t key_length, Query_Data_Type input_format, bool use_csv_headers_input,
+                 QueryObjects *objects) {
+    bool text = input_format == QUERY_TYPE_CSV || input_format == QUERY_TYPE_JSON;
+    int stream = text ? kv_store_object_stream(bus_number, namespace_id, key, key_length) : -1;
+    bool path_is_temp = false;
+    char *path;
+
+    if (stream >= 0) {
+        char stream_path[32];
+        snprintf(stream_path, sizeof(stream_path), "/dev/fd/%d", stream);
+        g_array_append_val(objects->streams, stream);
+        path = strdup(stream_path);
+    } else {
+        /* the backend has files, or is out of pipes */
+        path = kv_store_object_path(bus_number, namespace_id, key, key_length, &path_is_temp);
+    }
+    if (!path) {
+        return KV_ERROR_FILE_PATH;
+    }
+    if (path_is_temp) {
+        g_ptr_array_add(objects->temp_paths, path);
+    } else if (stream < 0 && input_format != QUERY_TYPE_PARQUET &&
+               objects->shadows->len == objects->paths->len) {
+        /* a Parquet shadow of a text object is scanned instead of parsing it */
+        char *shadow = kv_shadow_lookup(bus_number, namespace_id, key, key_length, path,
+                                        input_format, use_csv_headers_input);
+        if (shadow) {
+            g_ptr_array_add(objects->shadows, shadow);
+        }
+    }
+    g_ptr_array_add(objects->paths, path);
+    g_ptr_array_add(objects->compressions,
+                    text ? (gpointer)query_detect_compression(bus_number, namespace_id, key,
+                                                              key_length) : NULL);
+    return 0;
+}
+
+/* collects the files of the object at key or, with key_prefix, of every
+ * object whose key starts with key, in key order
+ */
+static int
+query_collect_objects(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                      size_t key_length, bool key_prefix, Query_Data_Type input_format,
+                      bool use_csv_headers_input, QueryObjects *objects) {
+    size_t offset = 0;
+
+    if (!key_prefix) {
+        return query_add_object(bus_number, namespace_id, key, key_length, input_format,
+                                use_csv_headers_input, objects);
+    }
+    while (1) {
+        ObjectKey *list = NULL;
+        size_t num_objects = 0;
+        size_t i;
+        int status = list_objects(bus_number, namespace_id, key, key_length, offset,
+                                  QUERY_LIST_BATCH, &num_objects, &list);
+        if (status) {
+            return status;
+        }
+        /* the listing starts at the prefix, the matches are contiguous */
+        for (i = 0; i < num_objects && !status; i++) {
+            if (list[i].key_len < key_length || memcmp(list[i].key, key, key_length)) {
                 break;
             }
+            status = query_add_object(bus_number, namespace_id, list[i].key, list[i].key_len,
+                                      input_format, use_csv_headers_input, objects);
+        }
+        free(list);
+        if (status) {
+            return status;
         }
-        qemu_mutex_unlock(&connection_mutex);
-        if (con_id == -1) {
-            usleep(100000);
+        if (i < num_objects || num_objects < QUERY_LIST_BATCH) {
+            break;
         }
-    } while (con_id == -1);
-    duckdb_state state = duckdb_query(cons[con_id], command, NULL);
-    qemu_mutex_lock(&connection_mutex);
-    busy[con_id] = false;
-    qemu_mutex_unlock(&connection_mutex);
+        offset += num_objects;
+    }
+    return objects->paths->len ? 0 : KV_ERROR_FILE_NOT_FOUND;
+}
+
+
+/* maps the Arrow IPC stream at path for scan_arrow_ipc(), which only reads
+ * from memory; returns the buffer to scan, or NULL
+ */
+static char *query_map_arrow(const char *path, GArray *mappings) {
+    struct iovec mapping;
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) || !st.st_size) {
+        close(fd);
+        return NULL;
+    }
+    mapping.iov_base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    mapping.iov_len = st.st_size;
+    close(fd);
+    if (mapping.iov_base == MAP_FAILED) {
+        return NULL;
+    }
+    g_array_append_val(mappings, mapping);
+    return g_strdup_printf("{'ptr': %" PRIuPTR "::UBIGINT, 'size': %zu::UBIGINT}",
+                           (uintptr_t)mapping.iov_base, mapping.iov_len);
+}
+
+/* unmaps the streams of query_map_arrow() and frees their buffers */
+static void query_unmap_arrow(GArray *mappings, GPtrArray *buffers) {
+    for (guint i = 0; i < mappings->len; i++) {
+        struct iovec *mapping = &g_array_index(mappings, struct iovec, i);
+        munmap(mapping->iov_base, mapping->iov_len);
+    }
+    g_array_free(mappings, true);
+    g_ptr_array_free(buffers, true);
+}
+
+/* Arrow IPC is read and written by the arrow extension of duckdb, which has
+ * to be installed beforehand. It is loaded into the pooled database on first
+ * use; its table functions take memory addresses, so query_check_functions()
+ * keeps them out of the query text.
+ */
+static bool query_load_arrow(QueryConnection *connection) {
+    if (!qatomic_read(&arrow_loaded)) {
+        if (duckdb_query(connection->con, "load arrow", NULL) == DuckDBError) {
+            warn_report_once("the duckdb arrow extension cannot be loaded");
+            return false;
+        }
+        qatomic_set(&arrow_loaded, true);
+    }
+    return true;
+}
+
+/* rejects queries naming table functions which read the memory at an
+ * address they are given: arrow_scan of duckdb, and scan_arrow_ipc and
+ * to_arrow_ipc of the arrow extension. Identifiers with unicode escapes
+ * could spell them, so those are rejected too. The check runs on the text
+ * as written, comments included, since duckdb may not read a comment
+ * where we would.
+ */
+static bool query_check_functions(const char *sql) {
+    static const char *const unsafe[] = { "arrow_scan", "arrow_ipc", "u&\"" };
+
+    for (int i = 0; i < ARRAY_SIZE(unsafe); i++) {
+        if (strcasestr(sql, unsafe[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* runs the query with duckdb copying the result into result_fd; the number
+ * of rows is returned in *rows, UINT64_MAX for an Arrow result
+ */
+static int
+query_copy_to_fd(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                 size_t key_length, bool key_prefix, char *sql,
+                 Query_Data_Type input_format, Query_Data_Type output_format,
+                 bool use_csv_headers_input, bool use_csv_headers_output,
+                 QueryCancel *cancel, int result_fd, uint64_t *rows) {
+    /* query_init_db() failed, e.g. on a bad KV_QUERY_* setting */
+    if (!pool_init) {
+        return KV_ERROR_DUCKDB;
+    }
+    char *normalized = query_normalize_sql(sql);
+    if (!strcasestr(normalized, "from") || !query_check_functions(sql)) {
+        g_free(normalized);
+        return KV_ERROR_INVALID_PARAMETER;
+    }
+    bool arrow = input_format == QUERY_TYPE_ARROW || output_format == QUERY_TYPE_ARROW;
+    QueryObjects objects;
+    query_objects_init(&objects);
+    int status = query_collect_objects(bus_number, namespace_id, key, key_length, key_prefix,
+                                       input_format, use_csv_headers_input, &objects);
+    if (status) {
+        query_free_objects(&objects);
+        g_free(normalized);
+        return status;
+    }
+    /* the objects are only read from their shadows if they all have one */
+    GPtrArray *sources = objects.paths;
+    if (objects.shadows->len == objects.paths->len) {
+        sources = objects.shadows;
+        input_format = QUERY_TYPE_PARQUET;
+    }
+    /* the objects of a prefix are read with one compression setting */
+    const char *compression = NULL;
+    if (input_format == QUERY_TYPE_CSV || input_format == QUERY_TYPE_JSON) {
+        compression = objects.compressions->pdata[0];
+        for (guint i = 1; i < objects.compressions->len; i++) {
+            if (g_strcmp0(objects.compressions->pdata[i], compression)) {
+                query_free_objects(&objects);
+                g_free(normalized);
+                return KV_ERROR_INVALID_PARAMETER;
+            }
+        }
+    }
+    /* Arrow objects are scanned from mappings, whose address is in the plan */
+    GArray *mappings = g_array_new(false, false, sizeof(struct iovec));
+    GPtrArray *buffers = g_ptr_array_new_with_free_func(g_free);
+    if (input_format == QUERY_TYPE_ARROW) {
+        for (guint i = 0; i < objects.paths->len; i++) {
+            char *buffer = query_map_arrow(objects.paths->pdata[i], mappings);
+            if (!buffer) {
+                query_unmap_arrow(mappings, buffers);
+                query_free_objects(&objects);
+                g_free(normalized);
+                return KV_ERROR_FILE_READ;
+            }
+            g_ptr_array_add(buffers, buffer);
+        }
+        sources = buffers;
+    }
+    /* an object changed within the timestamp granularity may keep its
+     * signature, so plans are only kept for objects not modified lately
+     */
+    struct stat st;
+    bool cacheable = !key_prefix && !objects.temp_paths->len && !objects.streams->len &&
+                     plan_cache_size && !arrow &&
+                     !stat(sources->pdata[0], &st) && st.st_ctim.tv_sec < time(NULL) - 1;
+    char *plan_key = g_strdup_printf("%d %s %d %d %d %s%s %s", input_format,
+                                     compression ? compression : "none", output_format,
+                                     use_csv_headers_input, use_csv_headers_output,
+                                     (char *)sources->pdata[0], key_prefix ? "*" : "",
+                                     normalized);
+
+    QueryNamespace *slot;
+    status = query_enter_namespace(bus_number, namespace_id, cancel, &slot);
+    if (status) {
+        query_unmap_arrow(mappings, buffers);
+        query_free_objects(&objects);
+        g_free(plan_key);
+        g_free(normalized);
+        return status;
+    }
+    QueryConnection *connection;
+    status = query_acquire_connection(plan_key, cancel, &connection);
+    duckdb_state state = DuckDBError;
+    *rows = UINT64_MAX;
+    if (!status && connection->result_slot >= 0 &&
+        (!arrow || query_load_arrow(connection)) &&
+        dup2(result_fd, connection->result_slot) >= 0) {
+        int result_slot = connection->result_slot;
+
+        qemu_set_cloexec(result_slot);
+        state = query_execute(connection, plan_key, sql,
+                              (const char *const *)sources->pdata, sources->len,
+                              cacheable ? &st : NULL, input_format, compression,
+                              output_format, use_csv_headers_input, use_csv_headers_output,
+                              cancel, rows);
+        /* the slot must not keep the write end of a stream open */
+        dup2(null_fd, result_slot);
+        qemu_set_cloexec(result_slot);
+    }
+    if (!status) {
+        query_release_connection(connection);
+    }
+    query_leave_namespace(slot);
+
+    query_unmap_arrow(mappings, buffers);
+    query_free_objects(&objects);
+    g_free(plan_key);
+    g_free(normalized);
     if (state == DuckDBError) {
-        return KV_ERROR_QUERY;
+        status = query_cancel_status(cancel);
+        return status ? status : KV_ERROR_QUERY;
     }
+    return 0;
+}
+
+int
+query_transcode_to_parquet(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                           size_t key_length, QueryCancel *cancel) {
+    Query_Data_Type input_format;
+    bool use_csv_headers;
 
-    FILE *file;
-    file = fopen(result_path, "r");
-    if (file == NULL) {
+    if (!pool_init) {
+        return KV_ERROR_DUCKDB;
+    }
+    if (!kv_shadow_policy(namespace_id, &input_format, &use_csv_headers)) {
+        return KV_ERROR_INVALID_PARAMETER;
+    }
+    /* taken first, an update from here on discards the conversion */
+    uint64_t generation = kv_shadow_begin(bus_number, namespace_id, key, key_length);
+    g_autofree char *shadow = kv_shadow_path(bus_number, namespace_id, key, key_length, true);
+    if (!shadow) {
+        return KV_ERROR_FILE_PATH;
+    }
+    g_autofree char *tmp_path = g_strdup_printf("%s.XXXXXX", shadow);
+    int fd = g_mkstemp_full(tmp_path, O_RDWR | O_CLOEXEC, 0644);
+    if (fd < 0) {
         return KV_ERROR_CANNOT_OPEN;
     }
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    rewind(file);
-    unsigned char *buffer = malloc(file_size);
+    close(fd);
+    /* the shadow found along is the one being replaced */
+    QueryObjects objects;
+    query_objects_init(&objects);
+    int status = query_add_object(bus_number, namespace_id, key, key_length, input_format,
+                                  use_csv_headers, &objects);
+    if (status) {
+        query_free_objects(&objects);
+        unlink(tmp_path);
+        return status;
+    }
+    char *command = query_build_command("select * from s3object",
+                                        (const char *const *)objects.paths->pdata, 1,
+                                        input_format, objects.compressions->pdata[0],
+                                        QUERY_TYPE_PARQUET, use_csv_headers, false, tmp_path);
+
+    /* conversions are not worth a plan */
+    QueryNamespace *slot;
+    duckdb_state state = DuckDBError;
+    if (!query_enter_namespace(bus_number, namespace_id, cancel, &slot)) {
+        QueryConnection *connection;
+        duckdb_prepared_statement statement;
+        uint64_t rows;
+
+        if (!query_acquire_connection("", cancel, &connection)) {
+            if (duckdb_prepare(connection->con, command, &statement) != DuckDBError) {
+                state = query_execute_statement(statement, cancel, -1, &rows);
+            }
+            duckdb_destroy_prepare(&statement);
+            query_release_connection(connection);
+        }
+        query_leave_namespace(slot);
+    }
+
+    g_free(command);
+    query_free_objects(&objects);
+    if (state == DuckDBError) {
+        status = query_cancel_status(cancel);
+
+        unlink(tmp_path);
+        return status ? status : KV_ERROR_QUERY;
+    }
+    return kv_shadow_commit(bus_number, namespace_id, key, key_length, generation, tmp_path) ?
+           0 : KV_ERROR_FILE_WRITE;
+}
+
+/* runs the query into an anonymous memory file, returned in *result_fd
+ * along with the size of the result and the number of rows
+ */
+static int
+query_run_memfd(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                size_t key_length, bool key_prefix, char *sql, size_t *output_len,
+                Query_Data_Type input_format, Query_Data_Type output_format,
+                bool use_csv_headers_input, bool use_csv_headers_output, QueryCancel *cancel,
+                int *result_fd, uint64_t *rows) {
+    // duckdb copies the result into an anonymous memory file
+    int fd = qemu_memfd_create("kv-query-result", 0, false, 0, 0, NULL);
+    if (fd < 0) {
+        return KV_ERROR_CANNOT_OPEN;
+    }
+    int status = query_copy_to_fd(bus_number, namespace_id, key, key_length, key_prefix, sql,
+                                  input_format, output_format, use_csv_headers_input,
+                                  use_csv_headers_output, cancel, fd, rows);
+    if (status) {
+        close(fd);
+        return status;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return KV_ERROR_FILE_READ;
+    }
+    *output_len = st.st_size;
+    *result_fd = fd;
+    return 0;
+}
+
+/* query_run() also returning the number of rows */
+static int
+query_run_rows(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+               size_t key_length, bool key_prefix, char *sql, size_t *output_len,
+               Query_Data_Type input_format, Query_Data_Type output_format,
+               bool use_csv_headers_input, bool use_csv_headers_output, QueryCancel *cancel,
+               unsigned char **result, uint64_t *rows) {
+    int result_fd;
+    int status = query_run_memfd(bus_number, namespace_id, key, key_length, key_prefix, sql,
+                                 output_len, input_format, output_format,
+                                 use_csv_headers_input, use_csv_headers_output, cancel,
+                                 &result_fd, rows);
+    if (status) {
+        return status;
+    }
+
+    unsigned char *buffer = malloc(*output_len);
     if (buffer == NULL) {
-        fclose(file);
-        remove(result_path);
+        close(result_fd);
         return KV_ERROR_MEMORY_ALLOCATION;
     }
-    size_t read_bytes = fread(buffer, sizeof(char), file_size, file);
-    if (read_bytes != file_size) {
+    struct iovec iov = { .iov_base = buffer, .iov_len = *output_len };
+    ssize_t read_bytes = kv_readv_full(result_fd, &iov, 1, 0);
+    close(result_fd);
+    if (read_bytes != *output_len) {
         free(buffer);
-        fclose(file);
-        remove(result_path);
         return KV_ERROR_FILE_READ;
     }
-    fclose(file);
-    *output_len = read_bytes;
     *result = buffer;
-    remove(result_path);
     return 0;
 }
+
+int
+query_run(uint32_t bus_number, uint32_t namespace_id, unsigned char *key, size_t key_length,
+          bool key_prefix, char *sql, size_t *output_len, Query_Data_Type input_format,
+          Query_Data_Type output_format, bool use_csv_headers_input,
+          bool use_csv_headers_output, QueryCancel *cancel, unsigned char **result) {
+    uint64_t rows;
+
+    return query_run_rows(bus_number, namespace_id, key, key_length, key_prefix, sql,
+                          output_len, input_format, output_format, use_csv_headers_input,
+                          use_csv_headers_output, cancel, result, &rows);
+}
+
+int
+query_run_into(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+               size_t key_length, bool key_prefix, char *sql, Query_Data_Type input_format,
+               Query_Data_Type output_format, bool use_csv_headers_input,
+               bool use_csv_headers_output, QueryCancel *cancel, unsigned char *into_key,
+               size_t into_key_length, uint64_t *rows, size_t *output_len) {
+    int result_fd;
+    int status = query_run_memfd(bus_number, namespace_id, key, key_length, key_prefix, sql,
+                                 output_len, input_format, output_format,
+                                 use_csv_headers_input, use_csv_headers_output, cancel,
+                                 &result_fd, rows);
+    if (status) {
+        return status;
+    }
+
+    /* the first chunk replaces the object and the others are appended, so
+     * the result is never held in memory twice
+     */
+    g_autofree unsigned char *chunk = g_malloc(MIN(*output_len, QUERY_INTO_CHUNK));
+    size_t offset = 0;
+    do {
+        struct iovec iov = {
+            .iov_base = chunk,
+            .iov_len = MIN(*output_len - offset, QUERY_INTO_CHUNK),
+        };
+        if (kv_readv_full(result_fd, &iov, 1, offset) != (ssize_t)iov.iov_len) {
+            status = KV_ERROR_FILE_READ;
+            break;
+        }
+        ssize_t stored = store_object_iov(bus_number, namespace_id, into_key, into_key_length,
+                                          &iov, 1, offset > 0, false, false);
+        if (stored < 0) {
+            status = stored;
+            break;
+        }
+        offset += iov.iov_len;
+    } while (offset < *output_len);
+    close(result_fd);
+    if (status && offset) {
+        /* not left with part of the result */
+        delete_object(bus_number, namespace_id, into_key, into_key_length);
+    }
+    return status;
+}
+
+int
+query_run_to_fd(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                size_t key_length, bool key_prefix, char *sql, Query_Data_Type input_format,
+                Query_Data_Type output_format, bool use_csv_headers_input,
+                bool use_csv_headers_output, QueryCancel *cancel, int fd) {
+    uint64_t rows;
+
+    if (output_format != QUERY_TYPE_PARQUET) {
+        return query_copy_to_fd(bus_number, namespace_id, key, key_length, key_prefix, sql,
+                                input_format, output_format, use_csv_headers_input,
+                                use_csv_headers_output, cancel, fd, &rows);
+    }
+    // the parquet writer seeks back and syncs its output, which a pipe cannot do
+    size_t output_len;
+    unsigned char *result;
+    int status = query_run(bus_number, namespace_id, key, key_length, key_prefix, sql,
+                           &output_len, input_format, output_format, use_csv_headers_input,
+                           use_csv_headers_output, cancel, &result);
+    if (status) {
+        return status;
+    }
+    struct iovec iov = { .iov_base = result, .iov_len = output_len };
+    status = kv_writev_full(fd, &iov, 1, -1) ? KV_ERROR_FILE_WRITE : 0;
+    free(result);
+    return status;
+}
+
+int
+run_query(uint32_t bus_number, uint32_t namespace_id, unsigned char *key, size_t key_length,
+          char *sql, size_t *output_len, Query_Data_Type input_format,
+          Query_Data_Type output_format, bool use_csv_headers_input,
+          bool use_csv_headers_output, unsigned char **result) {
+    return query_run(bus_number, namespace_id, key, key_length, false, sql, output_len,
+                     input_format, output_format, use_csv_headers_input,
+                     use_csv_headers_output, NULL, result);
+}
+
+int
+run_query_to_fd(uint32_t bus_number, uint32_t namespace_id, unsigned char *key,
+                size_t key_length, char *sql, Query_Data_Type input_format,
+                Query_Data_Type output_format, bool use_csv_headers_input,
+                bool use_csv_headers_output, int fd) {
+    return query_run_to_fd(bus_number, namespace_id, key, key_length, false, sql, input_format,
+                           output_format, use_csv_headers_input, use_csv_headers_output, NULL,
+                           fd);
+}
+
+int
+run_query_prefix(uint32_t bus_number, uint32_t namespace_id, unsigned char *key_prefix,
+                 size_t key_prefix_length, char *sql, size_t *output_len,
+                 Query_Data_Type input_format, Query_Data_Type output_format,
+                 bool use_csv_headers_input, bool use_csv_headers_output,
+                 unsigned char **result) {
+    return query_run(bus_number, namespace_id, key_prefix, key_prefix_length, true, sql,
+                     output_len, input_format, output_format, use_csv_headers_input,
+                     use_csv_headers_output, NULL, result);
+}
+
+int
+run_query_prefix_to_fd(uint32_t bus_number, uint32_t namespace_id, unsigned char *key_prefix,
+                       size_t key_prefix_length, char *sql, Query_Data_Type input_format,
+                       Query_Data_Type output_format, bool use_csv_headers_input,
+                       bool use_csv_headers_output, int fd) {
+    return query_run_to_fd(bus_number, namespace_id, key_prefix, key_prefix_length, true, sql,
+                           input_format, output_format, use_csv_headers_input,
+                           use_csv_headers_output, NULL, fd);
+}
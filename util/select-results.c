@@ -6,101 +6,429 @@
  * Written by Chia-Lin Wu <cwu@airmettle.com>
  *
  * This code is licensed under the GNU GPL v2 or later.
- */ 
+ */
 
-#include "qemu/select-results.h"
 #include "qemu/osdep.h"
+#include "qemu/select-results.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
 #include "qemu/main-loop.h"
+#include "qemu/queue.h"
+#include "qemu/units.h"
+#include "qemu/kv_utils.h"
 
-#define SELECT_NUM_CACHE_ENTRIES 32
+#define SELECT_RESULTS_MEMORY (256 * MiB)
+/* seconds a result is kept after it was last accessed */
+#define SELECT_RESULTS_TTL 600
+/* how much of a streamed result may be produced ahead of the host */
+#define SELECT_STREAM_PIPE_SIZE (1 * MiB)
 
-typedef struct select_store_data_entry {
-    unsigned char *data;
-    size_t data_len;
+typedef struct SelectResult {
     uint32_t id;
-    uint32_t last_id;
-    bool in_use;
-} select_store_data_entry;
+    /* immutable, retrieves share it instead of copying */
+    GBytes *data;
+    /* unlinked scratch file of a result that did not fit the budget, -1 otherwise */
+    int spill_fd;
+    size_t size;
+    /* read end of the pipe of a streamed result, -1 for stored results */
+    int fd;
+    /* bytes of the stream returned so far */
+    size_t consumed;
+    /* the query wrote all of the stream, with status */
+    bool finished;
+    int status;
+    void *owner;
+    SelectStreamReadyFunc *ready;
+    void *ready_opaque;
+    int64_t last_access;
+    QTAILQ_ENTRY(SelectResult) lru;
+} SelectResult;
 
-static select_store_data_entry data_cache[SELECT_NUM_CACHE_ENTRIES];
+static GHashTable *results;
+/* least recently accessed first */
+static QTAILQ_HEAD(, SelectResult) lru = QTAILQ_HEAD_INITIALIZER(lru);
+/* bytes of the results held in memory */
+static uint64_t memory_used;
+static uint64_t memory_budget;
+/* in microseconds, 0 keeps results until they are retrieved */
+static int64_t ttl;
+static char *spill_dir;
 static uint32_t next_id;
 static QemuMutex select_mutex;
 static bool init;
 
+static uint64_t select_results_size_env(const char *name, uint64_t default_value) {
+    const char *env = getenv(name);
+    uint64_t size;
+
+    if (!env) {
+        return default_value;
+    }
+    if (qemu_strtosz(env, NULL, &size)) {
+        warn_report("%s: invalid size '%s'", name, env);
+        return default_value;
+    }
+    return size;
+}
+
 void select_results_init(void) {
-    select_store_data_entry *entry;
+    const char *ttl_env = getenv("KV_SELECT_RESULTS_TTL");
+    const char *dir_env = getenv("KV_SELECT_RESULTS_DIR");
+
     if (init) {
         return;
     }
     init = true;
     qemu_mutex_init(&select_mutex);
-    for (int i = 0; i < SELECT_NUM_CACHE_ENTRIES; i++) {
-        entry = &data_cache[i];
-        entry->last_id = i;
+    results = g_hash_table_new(g_direct_hash, g_direct_equal);
+    memory_budget = select_results_size_env("KV_SELECT_RESULTS_MEMORY", SELECT_RESULTS_MEMORY);
+    ttl = SELECT_RESULTS_TTL * G_USEC_PER_SEC;
+    if (ttl_env) {
+        int seconds = atoi(ttl_env);
+        ttl = seconds < 0 ? ttl : seconds * G_USEC_PER_SEC;
+    }
+    spill_dir = g_strdup(dir_env ? dir_env : g_get_tmp_dir());
+}
+
+/* called with select_mutex held */
+static SelectResult *select_results_lookup_locked(uint32_t id) {
+    return g_hash_table_lookup(results, GUINT_TO_POINTER(id));
+}
+
+/* called with select_mutex held */
+static void select_results_touch_locked(SelectResult *result) {
+    result->last_access = g_get_monotonic_time();
+    QTAILQ_REMOVE(&lru, result, lru);
+    QTAILQ_INSERT_TAIL(&lru, result, lru);
+}
+
+/* called with select_mutex held, adds an entry under an unused id */
+static SelectResult *select_results_add_locked(void) {
+    SelectResult *result = g_new0(SelectResult, 1);
+
+    do {
+        next_id++;
+    } while (!next_id || select_results_lookup_locked(next_id));
+    result->id = next_id;
+    result->spill_fd = -1;
+    result->fd = -1;
+    result->last_access = g_get_monotonic_time();
+    g_hash_table_insert(results, GUINT_TO_POINTER(result->id), result);
+    QTAILQ_INSERT_TAIL(&lru, result, lru);
+    return result;
+}
+
+/* called with select_mutex held; frees the entry and hands back the waiter
+ * of a stream, which is called once the mutex is dropped
+ */
+static void select_results_release_locked(SelectResult *result,
+                                          SelectStreamReadyFunc **ready, void **ready_opaque) {
+    g_hash_table_remove(results, GUINT_TO_POINTER(result->id));
+    QTAILQ_REMOVE(&lru, result, lru);
+    if (result->data) {
+        memory_used -= result->size;
+        g_bytes_unref(result->data);
+    }
+    if (result->spill_fd >= 0) {
+        close(result->spill_fd);
+    }
+    if (result->fd >= 0) {
+        if (result->ready) {
+            qemu_set_fd_handler(result->fd, NULL, NULL, NULL);
+        }
+        close(result->fd);
+    }
+    *ready = result->ready;
+    *ready_opaque = result->ready_opaque;
+    g_free(result);
+}
+
+/* called with select_mutex held, frees the results not accessed within the
+ * TTL; streams a read is waiting for are kept
+ */
+static void select_results_expire_locked(void) {
+    int64_t now = g_get_monotonic_time();
+    SelectResult *result, *next;
+    SelectStreamReadyFunc *ready;
+    void *ready_opaque;
+
+    if (!ttl) {
+        return;
     }
+    QTAILQ_FOREACH_SAFE(result, &lru, lru, next) {
+        if (now - result->last_access < ttl) {
+            break;
+        }
+        if (!result->ready) {
+            select_results_release_locked(result, &ready, &ready_opaque);
+        }
+    }
+}
+
+/* writes a result to an unlinked file in the scratch directory,
+ * returns its fd or -1
+ */
+static int select_results_spill(const unsigned char *data, size_t len) {
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    int fd = -1;
+
+#ifdef O_TMPFILE
+    fd = open(spill_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+    if (fd < 0) {
+        char *path = g_strdup_printf("%s/kv-select-XXXXXX", spill_dir);
+        fd = g_mkstemp_full(path, O_RDWR | O_CLOEXEC, 0600);
+        if (fd >= 0) {
+            unlink(path);
+        }
+        g_free(path);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    if (kv_writev_full(fd, &iov, 1, 0)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+uint32_t select_results_store(unsigned char *data, size_t data_len) {
+    int spill_fd = -1;
+
+    qemu_mutex_lock(&select_mutex);
+    select_results_expire_locked();
+    /* reserve the memory up front, a spill is written without the lock */
+    bool in_memory = memory_used + data_len <= memory_budget;
+    if (in_memory) {
+        memory_used += data_len;
+    }
+    qemu_mutex_unlock(&select_mutex);
+
+    if (!in_memory) {
+        spill_fd = select_results_spill(data, data_len);
+        g_free(data);
+        if (spill_fd < 0) {
+            warn_report("cannot spill a SELECT result to %s: %s", spill_dir, strerror(errno));
+            return 0;
+        }
+    }
+
+    qemu_mutex_lock(&select_mutex);
+    SelectResult *result = select_results_add_locked();
+    result->size = data_len;
+    if (in_memory) {
+        result->data = g_bytes_new_take(data, data_len);
+    } else {
+        result->spill_fd = spill_fd;
+    }
+    uint32_t id = result->id;
+    qemu_mutex_unlock(&select_mutex);
+    return id;
 }
 
-uint32_t select_results_store(unsigned char *results, size_t results_len) {
-    select_store_data_entry *entry;
-    select_store_data_entry *oldest_entry = NULL;
+int select_results_retrieve(uint32_t id, size_t offset, size_t len, bool do_not_remove,
+                            bool do_not_remove_if_not_all_fetched, GBytes **window,
+                            size_t *total_size) {
+    SelectStreamReadyFunc *ready;
+    void *ready_opaque;
+    int spill_fd = -1;
 
+    *window = NULL;
+    *total_size = 0;
     qemu_mutex_lock(&select_mutex);
-    for (int i = 0; i < SELECT_NUM_CACHE_ENTRIES; i++) {
-        entry = &data_cache[next_id];
-        if (!entry->in_use) {
-            entry->in_use = true;
-            entry->data = results;
-            entry->data_len = results_len;
-            entry->id = entry->last_id + SELECT_NUM_CACHE_ENTRIES;
-            uint32_t id = entry->id;
-	    next_id = (next_id + 1) % SELECT_NUM_CACHE_ENTRIES;
+    select_results_expire_locked();
+    SelectResult *result = select_results_lookup_locked(id);
+    if (!result || result->fd >= 0) {
+        qemu_mutex_unlock(&select_mutex);
+        return KV_ERROR_FILE_NOT_FOUND;
+    }
+    offset = MIN(offset, result->size);
+    len = MIN(len, result->size - offset);
+    if (result->data) {
+        *window = g_bytes_new_from_bytes(result->data, offset, len);
+    } else {
+        /* the spill is read once the lock is dropped, through a duplicate
+         * that keeps the file open even if the result is freed meanwhile
+         */
+        spill_fd = dup(result->spill_fd);
+        if (spill_fd < 0) {
             qemu_mutex_unlock(&select_mutex);
-            return id;
+            return KV_ERROR_FILE_READ;
         }
-        if (!oldest_entry || (oldest_entry->id > entry->id)) {
-            oldest_entry = entry;
+    }
+    *total_size = result->size;
+    if (!do_not_remove &&
+        (!do_not_remove_if_not_all_fetched || result->size <= offset + len)) {
+        select_results_release_locked(result, &ready, &ready_opaque);
+    } else {
+        select_results_touch_locked(result);
+    }
+    qemu_mutex_unlock(&select_mutex);
+
+    if (spill_fd >= 0) {
+        /* only the requested part of a spilled result is read back */
+        unsigned char *buffer = g_malloc(len);
+        struct iovec iov = { .iov_base = buffer, .iov_len = len };
+        bool ok = kv_readv_full(spill_fd, &iov, 1, offset) == len;
+        close(spill_fd);
+        if (!ok) {
+            g_free(buffer);
+            *total_size = 0;
+            return KV_ERROR_FILE_READ;
         }
-	next_id = (next_id + 1) % SELECT_NUM_CACHE_ENTRIES;
+        *window = g_bytes_new_take(buffer, len);
     }
+    return 0;
+}
+
+/* called with select_mutex held */
+static SelectResult *select_results_find_stream_locked(uint32_t id) {
+    SelectResult *result = select_results_lookup_locked(id);
+    return result && result->fd >= 0 ? result : NULL;
+}
+
+uint32_t select_results_new_stream(void *owner, int *write_fd) {
+    int fds[2];
 
-    // nothing empty, use oldest
-    if (oldest_entry->data) {
-        g_free(oldest_entry->data);
+    if (!g_unix_open_pipe(fds, FD_CLOEXEC, NULL)) {
+        return 0;
+    }
+    if (!g_unix_set_fd_nonblocking(fds[0], true, NULL)) {
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
     }
-    oldest_entry->data = results;
-    oldest_entry->data_len = results_len;
-    oldest_entry->id = oldest_entry->id + SELECT_NUM_CACHE_ENTRIES;
-    uint32_t id = oldest_entry->id;
+#ifdef F_SETPIPE_SZ
+    /* the default size is kept if this exceeds the system limit */
+    fcntl(fds[0], F_SETPIPE_SZ, SELECT_STREAM_PIPE_SIZE);
+#endif
+
+    qemu_mutex_lock(&select_mutex);
+    select_results_expire_locked();
+    SelectResult *result = select_results_add_locked();
+    result->fd = fds[0];
+    result->owner = owner;
+    uint32_t id = result->id;
     qemu_mutex_unlock(&select_mutex);
+    *write_fd = fds[1];
     return id;
 }
 
-unsigned char *select_results_retrieve(uint32_t id, size_t *data_len,
-                                       bool do_not_remove,
-                                       bool do_not_remove_if_size_gt,
-                                       size_t size_check, bool *found) {
-    *data_len = 0;
-    *found = false;
+bool select_results_is_stream(uint32_t id) {
     qemu_mutex_lock(&select_mutex);
-    select_store_data_entry *entry = &data_cache[id % SELECT_NUM_CACHE_ENTRIES];
-    if (!entry->data || (entry->id != id)) {
+    bool is_stream = select_results_find_stream_locked(id);
+    qemu_mutex_unlock(&select_mutex);
+    return is_stream;
+}
+
+void select_results_finish_stream(uint32_t id, int status) {
+    qemu_mutex_lock(&select_mutex);
+    SelectResult *result = select_results_find_stream_locked(id);
+    if (result) {
+        result->finished = true;
+        result->status = status;
+    }
+    qemu_mutex_unlock(&select_mutex);
+}
+
+ssize_t select_results_read_stream(uint32_t id, size_t offset, unsigned char *buffer,
+                                   size_t len, bool *more) {
+    SelectStreamReadyFunc *ready = NULL;
+    void *ready_opaque;
+    ssize_t res = 0;
+
+    *more = false;
+    qemu_mutex_lock(&select_mutex);
+    SelectResult *result = select_results_find_stream_locked(id);
+    if (!result) {
         qemu_mutex_unlock(&select_mutex);
-        return NULL;
-    }
-    unsigned char *data = entry->data;
-    *data_len = entry->data_len;
-    if (!do_not_remove && (!do_not_remove_if_size_gt || (entry->data_len <= size_check))) {
-        entry->data_len = 0;
-        entry->data = NULL;
-        entry->last_id = entry->id;
-        entry->id = 0;
-        entry->in_use = false;
-    } else {
-        unsigned char *data_copy = g_malloc(entry->data_len);
-        memcpy(data_copy, data, entry->data_len);
-        data = data_copy;
+        return KV_ERROR_FILE_NOT_FOUND;
     }
+    /* the stream cannot be rewound, and only one read may wait for it */
+    if (offset != result->consumed || result->ready) {
+        qemu_mutex_unlock(&select_mutex);
+        return KV_ERROR_FILE_OFFSET;
+    }
+    *more = true;
+    while ((size_t)res < len) {
+        ssize_t n = read(result->fd, buffer + res, len - res);
+        if (n > 0) {
+            res += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            break;
+        }
+        /* the end of the stream, or it broke */
+        *more = false;
+        if (n < 0) {
+            res = KV_ERROR_PIPE;
+        } else if (!result->finished) {
+            res = KV_ERROR_PIPE;
+        } else if (result->status < 0) {
+            res = result->status;
+        }
+        select_results_release_locked(result, &ready, &ready_opaque);
+        break;
+    }
+    if (*more) {
+        result->consumed += res;
+        select_results_touch_locked(result);
+    }
+    qemu_mutex_unlock(&select_mutex);
+    assert(!ready);
+    return res;
+}
+
+static void select_results_stream_readable(void *opaque) {
+    SelectResult *result = opaque;
+
+    qemu_mutex_lock(&select_mutex);
+    SelectStreamReadyFunc *ready = result->ready;
+    void *ready_opaque = result->ready_opaque;
+    qemu_set_fd_handler(result->fd, NULL, NULL, NULL);
+    result->ready = NULL;
+    result->ready_opaque = NULL;
+    select_results_touch_locked(result);
     qemu_mutex_unlock(&select_mutex);
-    *found = true;
-    return data;
+    ready(ready_opaque);
+}
+
+bool select_results_wait_stream(uint32_t id, SelectStreamReadyFunc *ready, void *opaque) {
+    qemu_mutex_lock(&select_mutex);
+    SelectResult *result = select_results_find_stream_locked(id);
+    if (!result || result->ready) {
+        qemu_mutex_unlock(&select_mutex);
+        return false;
+    }
+    result->ready = ready;
+    result->ready_opaque = opaque;
+    qemu_set_fd_handler(result->fd, select_results_stream_readable, NULL, result);
+    qemu_mutex_unlock(&select_mutex);
+    return true;
+}
+
+void select_results_drop_streams(void *owner) {
+    SelectStreamReadyFunc *ready;
+    void *ready_opaque;
+    SelectResult *result;
+
+    do {
+        ready = NULL;
+        qemu_mutex_lock(&select_mutex);
+        QTAILQ_FOREACH(result, &lru, lru) {
+            if (result->fd >= 0 && result->owner == owner) {
+                select_results_release_locked(result, &ready, &ready_opaque);
+                break;
+            }
+        }
+        qemu_mutex_unlock(&select_mutex);
+        if (ready) {
+            ready(ready_opaque);
+        }
+    } while (result);
 }